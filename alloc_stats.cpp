@@ -0,0 +1,146 @@
+#include "alloc_stats.hpp"
+#include <atomic>
+#include <cstdlib>
+#include <new>
+
+//room in front of every block for its size and category.  16 bytes
+//keeps the block as aligned as malloc's.
+static const size_t header_size = 16;
+
+class atomic_counts {
+public:
+  std::atomic<uint64_t> allocations;
+  std::atomic<uint64_t> frees;
+  std::atomic<uint64_t> bytes_allocated;
+  std::atomic<int64_t> current_bytes;
+  std::atomic<int64_t> peak_bytes;
+};
+
+//zero-initialized before anything runs, so allocations made during
+//static initialization are counted too.
+static atomic_counts counts[ALLOC_CATEGORIES + 1];
+static const int total_index = ALLOC_CATEGORIES;
+
+static void raise_peak(atomic_counts &c, int64_t now)
+{
+  int64_t peak = c.peak_bytes.load(std::memory_order_relaxed);
+  while (now > peak &&
+	 !c.peak_bytes.compare_exchange_weak(peak, now, std::memory_order_relaxed))
+    ;
+}
+
+static void count_alloc(atomic_counts &c, uint64_t size)
+{
+  c.allocations.fetch_add(1, std::memory_order_relaxed);
+  c.bytes_allocated.fetch_add(size, std::memory_order_relaxed);
+  int64_t now = c.current_bytes.fetch_add(size, std::memory_order_relaxed) + size;
+  raise_peak(c, now);
+}
+
+static void count_free(atomic_counts &c, uint64_t size)
+{
+  c.frees.fetch_add(1, std::memory_order_relaxed);
+  c.current_bytes.fetch_sub(size, std::memory_order_relaxed);
+}
+
+void *operator new(size_t size)
+{
+  int category = alloc_category();
+  if (category < 0 || category >= ALLOC_CATEGORIES)
+    category = ALLOC_OTHER;
+  uint64_t *header = (uint64_t *)malloc(size + header_size);
+  if (header == NULL)
+    throw std::bad_alloc();
+  header[0] = size;
+  header[1] = category;
+  count_alloc(counts[category], size);
+  count_alloc(counts[total_index], size);
+  return (char *)header + header_size;
+}
+
+void *operator new(size_t size, const std::nothrow_t &) noexcept
+{
+  try {
+    return operator new(size);
+  } catch (std::bad_alloc &) {
+    return NULL;
+  }
+}
+
+void operator delete(void *p) noexcept
+{
+  if (p == NULL)
+    return;
+  uint64_t *header = (uint64_t *)((char *)p - header_size);
+  count_free(counts[header[1]], header[0]);
+  count_free(counts[total_index], header[0]);
+  free(header);
+}
+
+void operator delete(void *p, size_t) noexcept
+{
+  operator delete(p);
+}
+
+void operator delete(void *p, const std::nothrow_t &) noexcept
+{
+  operator delete(p);
+}
+
+static alloc_counts read_counts(const atomic_counts &c)
+{
+  alloc_counts r;
+  r.allocations = c.allocations;
+  r.frees = c.frees;
+  r.bytes_allocated = c.bytes_allocated;
+  r.current_bytes = c.current_bytes;
+  r.peak_bytes = c.peak_bytes;
+  return r;
+}
+
+alloc_stats alloc_stats::get(void)
+{
+  alloc_stats s;
+  for (int i = 0; i < ALLOC_CATEGORIES; i++)
+    s.categories[i] = read_counts(counts[i]);
+  s.total = read_counts(counts[total_index]);
+  return s;
+}
+
+void alloc_stats::reset_peaks(void)
+{
+  for (int i = 0; i <= ALLOC_CATEGORIES; i++)
+    counts[i].peak_bytes = counts[i].current_bytes.load();
+}
+
+const char *alloc_stats::category_name(int category)
+{
+  static const char *names[ALLOC_CATEGORIES] = { "other", "node", "swap_space", "io" };
+  return names[category];
+}
+
+void alloc_stats::print(FILE *out) const
+{
+  fprintf(out, "# %-10s %14s %14s %14s %14s\n", "heap", "current", "peak", "allocations", "frees");
+  for (int i = 0; i <= ALLOC_CATEGORIES; i++) {
+    const alloc_counts &c = i < ALLOC_CATEGORIES ? categories[i] : total;
+    fprintf(out, "# %-10s %14ld %14ld %14lu %14lu\n",
+	    i < ALLOC_CATEGORIES ? category_name(i) : "total",
+	    (long)c.current_bytes, (long)c.peak_bytes,
+	    (unsigned long)c.allocations, (unsigned long)c.frees);
+  }
+}
+
+void alloc_stats::print_per_op(FILE *out, const alloc_stats &before, uint64_t nops) const
+{
+  double n = nops ? nops : 1;
+  fprintf(out, "# %-10s %14s %14s\n", "per op", "allocations", "bytes");
+  for (int i = 0; i <= ALLOC_CATEGORIES; i++) {
+    const alloc_counts &c = i < ALLOC_CATEGORIES ? categories[i] : total;
+    const alloc_counts &b = i < ALLOC_CATEGORIES ? before.categories[i] : before.total;
+    fprintf(out, "# %-10s %14.2f %14.1f\n",
+	    i < ALLOC_CATEGORIES ? category_name(i) : "total",
+	    (c.allocations - b.allocations) / n,
+	    (c.bytes_allocated - b.bytes_allocated) / n);
+  }
+}
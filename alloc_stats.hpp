@@ -0,0 +1,85 @@
+// Heap accounting by category.
+//
+// Every thread has a current allocation category, which alloc_scope
+// sets for the length of a scope.  The betree charges what its nodes
+// hold (maps, keys and values) to ALLOC_NODE, and the swap space
+// charges its object table, descriptors and LRU queues to
+// ALLOC_SWAP_SPACE and serialized images (I/O buffers and the
+// compressed tier) to ALLOC_IO.  Everything else is ALLOC_OTHER.
+// Scopes nest: the swap space's scopes inside a betree operation
+// override the betree's until they end.
+//
+// The counting itself is done by the global operator new and delete
+// in alloc_stats.cpp, so only programs linked with alloc_stats.o count
+// anything; elsewhere a scope costs two thread-local stores.  Each
+// block carries a small header with its size and category, so a block
+// is credited back to the category that allocated it, wherever it is
+// freed.  Memory allocated with malloc() directly is not seen.
+
+#ifndef ALLOC_STATS_HPP
+#define ALLOC_STATS_HPP
+
+#include <cstdint>
+#include <cstdio>
+
+#define ALLOC_OTHER (0)
+#define ALLOC_NODE (1)
+#define ALLOC_SWAP_SPACE (2)
+#define ALLOC_IO (3)
+#define ALLOC_CATEGORIES (4)
+
+inline int &alloc_category(void)
+{
+  static thread_local int category = ALLOC_OTHER;
+  return category;
+}
+
+class alloc_scope
+{
+public:
+  alloc_scope(int category)
+    : saved(alloc_category())
+  {
+    alloc_category() = category;
+  }
+
+  ~alloc_scope(void)
+  {
+    alloc_category() = saved;
+  }
+
+private:
+  int saved;
+};
+
+class alloc_counts
+{
+public:
+  uint64_t allocations = 0;
+  uint64_t frees = 0;
+  uint64_t bytes_allocated = 0;
+  int64_t current_bytes = 0;
+  int64_t peak_bytes = 0;
+};
+
+class alloc_stats
+{
+public:
+  alloc_counts categories[ALLOC_CATEGORIES];
+  alloc_counts total;
+
+  // The counters now.  Only meaningful in programs linked with
+  // alloc_stats.o.
+  static alloc_stats get(void);
+  // Start the peaks again from the current sizes.
+  static void reset_peaks(void);
+  static const char *category_name(int category);
+
+  // Current and peak bytes, and allocations, by category.
+  void print(FILE *out) const;
+  // Allocations and bytes allocated per operation since before, by
+  // category.
+  void print_per_op(FILE *out, const alloc_stats &before, uint64_t nops) const;
+};
+
+#endif // ALLOC_STATS_HPP
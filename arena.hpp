@@ -0,0 +1,205 @@
+// A per-node arena for the containers a node holds.  The swap space's
+// shards also use one as a pool for their object descriptors, object
+// table entries and LRU queue nodes.
+//
+// An arena hands out blocks from a few large chunks, so filling a
+// node's maps (for instance when it is deserialized) costs a handful
+// of heap allocations instead of one per entry, and destroying the
+// node gives all the chunks back at once.  Freed blocks go on a free
+// list for their size class and are reused by later allocations of
+// that size, so a node that stays in memory while its maps churn does
+// not grow without bound.  Blocks larger than ARENA_MAX_BLOCK come
+// from the heap.
+//
+// arena_allocator<T> lets a standard container allocate from an
+// arena.  A default-constructed one has no arena and uses the heap, as
+// std::allocator does, and so does a copy of a container (see
+// select_on_container_copy_construction), so a map copied out of a
+// node never refers to that node's arena.  Containers with different
+// arenas must not be swapped.
+//
+// An arena is not thread-safe; a node's arena is only used by whoever
+// may modify the node, and a shard's under the shard lock.
+
+#ifndef ARENA_HPP
+#define ARENA_HPP
+
+#include <cstddef>
+#include <new>
+
+// Block sizes are rounded up to a multiple of ARENA_ALIGNMENT, which is
+// as aligned as operator new.
+#define ARENA_ALIGNMENT (16)
+#define ARENA_MAX_BLOCK (512)
+#define ARENA_SIZE_CLASSES (ARENA_MAX_BLOCK / ARENA_ALIGNMENT)
+// Each chunk is twice as big as the last, up to ARENA_MAX_CHUNK.
+#define ARENA_FIRST_CHUNK (2048)
+#define ARENA_MAX_CHUNK (65536)
+
+class arena
+{
+public:
+  arena(void)
+      : chunks(nullptr),
+        next(nullptr),
+        end(nullptr),
+        next_chunk_size(ARENA_FIRST_CHUNK),
+        bytes_reserved(0)
+  {
+    for (int i = 0; i < ARENA_SIZE_CLASSES; i++)
+      free_lists[i] = nullptr;
+  }
+
+  arena(const arena &) = delete;
+  arena &operator=(const arena &) = delete;
+
+  ~arena(void)
+  {
+    while (chunks)
+    {
+      chunk *prev = chunks->prev;
+      ::operator delete(chunks);
+      chunks = prev;
+    }
+  }
+
+  void *allocate(size_t bytes)
+  {
+    if (bytes == 0 || bytes > ARENA_MAX_BLOCK)
+      return ::operator new(bytes);
+    size_t c = size_class(bytes);
+    if (free_lists[c])
+    {
+      free_block *b = free_lists[c];
+      free_lists[c] = b->next;
+      return b;
+    }
+    size_t rounded = (c + 1) * ARENA_ALIGNMENT;
+    if ((size_t)(end - next) < rounded)
+      add_chunk();
+    void *p = next;
+    next += rounded;
+    return p;
+  }
+
+  void deallocate(void *p, size_t bytes)
+  {
+    if (bytes == 0 || bytes > ARENA_MAX_BLOCK)
+    {
+      ::operator delete(p);
+      return;
+    }
+    size_t c = size_class(bytes);
+    free_block *b = static_cast<free_block *>(p);
+    b->next = free_lists[c];
+    free_lists[c] = b;
+  }
+
+  // Bytes taken from the heap for chunks, including their headers.
+  size_t reserved(void) const
+  {
+    return bytes_reserved;
+  }
+
+private:
+  // Chunks are kept in a list through a header at their start, padded
+  // so that the blocks after it stay aligned.
+  class chunk
+  {
+  public:
+    chunk *prev;
+  };
+  static const size_t chunk_header =
+      (sizeof(chunk) + ARENA_ALIGNMENT - 1) / ARENA_ALIGNMENT * ARENA_ALIGNMENT;
+
+  class free_block
+  {
+  public:
+    free_block *next;
+  };
+
+  static size_t size_class(size_t bytes)
+  {
+    return (bytes - 1) / ARENA_ALIGNMENT;
+  }
+
+  // Whatever is left of the current chunk is not used again.
+  void add_chunk(void)
+  {
+    size_t size = next_chunk_size;
+    if (next_chunk_size < ARENA_MAX_CHUNK)
+      next_chunk_size *= 2;
+    chunk *ch = static_cast<chunk *>(::operator new(size));
+    ch->prev = chunks;
+    chunks = ch;
+    next = reinterpret_cast<char *>(ch) + chunk_header;
+    end = reinterpret_cast<char *>(ch) + size;
+    bytes_reserved += size;
+  }
+
+  free_block *free_lists[ARENA_SIZE_CLASSES];
+  chunk *chunks;
+  char *next;
+  char *end;
+  size_t next_chunk_size;
+  size_t bytes_reserved;
+};
+
+template <class T>
+class arena_allocator
+{
+public:
+  typedef T value_type;
+
+  arena_allocator(void)
+      : a(nullptr)
+  {
+  }
+
+  explicit arena_allocator(arena *ar)
+      : a(ar)
+  {
+  }
+
+  template <class U>
+  arena_allocator(const arena_allocator<U> &other)
+      : a(other.a)
+  {
+  }
+
+  T *allocate(size_t n)
+  {
+    if (a == nullptr)
+      return static_cast<T *>(::operator new(n * sizeof(T)));
+    return static_cast<T *>(a->allocate(n * sizeof(T)));
+  }
+
+  void deallocate(T *p, size_t n)
+  {
+    if (a == nullptr)
+      ::operator delete(p);
+    else
+      a->deallocate(p, n * sizeof(T));
+  }
+
+  arena_allocator select_on_container_copy_construction(void) const
+  {
+    return arena_allocator();
+  }
+
+  arena *a;
+};
+
+template <class T, class U>
+bool operator==(const arena_allocator<T> &x, const arena_allocator<U> &y)
+{
+  return x.a == y.a;
+}
+
+template <class T, class U>
+bool operator!=(const arena_allocator<T> &x, const arena_allocator<U> &y)
+{
+  return x.a != y.a;
+}
+
+#endif // ARENA_HPP
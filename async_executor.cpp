@@ -0,0 +1,140 @@
+#include "async_executor.hpp"
+#include <cassert>
+#include <chrono>
+
+//where a task is.
+#define TASK_QUEUED (0)
+#define TASK_RUNNING (1)
+#define TASK_WAITING (2)
+#define TASK_DONE (3)
+
+async_executor::async_executor(unsigned int nthreads)
+  : nstalled(0),
+    nwaiting(0),
+    nblocked(0),
+    nthreads(nthreads),
+    stopping(false)
+{
+  assert(nthreads > 0);
+  for (unsigned int i = 0; i < nthreads; i++)
+    workers.push_back(std::thread(&async_executor::worker_main, this));
+}
+
+//run_blocking() may start workers while we wait for the others.
+async_executor::~async_executor(void)
+{
+  std::unique_lock<std::mutex> lock(mtx);
+  stopping = true;
+  work_cond.notify_all();
+  while (!workers.empty()) {
+    std::thread w = std::move(workers.back());
+    workers.pop_back();
+    lock.unlock();
+    w.join();
+    lock.lock();
+  }
+}
+
+void async_executor::submit(async_executor::operation op)
+{
+  std::shared_ptr<task> t = std::make_shared<task>();
+  t->op = op;
+  t->state = TASK_QUEUED;
+  t->stalled = false;
+  t->woken = false;
+  //a task set aside is only reachable through its wake function, so
+  //that holds it; the cycle is broken when the task is done.
+  t->wake = [this, t]
+    {
+      wake(t);
+    };
+  std::lock_guard<std::mutex> lock(mtx);
+  queue.push_back(t);
+  work_cond.notify_one();
+}
+
+void async_executor::run_blocking(const std::function<void(void)> &f)
+{
+  {
+    std::lock_guard<std::mutex> lock(mtx);
+    nblocked++;
+    if (nblocked >= workers.size())
+      workers.push_back(std::thread(&async_executor::worker_main, this));
+  }
+  try {
+    f();
+  } catch (...) {
+    std::lock_guard<std::mutex> lock(mtx);
+    nblocked--;
+    throw;
+  }
+  std::lock_guard<std::mutex> lock(mtx);
+  nblocked--;
+}
+
+//requeue a task that was set aside.  If it is still running, its
+//worker requeues it when it returns.
+void async_executor::wake(const std::shared_ptr<task> &t)
+{
+  std::lock_guard<std::mutex> lock(mtx);
+  if (t->state == TASK_RUNNING) {
+    t->woken = true;
+  } else if (t->state == TASK_WAITING) {
+    nwaiting--;
+    t->state = TASK_QUEUED;
+    queue.push_back(t);
+    work_cond.notify_one();
+  }
+}
+
+//workers stay until nothing is queued or set aside, so a task woken
+//after the destructor started still runs.
+void async_executor::worker_main(void)
+{
+  std::unique_lock<std::mutex> lock(mtx);
+  while (true) {
+    work_cond.wait(lock, [this] { return !queue.empty() || (stopping && nwaiting == 0); });
+    if (queue.empty())
+      return;
+    std::shared_ptr<task> t = queue.front();
+    queue.pop_front();
+
+    if (t->stalled) {
+      t->stalled = false;
+      nstalled--;
+      //everything queued is waiting to be retried: give it time.
+      if (nstalled == queue.size()) {
+	lock.unlock();
+	std::this_thread::sleep_for(std::chrono::microseconds(DEFAULT_ASYNC_RETRY_USECS));
+	lock.lock();
+      }
+    }
+
+    t->state = TASK_RUNNING;
+    t->woken = false;
+    lock.unlock();
+    int r = t->op(t->wake);
+    //whatever a finished operation holds may take other locks as it
+    //goes, so it goes before we take mtx.
+    if (r == ASYNC_DONE) {
+      t->op = operation();
+      t->wake = wake_function();
+    }
+    lock.lock();
+    if (r == ASYNC_RETRY || (r == ASYNC_WAITING && t->woken)) {
+      t->state = TASK_QUEUED;
+      t->stalled = r == ASYNC_RETRY;
+      if (t->stalled)
+	nstalled++;
+      queue.push_back(t);
+      work_cond.notify_one();
+    } else if (r == ASYNC_WAITING) {
+      t->state = TASK_WAITING;
+      nwaiting++;
+    } else {
+      t->state = TASK_DONE;
+      if (stopping && nwaiting == 0 && queue.empty())
+	work_cond.notify_all();
+    }
+  }
+}
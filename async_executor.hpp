@@ -0,0 +1,93 @@
+// A small executor for operations that must not block on the disk.
+//
+// An operation is a function that does as much of its work as it can
+// without waiting for I/O.  It returns ASYNC_DONE once it has
+// finished.  If it stopped because it needs something that is still
+// on disk, it returns ASYNC_WAITING after arranging for the wake
+// function it was given to be called once that is ready (see
+// swap_space::fetch()), and the executor sets it aside until then,
+// running other operations meanwhile.  If there is nothing to wait
+// on (e.g. a latch it could not take), it returns ASYNC_RETRY and is
+// retried in turn; when nothing but retries is queued, a worker
+// sleeps for a moment between them instead of spinning.  Either way
+// the operation is called again later to pick up where it left off.
+// An operation that cannot avoid blocking does so in run_blocking(),
+// so that those set aside still get a worker when they are woken.
+//
+// Destroying the executor waits for every submitted operation to
+// finish, including those set aside.
+
+#ifndef ASYNC_EXECUTOR_HPP
+#define ASYNC_EXECUTOR_HPP
+
+#include <cstdint>
+#include <deque>
+#include <memory>
+#include <vector>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <condition_variable>
+
+// How long a worker sleeps when every queued operation is waiting to
+// be retried.
+#define DEFAULT_ASYNC_RETRY_USECS (20)
+
+// What an operation returns.
+#define ASYNC_DONE (0)
+#define ASYNC_WAITING (1)
+#define ASYNC_RETRY (2)
+
+class async_executor
+{
+public:
+  // wake may be called from any thread, at most once per
+  // ASYNC_WAITING, and only for an operation that returns
+  // ASYNC_WAITING.
+  typedef std::function<void(void)> wake_function;
+  typedef std::function<int(const wake_function &wake)> operation;
+
+  async_executor(unsigned int nthreads);
+  ~async_executor(void);
+
+  void submit(operation op);
+
+  // Run f, which may block, from inside an operation.  If every other
+  // worker is blocked too, another is started first; it stays until
+  // the executor is destroyed.
+  void run_blocking(const std::function<void(void)> &f);
+
+  unsigned int size(void) const { return nthreads; }
+
+private:
+  class task
+  {
+  public:
+    operation op;
+    wake_function wake;
+    int state;
+    // Did the last attempt return ASYNC_RETRY?
+    bool stalled;
+    // Was it woken while it was still running?
+    bool woken;
+  };
+
+  void worker_main(void);
+  void wake(const std::shared_ptr<task> &t);
+
+  std::mutex mtx;
+  std::condition_variable work_cond;
+  std::deque<std::shared_ptr<task>> queue;
+  // Number of stalled tasks in queue.
+  uint64_t nstalled;
+  // Number of tasks set aside until they are woken.
+  uint64_t nwaiting;
+  // Workers, including those started by run_blocking(), and how many
+  // of them are in run_blocking().
+  std::vector<std::thread> workers;
+  unsigned int nblocked;
+  unsigned int nthreads;
+  bool stopping;
+};
+
+#endif // ASYNC_EXECUTOR_HPP
@@ -1,16 +1,79 @@
 #include "backing_store.hpp"
 #include <iostream>
 #include <ext/stdio_filebuf.h>
+#include <iterator>
 #include <unistd.h>
+#include <fcntl.h>
+#include <cerrno>
 #include <cassert>
 
+////////////////////////////////////////////////////
+// Default (synchronous) asynchronous I/O interface //
+////////////////////////////////////////////////////
+void backing_store::submit(io_request *req)
+{
+  count_request(req);
+  std::iostream *ios = get(req->obj_id, req->version);
+  if (req->op == IO_READ) {
+    req->buffer.assign(std::istreambuf_iterator<char>(ios->rdbuf()),
+                       std::istreambuf_iterator<char>());
+  } else {
+    ios->write(req->buffer.data(), req->buffer.size());
+  }
+  put(ios);
+  req->done = true;
+}
+
+void backing_store::wait(io_request *req)
+{
+  assert(req->done);
+}
+
+bool backing_store::poll(io_request *req)
+{
+  return req->done;
+}
+
+bool backing_store::notify(io_request *req, std::function<void(void)> callback)
+{
+  assert(req->done);
+  (void)callback;
+  return false;
+}
+
+void backing_store::count_request(const io_request *req)
+{
+  if (req->op == IO_READ) {
+    reads++;
+  } else {
+    writes++;
+    bytes_written += req->buffer.size();
+  }
+}
+
+backing_store::io_counters backing_store::get_io_counters(void) const
+{
+  io_counters c;
+  c.reads = reads;
+  c.writes = writes;
+  c.bytes_written = bytes_written;
+  return c;
+}
+
 /////////////////////////////////////////////////////////////
 // Implementation of the one_file_per_object_backing_store //
 /////////////////////////////////////////////////////////////
-one_file_per_object_backing_store::one_file_per_object_backing_store(std::string rt)
-  : root(rt)
+one_file_per_object_backing_store::one_file_per_object_backing_store(std::string rt, bool allow_uring)
+  : root(rt),
+    engine(io_engine::create(allow_uring)),
+    sync_writes(false)
 {}
 
+one_file_per_object_backing_store::~one_file_per_object_backing_store(void)
+{
+  delete engine;
+}
+
 //allocate space for a new version of an object
 //requires that version be >> any previous version
 //logic for this is now handled by the swap space
@@ -50,15 +113,96 @@ void one_file_per_object_backing_store::put(std::iostream *ios)
 {
   ios->flush();
   __gnu_cxx::stdio_filebuf<char> *fb = (__gnu_cxx::stdio_filebuf<char> *)ios->rdbuf();
-  fsync(fb->fd());
+  if (sync_writes)
+    fsync(fb->fd());
   delete ios;
   delete fb;
 }
 
 
+//open the file for a version and hand the request to the I/O engine.
+void one_file_per_object_backing_store::submit(io_request *req)
+{
+  count_request(req);
+  req->sync = req->op == IO_WRITE && sync_writes;
+  std::string filename = get_filename(req->obj_id, req->version);
+  int flags = req->op == IO_READ ? O_RDONLY : (O_WRONLY | O_CREAT | O_TRUNC);
+  req->fd = open(filename.c_str(), flags, 0644);
+  if (req->fd < 0) {
+    req->error = errno;
+    req->done = true;
+    return;
+  }
+  engine->submit(req);
+}
+
+void one_file_per_object_backing_store::wait(io_request *req)
+{
+  engine->wait(req);
+}
+
+bool one_file_per_object_backing_store::poll(io_request *req)
+{
+  return engine->poll(req);
+}
+
+bool one_file_per_object_backing_store::notify(io_request *req, std::function<void(void)> callback)
+{
+  return engine->notify(req, callback);
+}
+
 //Given an object and version, return the filename corresponding to it.
 std::string one_file_per_object_backing_store::get_filename(uint64_t obj_id, uint64_t version){
 
   return root + "/" + std::to_string(obj_id) + "_" + std::to_string(version);
 
 }
+
+
+///////////////////////////////////////////////////
+// Implementation of the in_memory_backing_store //
+///////////////////////////////////////////////////
+void in_memory_backing_store::allocate(uint64_t obj_id, uint64_t version)
+{
+  std::lock_guard<std::mutex> lock(mtx);
+  versions[std::make_pair(obj_id, version)];
+}
+
+void in_memory_backing_store::deallocate(uint64_t obj_id, uint64_t version)
+{
+  std::lock_guard<std::mutex> lock(mtx);
+  size_t erased = versions.erase(std::make_pair(obj_id, version));
+  assert(erased == 1);
+  (void)erased;
+}
+
+std::iostream * in_memory_backing_store::get(uint64_t obj_id, uint64_t version)
+{
+  std::lock_guard<std::mutex> lock(mtx);
+  auto it = versions.find(std::make_pair(obj_id, version));
+  assert(it != versions.end());
+  return new version_stream(obj_id, version, it->second);
+}
+
+//store whatever was written through the stream.
+void in_memory_backing_store::put(std::iostream *ios)
+{
+  version_stream *vs = (version_stream *)ios;
+  std::lock_guard<std::mutex> lock(mtx);
+  versions[std::make_pair(vs->obj_id, vs->version)] = vs->str();
+  delete vs;
+}
+
+void in_memory_backing_store::submit(io_request *req)
+{
+  count_request(req);
+  std::lock_guard<std::mutex> lock(mtx);
+  auto it = versions.find(std::make_pair(req->obj_id, req->version));
+  if (it == versions.end())
+    req->error = ENOENT;
+  else if (req->op == IO_READ)
+    req->buffer = it->second;
+  else
+    it->second = req->buffer;
+  req->done = true;
+}
@@ -7,28 +7,102 @@
 #include <cstdint>
 #include <cstddef>
 #include <iostream>
+#include <atomic>
+#include <map>
+#include <mutex>
+#include <sstream>
+#include "io_engine.hpp"
 
 class backing_store
 {
 public:
+  virtual ~backing_store(void) {}
   virtual void allocate(uint64_t obj_id, uint64_t version) = 0;
   virtual void deallocate(uint64_t obj_id, uint64_t version) = 0;
   virtual std::iostream *get(uint64_t obj_id, uint64_t version) = 0;
   virtual void put(std::iostream *ios) = 0;
+
+  // Asynchronous whole-object reads and writes (see io_engine.hpp).
+  // A version must be allocated before it is written, and a write
+  // must be done before the same version is read or deallocated.
+  // The defaults run the request synchronously through get()/put().
+  virtual void submit(io_request *req);
+  virtual void wait(io_request *req);
+  virtual bool poll(io_request *req);
+  virtual bool notify(io_request *req, std::function<void(void)> callback);
+
+  // Requests submitted so far, and the bytes they asked to write.
+  class io_counters {
+  public:
+    uint64_t reads = 0;
+    uint64_t writes = 0;
+    uint64_t bytes_written = 0;
+  };
+  io_counters get_io_counters(void) const;
+
+protected:
+  // Implementations of submit() call this for every request.
+  void count_request(const io_request *req);
+
+private:
+  std::atomic<uint64_t> reads{0};
+  std::atomic<uint64_t> writes{0};
+  std::atomic<uint64_t> bytes_written{0};
 };
 
 class one_file_per_object_backing_store : public backing_store
 {
 public:
-  one_file_per_object_backing_store(std::string rt);
+  one_file_per_object_backing_store(std::string rt, bool allow_uring = true);
+  ~one_file_per_object_backing_store(void);
   void allocate(uint64_t obj_id, uint64_t version);
   void deallocate(uint64_t obj_id, uint64_t version);
   std::iostream *get(uint64_t obj_id, uint64_t version);
   void put(std::iostream *ios);
+  void submit(io_request *req);
+  void wait(io_request *req);
+  bool poll(io_request *req);
+  bool notify(io_request *req, std::function<void(void)> callback);
   std::string get_filename(uint64_t obj_id, uint64_t version);
+  const char *io_engine_name(void) const { return engine->name(); }
+
+  // fsync every write before it counts as done.  Off by default, so
+  // a write-back costs no device flush.
+  void set_sync_writes(bool enable) { sync_writes = enable; }
 
 private:
   std::string root;
+  io_engine *engine;
+  bool sync_writes;
+};
+
+// Keeps every version in memory, for benchmarks that want the cost of
+// the swap space without the disk's.  Requests finish in submit().
+class in_memory_backing_store : public backing_store
+{
+public:
+  void allocate(uint64_t obj_id, uint64_t version);
+  void deallocate(uint64_t obj_id, uint64_t version);
+  std::iostream *get(uint64_t obj_id, uint64_t version);
+  void put(std::iostream *ios);
+  void submit(io_request *req);
+
+private:
+  class version_stream : public std::stringstream
+  {
+  public:
+    version_stream(uint64_t obj_id, uint64_t version, const std::string &data)
+        : std::stringstream(data),
+          obj_id(obj_id),
+          version(version)
+    {
+    }
+    uint64_t obj_id;
+    uint64_t version;
+  };
+
+  std::mutex mtx;
+  std::map<std::pair<uint64_t, uint64_t>, std::string> versions;
 };
 
 #endif // BACKING_STORE_HPP
@@ -50,6 +50,42 @@
 // clean in-memory node only requires a write-back, whereas flushing
 // to an on-disk node requires reading it in and writing it out.
 
+// Queries and scans may run in parallel with each other and with one
+// writer.  Writers (upserts) are serialized by a mutex and hold an
+// exclusive latch on every node they modify, from the root down.  A
+// query holds a shared latch on one node at a time: it latches the
+// child it descends into and then releases the parent (latch
+// crabbing), remembering the parent's updates for its key on the way
+// down.  Since a writer cannot get past a node a reader holds, and
+// messages only move down the tree, a reader always stays ahead of
+// any flush that started after it.  A scan step finds the next key
+// holding shared latches on the whole path, then reads all of that
+// key's messages in one crabbing walk down its path, so that a flush
+// or drain between two steps cannot split them.  The few queries that need to modify a
+// node (epsilon updates and adoptions in an adaptive tree) give up
+// their latches and rerun as writers.
+
+// Flushes into different children touch disjoint subtrees.  With a
+// flush pool (see set_flush_threads()), a node that has several
+// batches big enough to flush sends them down in parallel, and then
+// updates its pivots from the results while it still holds its own
+// latch.
+
+// With background maintenance (see set_maintenance_threads()),
+// upserts no longer flush.  An upsert latches the root, adds its
+// message to the root's buffer and, if the root is now over-full,
+// queues it.  Maintenance threads take queued nodes fullest first,
+// walk down to each one with exclusive latches (holding only the node
+// and its parent), move batches from it one level down, and queue any
+// child that ends up over-full.  Upserts may then run concurrently
+// with each other and with maintenance, and nodes may stay over-full
+// for a while; the max-size invariant above only holds once the queue
+// is empty.  If the root or the queue grows too large, upserts run
+// queued tasks themselves until maintenance catches up.
+
+#ifndef BETREE_HPP
+#define BETREE_HPP
+
 #include <cassert>
 #include <cmath>
 #include <math.h>
@@ -59,10 +95,25 @@
 #include <vector>
 #include <cassert>
 #include <algorithm>
+#include <mutex>
+#include <atomic>
+#include <functional>
+#include <set>
+#include <thread>
+#include <condition_variable>
+#include <future>
+#include <memory>
+#include <string>
+#include <cstdio>
 
 #include "swap_space.hpp"
 #include "backing_store.hpp"
 #include "window_stat_tracker.hpp"
+#include "worker_pool.hpp"
+#include "async_executor.hpp"
+#include "latency_histogram.hpp"
+#include "alloc_stats.hpp"
+#include "arena.hpp"
 ////////////////// Upserts
 
 // Internally, we store data indexed by both the user-specified key
@@ -151,6 +202,20 @@ bool operator==(const MessageKey<Key> &a, const MessageKey<Key> &b)
 #define DELETE (1)
 #define UPDATE (2)
 
+// Bytes of user data in a key or value, for write amplification (see
+// betree::print_io_stats()).  Overload it for other variable-length
+// types.
+template <class X>
+uint64_t payload_bytes(const X &x)
+{
+  return sizeof(x);
+}
+
+inline uint64_t payload_bytes(const std::string &x)
+{
+  return x.size();
+}
+
 template <class Value>
 class Message
 {
@@ -195,13 +260,71 @@ bool operator==(const Message<Value> &a, const Message<Value> &b)
 // Note: we will flush MIN_FLUSH_SIZE/2 items to a clean in-memory child.
 #define DEFAULT_MIN_FLUSH_SIZE (DEFAULT_MAX_NODE_SIZE / 16ULL)
 
+// Version of the node image written by node::_serialize(), recorded
+// at its start.  Version 1 added height and shape_epsilon.  Images
+// from before versioning (version 0) have neither, and a node's
+// height cannot be recovered without reading its whole subtree, so a
+// tree written by an older build cannot be loaded.
+#define NODE_FORMAT_VERSION (1)
+
+// How many children ahead of the current one we ask the swap_space to
+// prefetch during scans and cascading flushes.
+#define DEFAULT_PREFETCH_DEPTH (4)
+
+// Back-pressure for background maintenance (see
+// set_maintenance_threads()).  An upsert stops to run a maintenance
+// task itself when the root buffer holds more than this many times
+// its maximum, or when more than this many tasks are pending.
+#define DEFAULT_BACKPRESSURE_FACTOR (4)
+#define DEFAULT_MAX_PENDING_MAINTENANCE (256)
+
+// How many times query() tries the optimistic walk before it falls
+// back on latch crabbing (see set_optimistic_reads()).
+#define DEFAULT_OPTIMISTIC_QUERY_RETRIES (2)
+
+// Optimistic queries may not write to the nodes they read, so each
+// thread counts their reads in batches of this many (see
+// note_optimistic_read()).
+#define DEFAULT_OPTIMISTIC_READ_BATCH (32)
+
+// Operations whose latencies we record (see set_latency_tracking()).
+// A scan's seek (begin(), lower_bound() or upper_bound()) and each of
+// its steps are recorded separately.
+#define LATENCY_INSERT (0)
+#define LATENCY_UPDATE (1)
+#define LATENCY_ERASE (2)
+#define LATENCY_QUERY (3)
+#define LATENCY_SCAN (4)
+#define LATENCY_NEXT (5)
+#define LATENCY_OPS (6)
+
+// A trace hook (see set_trace_hook()) is called with the opcode of
+// every upsert, or this for a query.
+#define TRACE_QUERY (3)
+
+// Tree shape statistics (see betree::get_level_shape()) are kept for
+// this many levels, counted up from the leaves; anything higher is
+// counted in the top one.
+#define SHAPE_MAX_LEVELS (64)
+// Node epsilons are counted in this many equal buckets over [0, 1].
+#define SHAPE_EPSILON_BUCKETS (10)
+
+// Outcomes of one step of a concurrent query (see node::query_step).
+#define QUERY_DESCEND (0)
+#define QUERY_FOUND (1)
+#define QUERY_NOT_FOUND (2)
+#define QUERY_ESCALATE (3)
+
 template <class Key, class Value>
 class betree
 {
 private:
+  // Lets microbench.cpp time node operations on their own.
+  friend class betree_microbench;
   class node;
   // We let a swap_space handle all the I/O.
   typedef typename swap_space::pointer<node> node_pointer;
+  typedef typename swap_space::pin<node> node_pin;
   class child_info : public serializable
   {
   public:
@@ -232,17 +355,62 @@ private:
     node_pointer child;
     uint64_t child_size;
   };
-  typedef typename std::map<Key, child_info> pivot_map;
-  typedef typename std::map<MessageKey<Key>, Message<Value>> message_map;
+  // What a walk down one key's path learns about the next key: the
+  // first message after the key in the buffers it read, and the
+  // smallest key that the subtrees it passed by may hold.  If the
+  // message is below that bound, it starts the next key.
+  class scan_successor
+  {
+  public:
+    scan_successor(void)
+        : found(false), bounded(false)
+    {
+    }
+
+    void offer(const std::pair<MessageKey<Key>, Message<Value>> &m)
+    {
+      if (!found || m.first < next.first)
+        next = m;
+      found = true;
+    }
+
+    void limit(const Key &b)
+    {
+      if (!bounded || b < bound)
+        bound = b;
+      bounded = true;
+    }
+
+    bool found;
+    std::pair<MessageKey<Key>, Message<Value>> next;
+    bool bounded;
+    Key bound;
+  };
+
+  // A node's maps allocate from the node's arena (see arena.hpp).
+  // Maps built outside a node, and copies of a node's maps, use the
+  // heap.
+  typedef typename std::map<Key, child_info, std::less<Key>,
+                            arena_allocator<std::pair<const Key, child_info>>>
+      pivot_map;
+  typedef typename std::map<MessageKey<Key>, Message<Value>, std::less<MessageKey<Key>>,
+                            arena_allocator<std::pair<const MessageKey<Key>, Message<Value>>>>
+      message_map;
 
   class node : public serializable
   {
   private:
     // Init class for sliding window statistic tracker on the Tree
     // with default value for W value (size of sliding window)
-    window_stat_tracker stat_tracker;
+    // Concurrent queries count their reads under stats_mutex; writers
+    // hold the node exclusively and don't need it.
+    mutable window_stat_tracker stat_tracker;
+    mutable std::mutex stats_mutex;
 
   public:
+    // Holds the entries of pivots and elements, so it comes before
+    // them and outlives them.
+    arena contents;
     // Child pointers
     pivot_map pivots;
     message_map elements;
@@ -255,14 +423,33 @@ private:
     uint64_t max_pivots;
     uint64_t max_messages;
     uint64_t node_level;
-    uint64_t operation_count;
+    mutable uint64_t operation_count;
     uint64_t const ops_before_epsilon_update;
     uint64_t const window_size;
     uint64_t node_id;
     bool ready_for_adoption = false;
+    // Levels above the leaves (0 for a leaf).  After an adoption a
+    // node's children may differ in height; the node's is the largest.
+    // Adoptions further down are not passed up, so until a node next
+    // adopts this may overstate its height, never understate it.
+    uint64_t height = 0;
+
+    // What this node adds to the tree's shape statistics, as of the
+    // last note_shape().  A node is written out only after it has been
+    // noted, so these match what is read back, except for the epsilon
+    // bucket: epsilon loses precision on the way through the text
+    // serialization, so the bucket it was counted in is stored too.
+    bool shape_counted = false;
+    bool shape_retired = false;
+    uint64_t shape_height = 0;
+    uint64_t shape_pivots = 0;
+    uint64_t shape_messages = 0;
+    uint64_t shape_epsilon = 0;
 
     node()
-        : max_node_size(64), min_node_size(64 / 4), min_flush_size(64 / 16), epsilon(0.4), node_level(0), operation_count(0), ops_before_epsilon_update(100), window_size(100), node_id(-1)
+        : pivots(typename pivot_map::allocator_type(&contents)),
+          elements(typename message_map::allocator_type(&contents)),
+          max_node_size(64), min_node_size(64 / 4), min_flush_size(64 / 16), epsilon(0.4), node_level(0), operation_count(0), ops_before_epsilon_update(100), window_size(100), node_id(-1)
     {
       max_pivots = calculate_max_pivots();
       max_messages = max_node_size - max_pivots;
@@ -270,7 +457,9 @@ private:
     }
 
     node(float e, uint64_t level, uint64_t opsbeforeupdate = 100, uint64_t windowsize = 100)
-        : max_node_size(64), min_node_size(64 / 4), min_flush_size(64 / 16), epsilon(e), node_level(level), operation_count(0), ops_before_epsilon_update(opsbeforeupdate), window_size(windowsize), node_id(-1)
+        : pivots(typename pivot_map::allocator_type(&contents)),
+          elements(typename message_map::allocator_type(&contents)),
+          max_node_size(64), min_node_size(64 / 4), min_flush_size(64 / 16), epsilon(e), node_level(level), operation_count(0), ops_before_epsilon_update(opsbeforeupdate), window_size(windowsize), node_id(-1)
     {
       max_pivots = calculate_max_pivots();
       max_messages = max_node_size - max_pivots;
@@ -348,6 +537,40 @@ private:
           ready_for_adoption = true;
         }
       }
+      note_shape(bet);
+    }
+
+    // Bring the tree's shape statistics up to date with this node.
+    // Everything that changes a node's pivots, buffer, epsilon or
+    // height calls this before letting go of the node.
+    void note_shape(betree &bet)
+    {
+      if (shape_retired)
+        return;
+      uint64_t eps = bet.epsilon_bucket(epsilon);
+      if (shape_counted)
+      {
+        if (shape_height == height && shape_pivots == pivots.size() &&
+            shape_messages == elements.size() && shape_epsilon == eps)
+          return;
+        bet.count_shape(shape_height, -1, -(int64_t)shape_pivots, -(int64_t)shape_messages, shape_epsilon);
+      }
+      bet.count_shape(height, 1, pivots.size(), elements.size(), eps);
+      shape_counted = true;
+      shape_height = height;
+      shape_pivots = pivots.size();
+      shape_messages = elements.size();
+      shape_epsilon = eps;
+    }
+
+    // Take a node that has been split, merged or adopted away out of
+    // the statistics for good.
+    void retire_shape(betree &bet)
+    {
+      if (shape_counted)
+        bet.count_shape(shape_height, -1, -(int64_t)shape_pivots, -(int64_t)shape_messages, shape_epsilon);
+      shape_counted = false;
+      shape_retired = true;
     }
 
     // decrement node_level when adopted
@@ -356,13 +579,12 @@ private:
       node_level--;
     }
 
-    // add single read count to window stat tracker on this node
-    void add_read(betree &bet)
+    // periodically update epsilon.  Batches of reads counted under a
+    // shared latch (see note_reads()) may take operation_count past
+    // ops_before_epsilon_update.
+    void maybe_update_epsilon(betree &bet)
     {
-      stat_tracker.add_read();
-      operation_count += 1;
-      // periodically update epsilon
-      if (operation_count == ops_before_epsilon_update)
+      if (operation_count >= ops_before_epsilon_update)
       {
         float new_epsilon = stat_tracker.get_epsilon();
         set_epsilon(new_epsilon, bet);
@@ -370,18 +592,54 @@ private:
       }
     }
 
+    // add single read count to window stat tracker on this node
+    void add_read(betree &bet)
+    {
+      stat_tracker.add_read();
+      operation_count += 1;
+      maybe_update_epsilon(bet);
+    }
+
+    // Count a read made under a shared latch.  Returns false, without
+    // counting it, if this read would trigger an epsilon update; the
+    // caller must then redo the read exclusively.
+    bool note_read(void) const
+    {
+      std::lock_guard<std::mutex> lock(stats_mutex);
+      if (operation_count + 1 >= ops_before_epsilon_update)
+        return false;
+      stat_tracker.add_read();
+      operation_count += 1;
+      return true;
+    }
+
+    // Count n reads under a shared latch.  Returns true if an epsilon
+    // update is now due, which somebody holding the node exclusively
+    // has to run.
+    bool note_reads(uint64_t n) const
+    {
+      std::lock_guard<std::mutex> lock(stats_mutex);
+      for (uint64_t i = 0; i < n; i++)
+        stat_tracker.add_read();
+      operation_count += n;
+      return operation_count >= ops_before_epsilon_update;
+    }
+
     // add single write count to window stat tracker on this node
     void add_write(betree &bet)
     {
       stat_tracker.add_write();
       operation_count += 1;
-      // periodically update epsilon
-      if (operation_count == ops_before_epsilon_update)
-      {
-        float new_epsilon = stat_tracker.get_epsilon();
-        set_epsilon(new_epsilon, bet);
-        operation_count = 0;
-      }
+      maybe_update_epsilon(bet);
+    }
+
+    // True if flushing to this node will update its epsilon, which may
+    // have to pin every node below it.  Requires the node's exclusive
+    // latch.
+    bool epsilon_update_due(const betree &bet) const
+    {
+      return bet.is_dynamic && node_level <= bet.tunable_epsilon_level &&
+             operation_count + 1 >= ops_before_epsilon_update;
     }
 
     bool is_leaf(void) const
@@ -542,7 +800,7 @@ private:
       std::vector<uint64_t> cur_child_ids;
       for (auto it = pivots.begin(); it != pivots.end(); ++it)
       {
-        uint64_t cur_id = it->second.child->get_node_id();
+        uint64_t cur_id = it->second.child.read_pin()->get_node_id();
         cur_child_ids.push_back(cur_id);
       }
       uint64_t size_before_adopt = cur_child_ids.size();
@@ -555,7 +813,7 @@ private:
         auto it = pivots.begin();
         while (true)
         {
-          auto cur_id = it->second.child->get_node_id();
+          auto cur_id = it->second.child.read_pin()->get_node_id();
           if (cur_id == cur_child_ids[0])
           {
             break;
@@ -570,40 +828,53 @@ private:
         if (it != pivots.end())
         { // if not at end
 
+          // Latch the child before looking inside it.
+          auto child_to_erase = it->second.child; // the child whose grandchildren we'll adopt
+          node_pin child = child_to_erase.write_pin();
+
           // see if we can adopt all sibling grandchildren
-          if (((total_pivots - 1) + it->second.child->pivots.size()) > max_pivots)
+          if (((total_pivots - 1) + child->pivots.size()) > max_pivots)
           {
             continue; // don't adopt the set of grandchildren if it would result in > max_pivots
           }
 
-          auto child_to_erase = it->second.child; // the child whose grandchildren we'll adopt
-
           // Skip if child is leaf, there's no grandchildren to adopt
-          if (child_to_erase->is_leaf())
+          if (child->is_leaf())
           {
             continue;
           }
 
-          pivot_map grandchildren = child_to_erase->pivots; // granchildren of the child
+          pivot_map grandchildren = child->pivots; // granchildren of the child
 
           if (grandchildren.size() > 0)
           {
 
-    	    // apply all messages to this node
-	    message_map child_messages = child_to_erase->elements;
+    	    // apply all messages to this node.  The child's messages
+    	    // are older than ours, so they go in first and ours are
+    	    // applied on top of them again.
+	    message_map child_messages = child->elements;
+	    // Moved rather than swapped: our_messages keeps using our
+	    // arena.
+	    message_map our_messages(std::move(elements));
+	    elements.clear();
 	    for (auto eltit = child_messages.begin(); eltit != child_messages.end(); ++eltit) {
 		apply(eltit->first, eltit->second, bet.default_value);
 	    }
+	    for (auto eltit = our_messages.begin(); eltit != our_messages.end(); ++eltit) {
+		apply(eltit->first, eltit->second, bet.default_value);
+	    }
 
             // kill child
             pivots.erase(it);
-            child_to_erase->pivots.clear();
-            child_to_erase->elements.clear();
+            child->pivots.clear();
+            child->elements.clear();
+            child->retire_shape(bet);
+            child.release();
 
             // decrement node_level of adoptees
             for (auto adopt_it = grandchildren.begin(); adopt_it != grandchildren.end(); ++adopt_it)
             {
-              adopt_it->second.child->decrement_node_level();
+              adopt_it->second.child.write_pin()->decrement_node_level();
             }
 
             // adopt sibling grandchildren
@@ -620,14 +891,17 @@ private:
       }
 
       // After adoption, go through all children of this node and udpates child_size
+      // and our height, which drops if we adopted all our grandchildren.
+      height = 1;
       for (auto it = pivots.begin(); it != pivots.end(); ++it)
       {
-        it->second.child_size =
-            it->second.child->pivots.size() +
-            it->second.child->elements.size();
+        node_pin child = it->second.child.read_pin();
+        it->second.child_size = child->pivots.size() + child->elements.size();
+        height = std::max(height, child->height + 1);
       }
 
       ready_for_adoption = false;
+      note_shape(bet);
     }
     // --------------------------------------------------------------- //
 
@@ -669,6 +943,7 @@ private:
 
         auto new_node_id = bet.glob_id_inc++;
         new_node->set_node_id(new_node_id);
+        new_node->height = height;
 
         // If there are still pivots to move...
         // result[pivot_idx->first] = child_info(new_node, 0 + 0)
@@ -711,13 +986,17 @@ private:
       }
 
       for (auto it = result.begin(); it != result.end(); ++it)
+      {
         it->second.child_size = it->second.child->elements.size() +
                                 it->second.child->pivots.size();
+        it->second.child->note_shape(bet);
+      }
 
       assert(pivot_idx == pivots.end());
       assert(elt_idx == elements.end());
       pivots.clear();
       elements.clear();
+      retire_shape(bet);
       return result;
     }
 
@@ -730,6 +1009,7 @@ private:
       node_pointer new_node = bet.ss->allocate(new node(e, l, bet.ops_before_update, bet.window_size));
       auto new_node_id = bet.glob_id_inc++;
       new_node->set_node_id(new_node_id);
+      new_node->height = begin->second.child->height;
       for (auto it = begin; it != end; ++it)
       {
         new_node->elements.insert(it->second.child->elements.begin(),
@@ -737,6 +1017,7 @@ private:
         new_node->pivots.insert(it->second.child->pivots.begin(),
                                 it->second.child->pivots.end());
       }
+      new_node->note_shape(bet);
       return new_node;
     }
 
@@ -761,8 +1042,10 @@ private:
           node_pointer merged_node = merge(bet, beginit, endit);
           for (auto tmp = beginit; tmp != endit; ++tmp)
           {
-            tmp->second.child->elements.clear();
-            tmp->second.child->pivots.clear();
+            node_pin victim = tmp->second.child.write_pin();
+            victim->elements.clear();
+            victim->pivots.clear();
+            victim->retire_shape(bet);
           }
           Key key = beginit->first;
           pivots.erase(beginit, endit);
@@ -778,7 +1061,7 @@ private:
       // Recurse down to bottom of tree
       for (auto it = pivots.begin(); it != pivots.end(); ++it)
       {
-        it->second.child->flag_as_ready_for_adoption_recursive(bet);
+        it->second.child.write_pin()->flag_as_ready_for_adoption_recursive(bet);
       }
 	
       ready_for_adoption = true;
@@ -791,77 +1074,67 @@ private:
 	// recurse down
 	for (auto it = pivots.begin(); it != pivots.end(); ++it)
         {
-	   it->second.child->recursive_set_epsilon(bet, new_mav_pivots, new_max_messages, eps);
+	   it->second.child.write_pin()->recursive_set_epsilon(bet, new_mav_pivots, new_max_messages, eps);
 	}
 
 	// update
 	epsilon = eps;
 	max_pivots = new_mav_pivots;
 	max_messages = new_max_messages;
+	note_shape(bet);
     }
 
 
-    // recursive method to return the height of the tree
-    int tree_height_recursive(betree &bet, int currentLevel = 0)
+    // Find the child with the largest set of messages in our buffer,
+    // and collect the children with batches big enough to flush even
+    // if they are on disk (we are likely to flush to them next).
+    // Returns false if the largest batch is too small to be worth
+    // flushing, i.e. we have too many pivots and should split.
+    bool find_batch_to_flush(typename pivot_map::iterator &child_pivot,
+                             typename pivot_map::iterator &next_pivot,
+                             std::vector<std::pair<unsigned int, typename pivot_map::iterator>> &big_batches)
     {
-      if (is_leaf())
-      {
-        return currentLevel;
-      }
-
-      std::vector<int> heights;
-      for (auto &pivot : pivots)
+      unsigned int max_size = 0;
+      for (auto it = pivots.begin(); it != pivots.end(); ++it)
       {
-        int height = pivot.second.child->tree_height_recursive(bet, currentLevel + 1);
-        heights.push_back(height);
+        auto it2 = next(it);
+        auto elt_it = get_element_begin(it);
+        auto elt_it2 = get_element_begin(it2);
+        unsigned int dist = distance(elt_it, elt_it2);
+        if (dist > max_size)
+        {
+          child_pivot = it;
+          next_pivot = it2;
+          max_size = dist;
+        }
+        if (dist > min_flush_size)
+          big_batches.push_back(std::make_pair(dist, it));
       }
-      // Return max height
-      return *std::max_element(heights.begin(), heights.end());
+      // If one of these conditions is false, we have too many pivots
+      // 1. the max node size is greater than the min flush size
+      // 2. the max node size is not bigger than half the min flush size and the child is in memory
+      return max_size > min_flush_size ||
+             (max_size > min_flush_size / 2 && child_pivot->second.child.is_in_memory());
     }
 
-    // recursive method to count all the nodes in the tree
-    int node_count_recursive(betree &bet)
-    {
-      int count = 1; // current node
-      for (auto &pivot : pivots)
-      {
-        count += pivot.second.child->node_count_recursive(bet);
-      }
-      return count;
-    }
-    // recursive method to count all the pivots in the tree
-    int pivot_count_recursive(betree &bet)
-    {
-      int count = 0;
-      for (auto &pivot : pivots)
-      {
-        count += pivot.second.child->pivot_count_recursive(bet);
-      }
-      return count;
-    }
-    // Print the amount of messages in each node
-    void message_count_recursive(betree &bet)
+    // True if this node is over its limits and needs a flush or a
+    // split.
+    bool needs_maintenance(void) const
     {
       if (is_leaf())
-      {
-        std::cout << "leaf messages: " << std::to_string(elements.size()) << std::endl;
-        return;
-      }
-      else
-      {
-        std::cout << "messages: " << std::to_string(elements.size()) << std::endl;
-        for (auto &pivot : pivots)
-        {
-          pivot.second.child->message_count_recursive(bet);
-        }
-      }
+        return elements.size() >= max_messages;
+      return elements.size() >= max_messages || pivots.size() >= max_pivots;
     }
 
     // Receive a collection of new messages and perform recursive
     // flushes or splits as necessary.  If we split, return a
     // map with the new pivot keys pointing to the new nodes.
     // Otherwise return an empty map.
-    pivot_map flush(betree &bet, message_map &elts)
+    //
+    // With cascade false (background maintenance), an internal node
+    // just buffers the messages and is left over-full for the
+    // scheduler to drain; leaves still split right away.
+    pivot_map flush(betree &bet, message_map &elts, bool cascade = true)
     {
       // If this node is less than the tunable epsilon tree level
       // Checks for an epsilon update.
@@ -890,6 +1163,7 @@ private:
         // Leaves don't contain pivots, so only need to check max message size.
         if (elements.size() >= max_messages)
           result = split(bet);
+        note_shape(bet);
         return result;
       }
 
@@ -904,6 +1178,14 @@ private:
         pivots.erase(oldmin);
       }
 
+      if (!cascade)
+      {
+        for (auto it = elts.begin(); it != elts.end(); ++it)
+          apply(it->first, it->second, bet.default_value);
+        note_shape(bet);
+        return result;
+      }
+
       // If everything is going to a single dirty child, go ahead
       // and put it there.
       auto first_pivot_idx = get_pivot(elts.begin()->first.key);
@@ -911,16 +1193,18 @@ private:
       if (first_pivot_idx == last_pivot_idx &&
           first_pivot_idx->second.child.is_dirty())
       {
-        // There shouldn't be anything in our buffer for this child,
-        // but lets assert that just to be safe.
+        // Queries pin children non-constly, so a dirty child may
+        // still have older messages sitting in our buffer.  Send them
+        // down along with the new ones so they are applied in order.
         {
           auto next_pivot_idx = next(first_pivot_idx);
           auto elt_start = get_element_begin(first_pivot_idx);
           auto elt_end = get_element_begin(next_pivot_idx);
-          //assert(elt_start == elt_end);
+          elts.insert(elt_start, elt_end);
+          elements.erase(elt_start, elt_end);
         }
         // Flush the messages from further down the tree.
-        pivot_map new_children = first_pivot_idx->second.child->flush(bet, elts);
+        pivot_map new_children = first_pivot_idx->second.child.write_pin()->flush(bet, elts);
 	
 	// If more leaves were created from the flush, update our pivots.
         if (!new_children.empty())
@@ -945,37 +1229,28 @@ private:
         // Now flush to out-of-core or clean children as necessary
         while (elements.size() >= max_messages || pivots.size() >= max_pivots)
         {
-          // Find the child with the largest set of messages in our buffer
-          unsigned int max_size = 0;
           auto child_pivot = pivots.begin();
           auto next_pivot = pivots.begin();
-          for (auto it = pivots.begin(); it != pivots.end(); ++it)
+          std::vector<std::pair<unsigned int, typename pivot_map::iterator>> big_batches;
+          if (!find_batch_to_flush(child_pivot, next_pivot, big_batches))
           {
-            auto it2 = next(it);
-            auto elt_it = get_element_begin(it);
-            auto elt_it2 = get_element_begin(it2);
-            unsigned int dist = distance(elt_it, elt_it2);
-            if (dist > max_size)
-            {
-              child_pivot = it;
-              next_pivot = it2;
-              max_size = dist;
-            }
+            break; // We need to split because we have too many pivots
           }
-          // If one of these conditions is false, we have too many pivots
-          // 1. the max node size is greater than the min flush size
-          // 2. the max node size is not bigger than half the min flush size and the child is in memory
-          if (!(max_size > min_flush_size ||
-                (max_size > min_flush_size / 2 && child_pivot->second.child.is_in_memory())))
+
+          if (bet.flush_pool && big_batches.size() > 1)
           {
-            break; // We need to split because we have too many pivots
+            flush_in_parallel(bet, big_batches);
+            continue;
           }
 
+          // Start reading the runners-up while we flush to this child.
+          prefetch_largest_batches(bet, big_batches, child_pivot);
+
           auto elt_child_it = get_element_begin(child_pivot);
           auto elt_next_it = get_element_begin(next_pivot);
           message_map child_elts(elt_child_it, elt_next_it);
           
-          pivot_map new_children = child_pivot->second.child->flush(bet, child_elts);
+          pivot_map new_children = child_pivot->second.child.write_pin()->flush(bet, child_elts);
 	  
 	  elements.erase(elt_child_it, elt_next_it);
           if (!new_children.empty())
@@ -987,7 +1262,7 @@ private:
           else
           {
             // Otherwise if there are no new nodes, make sure the node size is up to date.
-            first_pivot_idx->second.child_size =
+            child_pivot->second.child_size =
                 child_pivot->second.child->pivots.size() +
                 child_pivot->second.child->elements.size();
           }
@@ -1003,10 +1278,156 @@ private:
 
       // merge_small_children(bet);
 
+      note_shape(bet);
       debug(std::cout << "Done flushing " << this << std::endl);
       return result;
     }
 
+    // One background maintenance step (see betree::run_maintenance).
+    // Like the loop at the end of flush(), but batches only go one
+    // level down: children left over-full are handed back to the
+    // scheduler instead of being flushed further.  Returns the new
+    // nodes if we split.
+    //
+    // Given wake, it is run by the async executor and must not wait:
+    // it stops at the first child it cannot have right away, without
+    // splitting, and sets code to what the operation should return.
+    // A flush that updates the child's epsilon runs blocking.
+    pivot_map drain(betree &bet, const async_executor::wake_function *wake, int &code)
+    {
+      pivot_map result;
+
+      if (is_leaf())
+      {
+        if (elements.size() >= max_messages)
+          result = split(bet);
+        note_shape(bet);
+        return result;
+      }
+
+      while (elements.size() >= max_messages || pivots.size() >= max_pivots)
+      {
+        auto child_pivot = pivots.begin();
+        auto next_pivot = pivots.begin();
+        std::vector<std::pair<unsigned int, typename pivot_map::iterator>> big_batches;
+        if (!find_batch_to_flush(child_pivot, next_pivot, big_batches))
+          break;
+
+        prefetch_largest_batches(bet, big_batches, child_pivot);
+
+        auto elt_child_it = get_element_begin(child_pivot);
+        auto elt_next_it = get_element_begin(next_pivot);
+        message_map child_elts(elt_child_it, elt_next_it);
+
+        pivot_map new_children;
+        {
+          node_pin child;
+          if (wake == NULL)
+            child = child_pivot->second.child.write_pin();
+          else
+            child = bet.async_pin(child_pivot->second.child, LATCH_EXCLUSIVE, *wake, code);
+          if (!child.is_pinned())
+            break;
+          if (wake != NULL && child->epsilon_update_due(bet))
+            bet.executor->run_blocking([&]
+                                       { new_children = child->flush(bet, child_elts, false); });
+          else
+            new_children = child->flush(bet, child_elts, false);
+          if (new_children.empty())
+          {
+            child_pivot->second.child_size = child->pivots.size() + child->elements.size();
+            if (child->needs_maintenance())
+              bet.schedule_maintenance(child_pivot->second.child, child);
+          }
+        }
+
+        elements.erase(elt_child_it, elt_next_it);
+        if (!new_children.empty())
+        {
+          pivots.erase(child_pivot);
+          pivots.insert(new_children.begin(), new_children.end());
+        }
+      }
+
+      if (code == ASYNC_DONE && pivots.size() > max_pivots)
+        result = split(bet);
+      note_shape(bet);
+      return result;
+    }
+
+    // One child flush done on the flush pool.
+    class child_flush
+    {
+    public:
+      typename pivot_map::iterator pivot;
+      message_map elts;
+      pivot_map new_children;
+    };
+
+    // Flush the largest of batches (at most one per pool thread, plus
+    // one for us) to their children at the same time.  The children
+    // only touch their own subtrees; our pivots are updated here,
+    // after they are all done.
+    void flush_in_parallel(betree &bet,
+                           std::vector<std::pair<unsigned int, typename pivot_map::iterator>> &batches)
+    {
+      uint64_t n = std::min<uint64_t>(batches.size(), bet.flush_pool->size() + 1);
+      std::partial_sort(batches.begin(), batches.begin() + n, batches.end(),
+                        [](const std::pair<unsigned int, typename pivot_map::iterator> &a,
+                           const std::pair<unsigned int, typename pivot_map::iterator> &b)
+                        { return a.first > b.first; });
+
+      std::vector<child_flush> jobs(n);
+      std::vector<std::function<void(void)>> tasks;
+      for (uint64_t i = 0; i < n; i++)
+      {
+        child_flush &job = jobs[i];
+        job.pivot = batches[i].second;
+        auto elt_start = get_element_begin(job.pivot);
+        auto elt_end = get_element_begin(next(job.pivot));
+        job.elts.insert(elt_start, elt_end);
+        elements.erase(elt_start, elt_end);
+        tasks.push_back([&bet, &job]
+                        {
+                          alloc_scope scope(ALLOC_NODE);
+                          job.new_children = job.pivot->second.child.write_pin()->flush(bet, job.elts); });
+      }
+      bet.flush_pool->run(tasks);
+
+      for (auto it = jobs.begin(); it != jobs.end(); ++it)
+      {
+        if (!it->new_children.empty())
+        {
+          pivots.erase(it->pivot);
+          pivots.insert(it->new_children.begin(), it->new_children.end());
+        }
+        else
+        {
+          it->pivot->second.child_size =
+              it->pivot->second.child->pivots.size() +
+              it->pivot->second.child->elements.size();
+        }
+      }
+    }
+
+    // Prefetch the children with the largest batches, other than the
+    // one we are about to flush to.
+    void prefetch_largest_batches(betree &bet,
+                                  std::vector<std::pair<unsigned int, typename pivot_map::iterator>> &batches,
+                                  typename pivot_map::iterator current)
+    {
+      if (bet.prefetch_depth == 0)
+        return;
+      uint64_t n = std::min<uint64_t>(batches.size(), bet.prefetch_depth + 1);
+      std::partial_sort(batches.begin(), batches.begin() + n, batches.end(),
+                        [](const std::pair<unsigned int, typename pivot_map::iterator> &a,
+                           const std::pair<unsigned int, typename pivot_map::iterator> &b)
+                        { return a.first > b.first; });
+      for (uint64_t i = 0; i < n; i++)
+        if (batches[i].second != current)
+          bet.ss->prefetch(batches[i].second->second.child);
+    }
+
     Value query(betree &bet, const Key k)
     {
       debug(std::cout << "Querying " << this << std::endl);
@@ -1016,6 +1437,11 @@ private:
       {
         add_read(bet);
       }
+      // Adopt before searching: a query that ends in an exception
+      // would otherwise leave the node flagged, and every later query
+      // through it would have to come back here (see query_step).
+      if (ready_for_adoption)
+        adopt(bet);
       if (is_leaf())
       {
         auto it = elements.lower_bound(MessageKey<Key>::range_start(k));
@@ -1038,7 +1464,7 @@ private:
       if (message_iter == elements.end() || k < message_iter->first)
         // If we don't have any messages for this key, just search
         // further down the tree.
-        v = get_pivot(k)->second.child->query(bet, k);
+        v = get_pivot(k)->second.child.write_pin()->query(bet, k);
       else if (message_iter->second.opcode == UPDATE)
       {
         // We have some updates for this key.  Search down the tree.
@@ -1047,7 +1473,7 @@ private:
         // default initial value.
         try
         {
-          Value t = get_pivot(k)->second.child->query(bet, k);
+          Value t = get_pivot(k)->second.child.write_pin()->query(bet, k);
           v = t;
         }
         catch (std::out_of_range &e)
@@ -1080,25 +1506,109 @@ private:
         message_iter++;
       }
 
-      // Node adopts after query if ready to shorten tree
-      if (ready_for_adoption){
-        adopt(bet);
+      return v;
+    }
+
+    // One level of a query made under a shared latch on this node.
+    // Updates for k buffered here are put in front of updates, so that
+    // updates ends up in the order they must be applied.  If the
+    // answer lies further down, next is set to the child to search,
+    // which lives in this node: the caller must move on to it before
+    // letting go of this node.  Nothing is modified except the read
+    // statistics, and those only if count_read is set; if the query
+    // would need to modify this node, we return QUERY_ESCALATE.
+    int query_step(const betree &bet, const Key &k, std::vector<Value> &updates,
+                   Value &v, const node_pointer *&next, bool count_read = true) const
+    {
+      if (ready_for_adoption)
+        return QUERY_ESCALATE;
+      if (count_read && bet.is_dynamic && node_level <= bet.tunable_epsilon_level && !note_read())
+        return QUERY_ESCALATE;
+
+      if (is_leaf())
+      {
+        auto it = elements.lower_bound(MessageKey<Key>::range_start(k));
+        if (it == elements.end() || !(it->first.key == k))
+          return QUERY_NOT_FOUND;
+        assert(it->second.opcode == INSERT);
+        v = it->second.val;
+        return QUERY_FOUND;
       }
 
-      return v;
+      auto message_iter = get_element_begin(k);
+      int result = QUERY_DESCEND;
+      if (message_iter != elements.end() && !(k < message_iter->first))
+      {
+        if (message_iter->second.opcode == DELETE)
+        {
+          result = QUERY_NOT_FOUND;
+          message_iter++;
+        }
+        else if (message_iter->second.opcode == INSERT)
+        {
+          result = QUERY_FOUND;
+          v = message_iter->second.val;
+          message_iter++;
+        }
+      }
+
+      std::vector<Value> ours;
+      while (message_iter != elements.end() && message_iter->first.key == k)
+      {
+        assert(message_iter->second.opcode == UPDATE);
+        ours.push_back(message_iter->second.val);
+        message_iter++;
+      }
+      updates.insert(updates.begin(), ours.begin(), ours.end());
+
+      if (result == QUERY_DESCEND)
+        next = &get_pivot(k)->second.child;
+      return result;
+    }
+
+    // Collect this node's messages for k, oldest first, and point next
+    // at the child that may hold older ones (NULL if there is none).
+    // Tell succ about our first message after k's and about the
+    // children we do not descend into.
+    void get_key_messages(const Key &k,
+                          std::vector<std::pair<MessageKey<Key>, Message<Value>>> &msgs,
+                          const node_pointer *&next, scan_successor &succ) const
+    {
+      auto it = elements.lower_bound(MessageKey<Key>::range_start(k));
+      for (; it != elements.end() && it->first.key == k; ++it)
+        msgs.push_back(*it);
+      if (it != elements.end())
+        succ.offer(*it);
+      next = NULL;
+      if (is_leaf())
+        return;
+      if (k < pivots.begin()->first)
+      {
+        succ.limit(pivots.begin()->first);
+        return;
+      }
+      auto pivot = get_pivot(k);
+      next = &pivot->second.child;
+      if (++pivot != pivots.end())
+        succ.limit(pivot->first);
     }
 
     std::pair<MessageKey<Key>, Message<Value>>
-    get_next_message_from_children(const MessageKey<Key> *mkey) const
+    get_next_message_from_children(const betree &bet, const MessageKey<Key> *mkey) const
     {
       if (mkey && *mkey < pivots.begin()->first)
         mkey = NULL;
       auto it = mkey ? get_pivot(mkey->key) : pivots.begin();
+      // The scan will move on to the following children next.
+      auto ahead = it;
+      for (uint64_t i = 0; i < bet.prefetch_depth && ahead != pivots.end(); i++)
+        if (++ahead != pivots.end())
+          bet.ss->prefetch(ahead->second.child);
       while (it != pivots.end())
       {
         try
         {
-          return it->second.child->get_next_message(mkey);
+          return it->second.child.read_pin()->get_next_message(bet, mkey);
         }
         catch (std::out_of_range &e)
         {
@@ -1109,7 +1619,7 @@ private:
     }
 
     std::pair<MessageKey<Key>, Message<Value>>
-    get_next_message(const MessageKey<Key> *mkey) const
+    get_next_message(const betree &bet, const MessageKey<Key> *mkey) const
     {
       auto it = mkey ? elements.upper_bound(*mkey) : elements.begin();
 
@@ -1121,11 +1631,11 @@ private:
       }
 
       if (it == elements.end())
-        return get_next_message_from_children(mkey);
+        return get_next_message_from_children(bet, mkey);
 
       try
       {
-        auto kids = get_next_message_from_children(mkey);
+        auto kids = get_next_message_from_children(bet, mkey);
         if (kids.first < it->first)
           return kids;
         else
@@ -1139,7 +1649,10 @@ private:
 
     void _serialize(std::iostream &fs, serialization_context &context)
     {
-      fs << "pivots:" << std::endl;
+      uint64_t format = NODE_FORMAT_VERSION;
+      fs << "format: ";
+      serialize(fs, context, format);
+      fs << "\npivots:" << std::endl;
       serialize(fs, context, pivots);
       fs << "elements:" << std::endl;
       serialize(fs, context, elements);
@@ -1151,12 +1664,28 @@ private:
       serialize(fs, context, node_id);
       fs << "\nready_for_adoption: ";
       serialize(fs, context, ready_for_adoption);
+      fs << "\nheight: ";
+      serialize(fs, context, height);
+      fs << "\nshape_epsilon: ";
+      serialize(fs, context, shape_epsilon);
     }
 
     void _deserialize(std::iostream &fs, serialization_context &context)
     {
       std::string dummy;
+      uint64_t format = 0;
       fs >> dummy;
+      if (dummy == "format:")
+      {
+        deserialize(fs, context, format);
+        fs >> dummy;
+      }
+      if (format != NODE_FORMAT_VERSION)
+      {
+        std::cerr << "betree node image has format " << format
+                  << ", this build reads format " << NODE_FORMAT_VERSION << std::endl;
+        abort();
+      }
       deserialize(fs, context, pivots);
       fs >> dummy;
       deserialize(fs, context, elements);
@@ -1168,6 +1697,15 @@ private:
       deserialize(fs, context, node_id);
       fs >> dummy;
       deserialize(fs, context, ready_for_adoption);
+      fs >> dummy;
+      deserialize(fs, context, height);
+      fs >> dummy;
+      deserialize(fs, context, shape_epsilon);
+
+      shape_counted = true;
+      shape_height = height;
+      shape_pivots = pivots.size();
+      shape_messages = elements.size();
     }
   };
 
@@ -1183,7 +1721,717 @@ private:
   uint64_t tunable_epsilon_level;
   uint64_t const ops_before_update;
   uint64_t const window_size;
-  uint64_t glob_id_inc = 0;
+  // Child flushes on the flush pool allocate nodes concurrently.
+  std::atomic<uint64_t> glob_id_inc{0};
+  uint64_t prefetch_depth = DEFAULT_PREFETCH_DEPTH;
+  worker_pool *flush_pool = NULL;
+  async_executor *executor = NULL;
+  bool optimistic_reads = false;
+  // Key and value bytes of every upsert so far.
+  std::atomic<uint64_t> bytes_upserted{0};
+  // One histogram per LATENCY_* operation, or NULL when not recording.
+  latency_histogram *latencies = NULL;
+  std::function<void(int, const Key &, const Value &)> trace_hook;
+  // Tree shape by height above the leaves, kept up to date by
+  // node::note_shape() so that reading it never touches a node.
+  std::atomic<int64_t> shape_nodes[SHAPE_MAX_LEVELS];
+  std::atomic<int64_t> shape_pivots[SHAPE_MAX_LEVELS];
+  std::atomic<int64_t> shape_messages[SHAPE_MAX_LEVELS];
+  std::atomic<int64_t> shape_epsilons[SHAPE_MAX_LEVELS][SHAPE_EPSILON_BUCKETS];
+  static int epsilon_bucket(float e)
+  {
+    int bucket = e * SHAPE_EPSILON_BUCKETS;
+    if (bucket < 0)
+      bucket = 0;
+    if (bucket >= SHAPE_EPSILON_BUCKETS)
+      bucket = SHAPE_EPSILON_BUCKETS - 1;
+    return bucket;
+  }
+
+  void count_shape(uint64_t height, int64_t nodes, int64_t pivots, int64_t messages, int bucket)
+  {
+    if (height >= SHAPE_MAX_LEVELS)
+      height = SHAPE_MAX_LEVELS - 1;
+    shape_nodes[height].fetch_add(nodes, std::memory_order_relaxed);
+    shape_pivots[height].fetch_add(pivots, std::memory_order_relaxed);
+    shape_messages[height].fetch_add(messages, std::memory_order_relaxed);
+    shape_epsilons[height][bucket].fetch_add(nodes, std::memory_order_relaxed);
+  }
+
+  // Serializes writers, including queries that had to escalate.
+  std::mutex writer_mutex;
+  // Protects root itself (not the root node).
+  mutable std::mutex root_mutex;
+
+  // A node waiting for background maintenance.  We find it again by
+  // walking down from the root along key, so a task whose node has
+  // since been split or merged away just finds nothing to do.
+  class maintenance_task
+  {
+  public:
+    uint64_t id;
+    Key key;
+    double fullness;
+    node_pointer target;
+  };
+
+  // Over-full nodes waiting to be drained, and the ids of the nodes in
+  // it, so that each node is queued at most once.
+  std::vector<maintenance_task> pending_maintenance;
+  std::set<uint64_t> queued_nodes;
+  unsigned int running_maintenance = 0;
+  bool stop_maintenance = false;
+  std::vector<std::thread> maintenance_threads;
+  std::mutex maintenance_mutex;
+  std::condition_variable maintenance_cond;
+  std::condition_variable maintenance_idle;
+
+  // Pin the root with the given latch.  A writer that replaces the
+  // root does so before it releases the old one, so once we hold the
+  // latch we just check that it is still the root.
+  node_pin pin_root(int latch_mode, node_pointer &r) const
+  {
+    while (true)
+    {
+      {
+        std::lock_guard<std::mutex> lock(root_mutex);
+        r = root;
+      }
+      node_pin p(&r, latch_mode);
+      std::lock_guard<std::mutex> lock(root_mutex);
+      if (root == r)
+        return p;
+    }
+  }
+
+  node_pin pin_root_shared(void) const
+  {
+    node_pointer r;
+    return pin_root(LATCH_SHARED, r);
+  }
+
+  // Put a new root above the nodes the old root split into.  The
+  // caller still holds the old root's exclusive latch.
+  void replace_root(float e, uint64_t old_height, pivot_map &new_nodes)
+  {
+    // The root's level should always be 0
+    node_pointer new_root = ss->allocate(new node(e, 0, ops_before_update, window_size));
+    new_root->pivots = new_nodes;
+    new_root->height = old_height + 1;
+    new_root->note_shape(*this);
+
+    // set new node_id
+    auto new_node_id = glob_id_inc++;
+    new_root->set_node_id(new_node_id);
+
+    std::lock_guard<std::mutex> rlock(root_mutex);
+    root = new_root;
+  }
+
+  // The walk of query() without pins or latches, for when every node
+  // on the path is in memory (see swap_space::optimistic_reader).
+  // Returns false if it had to give up on some node, e.g. because it
+  // is on disk, being written, or must be modified by the query.  It
+  // counts no reads; the caller passes a successful walk's key to
+  // note_optimistic_read().
+  bool optimistic_query(const Key &k, std::vector<Value> &updates, Value &v, int &result) const
+  {
+    swap_space::optimistic_reader reader(ss);
+    if (!reader.ok())
+      return false;
+    const node_pointer *next = &root;
+    while (true)
+    {
+      const node *n = reader.enter(*next);
+      if (n == NULL)
+        return false;
+      result = n->query_step(*this, k, updates, v, next, false);
+      if (result == QUERY_ESCALATE || !reader.validate())
+        return false;
+      if (result != QUERY_DESCEND)
+        return true;
+    }
+  }
+
+  latency_histogram *latency_of(int op) const
+  {
+    return latencies ? &latencies[op] : NULL;
+  }
+
+  // Apply the updates a query collected on its way down to whatever
+  // its walk ended on.
+  Value finish_query(int result, const std::vector<Value> &updates, Value v) const
+  {
+    if (result == QUERY_NOT_FOUND)
+    {
+      if (updates.empty())
+        throw std::out_of_range("Key does not exist");
+      v = default_value;
+    }
+    for (auto it = updates.begin(); it != updates.end(); ++it)
+      v = v + *it;
+    return v;
+  }
+
+  // The state of an async operation between attempts.  A query that
+  // had to wait for a child keeps the child's parent latched, so that
+  // the next attempt picks up there, crabbing on as query() does.
+  class async_query
+  {
+  public:
+    Key key;
+    std::promise<Value> result;
+    // Empty until the root has been read.
+    node_pin parent;
+    const node_pointer *next;
+    std::vector<Value> updates;
+    Value v;
+  };
+
+  // A writer's place in the queue for the root's latch, kept between
+  // attempts so that readers cannot starve it (see rw_latch::try_lock()).
+  class root_claim
+  {
+  public:
+    node_pointer root;
+    bool queued = false;
+  };
+
+  class async_upsert
+  {
+  public:
+    int opcode;
+    Key key;
+    Value value;
+    std::promise<void> result;
+    root_claim claim;
+  };
+
+  class async_maintenance
+  {
+  public:
+    bool running = false;
+    maintenance_task task;
+    root_claim claim;
+  };
+
+  // Pin p for an async operation: take its latch and make sure it is
+  // in memory, without waiting for either.  If that cannot be done
+  // yet, returns an empty pin and sets code to what the operation
+  // should return: ASYNC_WAITING once wake will be called when p has
+  // been read, ASYNC_RETRY otherwise.
+  node_pin async_pin(const node_pointer &p, int latch_mode,
+                     const async_executor::wake_function &wake, int &code)
+  {
+    return async_pin(p, latch_mode, wake, code, NULL);
+  }
+
+  node_pin async_pin(const node_pointer &p, int latch_mode,
+                     const async_executor::wake_function &wake, int &code, bool *queued)
+  {
+    node_pin n;
+    if (latch_mode == LATCH_SHARED)
+      n = p.try_read_pin();
+    else if (queued != NULL)
+      n = p.try_write_pin(*queued);
+    else
+      n = p.try_write_pin();
+    if (!n.is_pinned())
+    {
+      code = ASYNC_RETRY;
+      return n;
+    }
+    int fetched = ss->fetch(p, wake);
+    if (fetched != FETCH_READY)
+    {
+      n.release();
+      code = fetched == FETCH_WAITING ? ASYNC_WAITING : ASYNC_RETRY;
+    }
+    return n;
+  }
+
+  // pin_root() for an async operation (see async_pin()).  A writer
+  // passes its claim on the root, which moves with the root.
+  node_pin async_pin_root(int latch_mode, node_pointer &r,
+                          const async_executor::wake_function &wake, int &code,
+                          root_claim *claim = NULL)
+  {
+    while (true)
+    {
+      {
+        std::lock_guard<std::mutex> lock(root_mutex);
+        r = root;
+      }
+      if (claim != NULL && claim->queued && claim->root != r)
+        claim->root.cancel_write_pin(claim->queued);
+      node_pin p = async_pin(r, latch_mode, wake, code, claim ? &claim->queued : NULL);
+      if (claim != NULL)
+        claim->root = r;
+      if (!p.is_pinned())
+        return p;
+      std::lock_guard<std::mutex> lock(root_mutex);
+      if (root == r)
+        return p;
+    }
+  }
+
+  // One attempt at an async query: the walk of query(), from the root
+  // or from where the last attempt stopped, up to the first node it
+  // cannot have without waiting.  A query that has to run as a writer
+  // (see query_step()) gives up its walk and runs query_exclusive()
+  // blocking, which only happens in dynamic trees.
+  int async_query_step(async_query &q, const async_executor::wake_function &wake)
+  {
+    alloc_scope scope(ALLOC_NODE);
+    try
+    {
+      int code = ASYNC_DONE;
+      node_pin cur;
+      if (q.parent.is_pinned())
+        cur = async_pin(*q.next, LATCH_SHARED, wake, code);
+      else
+      {
+        node_pointer r;
+        cur = async_pin_root(LATCH_SHARED, r, wake, code);
+      }
+      while (cur.is_pinned())
+      {
+        q.parent.release();
+        int result = cur->query_step(*this, q.key, q.updates, q.v, q.next);
+        if (result == QUERY_ESCALATE)
+        {
+          cur.release();
+          executor->run_blocking([this, &q]
+                                 { q.result.set_value(query_exclusive(q.key)); });
+          return ASYNC_DONE;
+        }
+        if (result != QUERY_DESCEND)
+        {
+          cur.release();
+          q.result.set_value(finish_query(result, q.updates, q.v));
+          return ASYNC_DONE;
+        }
+        q.parent = std::move(cur);
+        cur = async_pin(*q.next, LATCH_SHARED, wake, code);
+      }
+      return code;
+    }
+    catch (...)
+    {
+      q.parent.release();
+      q.result.set_exception(std::current_exception());
+    }
+    return ASYNC_DONE;
+  }
+
+  // An async upsert does what buffered_upsert() does: it adds the
+  // message to the root and leaves flushing to maintenance, which
+  // without maintenance threads also runs on the executor.  While the
+  // root is too far behind it retries instead of helping.  Adding to
+  // a root whose epsilon update is due runs blocking.
+  int async_upsert_step(async_upsert &u, const async_executor::wake_function &wake)
+  {
+    alloc_scope scope(ALLOC_NODE);
+    try
+    {
+      int code = ASYNC_DONE;
+      node_pointer old_root;
+      node_pin root_pin = async_pin_root(LATCH_EXCLUSIVE, old_root, wake, code, &u.claim);
+      if (!root_pin.is_pinned())
+        return code;
+      const node_pin &r = root_pin;
+      if (r->elements.size() > DEFAULT_BACKPRESSURE_FACTOR * r->max_messages)
+      {
+        schedule_maintenance(old_root, root_pin);
+        return ASYNC_RETRY;
+      }
+
+      auto add = [this, &u, &old_root, &root_pin]
+      {
+        message_map tmp;
+        tmp[MessageKey<Key>(u.key, next_timestamp++)] = Message<Value>(u.opcode, u.value);
+        pivot_map new_nodes = root_pin->flush(*this, tmp, false);
+        if (!new_nodes.empty())
+          replace_root(root_pin->epsilon, root_pin->height, new_nodes);
+        else if (root_pin->needs_maintenance())
+          schedule_maintenance(old_root, root_pin);
+      };
+      if (r->epsilon_update_due(*this))
+        executor->run_blocking(add);
+      else
+        add();
+      root_pin.release();
+      u.result.set_value();
+    }
+    catch (...)
+    {
+      u.result.set_exception(std::current_exception());
+    }
+    return ASYNC_DONE;
+  }
+
+  // Walk down with latch crabbing, then apply the updates found on
+  // the way to whatever the walk ended on.
+  Value walk_query(Key k)
+  {
+    std::vector<Value> updates;
+    Value v = default_value;
+    int result;
+    if (optimistic_reads)
+    {
+      for (int i = 0; i < DEFAULT_OPTIMISTIC_QUERY_RETRIES; i++)
+      {
+        if (optimistic_query(k, updates, v, result))
+        {
+          if (is_dynamic)
+            note_optimistic_read(k);
+          return finish_query(result, updates, v);
+        }
+        updates.clear();
+        v = default_value;
+      }
+    }
+
+    node_pin cur = pin_root_shared();
+    while (true)
+    {
+      const node_pointer *next;
+      result = cur->query_step(*this, k, updates, v, next);
+      if (result == QUERY_ESCALATE)
+      {
+        cur.release();
+        return query_exclusive(k);
+      }
+      if (result != QUERY_DESCEND)
+        break;
+      node_pin child = next->read_pin();
+      cur = std::move(child);
+    }
+    cur.release();
+    return finish_query(result, updates, v);
+  }
+
+  // Count the read of a successful optimistic query on the nodes that
+  // adapt their epsilon.  Each thread keeps the keys of its last few
+  // and counts them together, under shared latches, so that readers
+  // of a hot node take its stats_mutex once per batch.  A thread that
+  // moves on to another tree drops what it kept for the last one.
+  void note_optimistic_read(const Key &k)
+  {
+    static thread_local const betree *owner = NULL;
+    static thread_local std::vector<Key> pending;
+    if (owner != this)
+    {
+      pending.clear();
+      owner = this;
+    }
+    pending.push_back(k);
+    if (pending.size() < DEFAULT_OPTIMISTIC_READ_BATCH)
+      return;
+
+    std::sort(pending.begin(), pending.end());
+    bool due = false;
+    Key due_key = pending.front();
+    {
+      const node_pin r = pin_root_shared();
+      fold_reads(r, pending.begin(), pending.end(), due, due_key);
+    }
+    pending.clear();
+    if (due)
+      update_epsilons(due_key);
+  }
+
+  // Count a read of each of the sorted keys in [begin, end) on n and
+  // on the nodes below it that adapt their epsilon.  If one of them is
+  // now due for an epsilon update, set due and put a key on its path
+  // in due_key.
+  void fold_reads(const node_pin &n,
+                  typename std::vector<Key>::const_iterator begin,
+                  typename std::vector<Key>::const_iterator end,
+                  bool &due, Key &due_key) const
+  {
+    if (n->node_level > tunable_epsilon_level)
+      return;
+    if (n->note_reads(end - begin) && !due)
+    {
+      due = true;
+      due_key = *begin;
+    }
+    if (n->is_leaf())
+      return;
+    auto it = begin;
+    while (it != end)
+    {
+      // Keys below the first pivot have no child to go to.
+      if (*it < n->pivots.begin()->first)
+      {
+        ++it;
+        continue;
+      }
+      auto pivot = n->get_pivot(*it);
+      auto next_pivot = std::next(pivot);
+      auto stop = it;
+      while (stop != end && (next_pivot == n->pivots.end() || *stop < next_pivot->first))
+        ++stop;
+      const node_pin child = pivot->second.child.read_pin();
+      fold_reads(child, it, stop, due, due_key);
+      it = stop;
+    }
+  }
+
+  // Run the epsilon updates that folded reads made due on k's path.
+  // Like query_exclusive(), this runs as a writer and holds the path.
+  void update_epsilons(const Key &k)
+  {
+    std::lock_guard<std::mutex> lock(writer_mutex);
+    node_pointer r;
+    std::vector<node_pin> path;
+    path.push_back(pin_root(LATCH_EXCLUSIVE, r));
+    while (path.back()->node_level <= tunable_epsilon_level)
+    {
+      node_pin &n = path.back();
+      n->maybe_update_epsilon(*this);
+      if (n->is_leaf() || k < n->pivots.begin()->first)
+        break;
+      node_pin child = n->get_pivot(k)->second.child.write_pin();
+      path.push_back(std::move(child));
+    }
+  }
+
+  // A query run as a writer, so it may update epsilons and adopt.
+  Value query_exclusive(Key k)
+  {
+    std::lock_guard<std::mutex> lock(writer_mutex);
+    node_pointer r;
+    return pin_root(LATCH_EXCLUSIVE, r)->query(*this, k);
+  }
+
+  // Queue an over-full node for the maintenance threads.  The caller
+  // holds n's latch.
+  void schedule_maintenance(const node_pointer &p, const node_pin &n)
+  {
+    maintenance_task t;
+    t.id = n->node_id;
+    if (n->is_leaf())
+    {
+      t.key = n->elements.begin()->first.key;
+      t.fullness = (double)n->elements.size() / n->max_messages;
+    }
+    else
+    {
+      t.key = n->pivots.begin()->first;
+      t.fullness = std::max((double)n->elements.size() / n->max_messages,
+                            (double)n->pivots.size() / n->max_pivots);
+    }
+    t.target = p;
+
+    std::lock_guard<std::mutex> lock(maintenance_mutex);
+    if (stop_maintenance || !queued_nodes.insert(t.id).second)
+      return;
+    pending_maintenance.push_back(t);
+    maintenance_cond.notify_one();
+    if (maintenance_threads.empty() && executor != NULL)
+    {
+      std::shared_ptr<async_maintenance> m = std::make_shared<async_maintenance>();
+      executor->submit([this, m](const async_executor::wake_function &wake)
+                       { return async_maintenance_step(*m, wake); });
+    }
+  }
+
+  // Take the most urgent pending task.  Fuller nodes go first, and a
+  // node that is still dirty in memory counts as one buffer fuller:
+  // draining it costs no read, and its write-back is already owed.
+  maintenance_task pop_maintenance(void)
+  {
+    assert(!pending_maintenance.empty());
+    auto best = pending_maintenance.end();
+    double best_priority = 0;
+    for (auto it = pending_maintenance.begin(); it != pending_maintenance.end(); ++it)
+    {
+      double priority = it->fullness + (it->target.is_dirty() ? 1.0 : 0.0);
+      if (best == pending_maintenance.end() || priority > best_priority)
+      {
+        best = it;
+        best_priority = priority;
+      }
+    }
+    maintenance_task t = *best;
+    *best = pending_maintenance.back();
+    pending_maintenance.pop_back();
+    queued_nodes.erase(t.id);
+    return t;
+  }
+
+  // Pop and run one task.  lock holds maintenance_mutex, and is
+  // dropped while the task runs.
+  void run_next_maintenance(std::unique_lock<std::mutex> &lock)
+  {
+    running_maintenance++;
+    {
+      maintenance_task t = pop_maintenance();
+      lock.unlock();
+      run_maintenance(t);
+    }
+    lock.lock();
+    running_maintenance--;
+    if (pending_maintenance.empty() && running_maintenance == 0)
+      maintenance_idle.notify_all();
+  }
+
+  // Find the task's node with exclusive latch crabbing, holding at
+  // most the node and its parent, then drain it one level and fix up
+  // the parent if it split.  Given wake, it runs on the async
+  // executor: instead of waiting for a node it lets go of everything
+  // and returns what the operation should (see drain()), and the task
+  // is run again from the root once it is woken.
+  int run_maintenance(const maintenance_task &t, const async_executor::wake_function *wake = NULL,
+                      root_claim *claim = NULL)
+  {
+    int code = ASYNC_DONE;
+    node_pointer parent_ptr;
+    node_pin parent;
+    node_pointer cur_ptr;
+    node_pin cur;
+    if (wake == NULL)
+      cur = pin_root(LATCH_EXCLUSIVE, cur_ptr);
+    else
+      cur = async_pin_root(LATCH_EXCLUSIVE, cur_ptr, *wake, code, claim);
+    if (!cur.is_pinned())
+      return code;
+    bool at_root = true;
+    while (cur_ptr != t.target)
+    {
+      const node_pin &c = cur;
+      if (c->is_leaf())
+        return ASYNC_DONE; // It is no longer in the tree.
+      node_pointer child_ptr;
+      try
+      {
+        child_ptr = c->get_pivot(t.key)->second.child;
+      }
+      catch (std::out_of_range &e)
+      {
+        return ASYNC_DONE;
+      }
+      node_pin child;
+      if (wake == NULL)
+        child = child_ptr.write_pin();
+      else
+        child = async_pin(child_ptr, LATCH_EXCLUSIVE, *wake, code);
+      if (!child.is_pinned())
+        return code;
+      parent = std::move(cur);
+      parent_ptr = cur_ptr;
+      cur = std::move(child);
+      cur_ptr = child_ptr;
+      at_root = false;
+    }
+
+    const node_pin &c = cur;
+    if (!c->needs_maintenance())
+      return ASYNC_DONE;
+    pivot_map new_nodes = cur->drain(*this, wake, code);
+    if (at_root)
+    {
+      if (!new_nodes.empty())
+        replace_root(cur->epsilon, cur->height, new_nodes);
+      return code;
+    }
+
+    auto pivot = parent->get_pivot(t.key);
+    if (new_nodes.empty())
+    {
+      pivot->second.child_size = cur->pivots.size() + cur->elements.size();
+      return code;
+    }
+    cur.release();
+    parent->pivots.erase(pivot);
+    parent->pivots.insert(new_nodes.begin(), new_nodes.end());
+    parent->note_shape(*this);
+    if (parent->needs_maintenance())
+      schedule_maintenance(parent_ptr, parent);
+    return ASYNC_DONE;
+  }
+
+  // With no maintenance threads, each task that async upserts leave
+  // is run by an operation on the async executor.  Its task counts as
+  // running from the first attempt to the last.
+  int async_maintenance_step(async_maintenance &m, const async_executor::wake_function &wake)
+  {
+    alloc_scope scope(ALLOC_NODE);
+    if (!m.running)
+    {
+      std::lock_guard<std::mutex> lock(maintenance_mutex);
+      if (pending_maintenance.empty())
+        return ASYNC_DONE;
+      m.task = pop_maintenance();
+      m.running = true;
+      running_maintenance++;
+    }
+    int code = run_maintenance(m.task, &wake, &m.claim);
+    if (code != ASYNC_DONE)
+      return code;
+    std::lock_guard<std::mutex> lock(maintenance_mutex);
+    running_maintenance--;
+    if (pending_maintenance.empty() && running_maintenance == 0)
+      maintenance_idle.notify_all();
+    return ASYNC_DONE;
+  }
+
+  void maintenance_main(void)
+  {
+    alloc_scope scope(ALLOC_NODE);
+    std::unique_lock<std::mutex> lock(maintenance_mutex);
+    while (true)
+    {
+      maintenance_cond.wait(lock, [this] { return stop_maintenance || !pending_maintenance.empty(); });
+      if (stop_maintenance)
+        return;
+      run_next_maintenance(lock);
+    }
+  }
+
+  void stop_maintenance_threads(void)
+  {
+    {
+      std::lock_guard<std::mutex> lock(maintenance_mutex);
+      stop_maintenance = true;
+    }
+    maintenance_cond.notify_all();
+    for (auto it = maintenance_threads.begin(); it != maintenance_threads.end(); ++it)
+      it->join();
+    maintenance_threads.clear();
+    std::lock_guard<std::mutex> lock(maintenance_mutex);
+    pending_maintenance.clear();
+    queued_nodes.clear();
+    stop_maintenance = false;
+  }
+
+  // Upsert with background maintenance: add the message to the root
+  // and leave flushing to the maintenance threads, unless they have
+  // fallen far enough behind that we should help.
+  void buffered_upsert(int opcode, Key k, Value v)
+  {
+    bool behind;
+    {
+      node_pointer old_root;
+      node_pin root_pin = pin_root(LATCH_EXCLUSIVE, old_root);
+      message_map tmp;
+      tmp[MessageKey<Key>(k, next_timestamp++)] = Message<Value>(opcode, v);
+      pivot_map new_nodes = root_pin->flush(*this, tmp, false);
+      if (!new_nodes.empty())
+        replace_root(root_pin->epsilon, root_pin->height, new_nodes);
+      else if (root_pin->needs_maintenance())
+        schedule_maintenance(old_root, root_pin);
+      const node_pin &r = root_pin;
+      behind = r->elements.size() > DEFAULT_BACKPRESSURE_FACTOR * r->max_messages;
+    }
+
+    std::unique_lock<std::mutex> lock(maintenance_mutex);
+    if (!pending_maintenance.empty() &&
+        (behind || pending_maintenance.size() > DEFAULT_MAX_PENDING_MAINTENANCE))
+      run_next_maintenance(lock);
+  }
 
 public:
   betree(swap_space *sspace,
@@ -1205,51 +2453,285 @@ public:
         ops_before_update(opsbeforeupdate),
         window_size(windowsize)
   {
+    for (int i = 0; i < SHAPE_MAX_LEVELS; i++)
+    {
+      shape_nodes[i] = 0;
+      shape_pivots[i] = 0;
+      shape_messages[i] = 0;
+      for (int j = 0; j < SHAPE_EPSILON_BUCKETS; j++)
+        shape_epsilons[i][j] = 0;
+    }
     // The root is always at level 0 in the tree.
+    alloc_scope scope(ALLOC_NODE);
     root = ss->allocate(new node(starting_epsilon, 0, ops_before_update, window_size));
     auto new_node_id = glob_id_inc++; // init node_id
     root->set_node_id(new_node_id);
+    root->note_shape(*this);
+  }
+
+  ~betree(void)
+  {
+    delete executor;
+    stop_maintenance_threads();
+    delete flush_pool;
+    delete[] latencies;
+  }
+
+  // Number of threads used to flush to several children at once, on
+  // top of the thread doing the upsert (0 flushes one child at a
+  // time).
+  void set_flush_threads(unsigned int nthreads)
+  {
+    std::lock_guard<std::mutex> lock(writer_mutex);
+    delete flush_pool;
+    flush_pool = nthreads > 0 ? new worker_pool(nthreads) : NULL;
+  }
+
+  // Number of background threads that flush and split over-full
+  // nodes.  With any, an upsert only adds its message to the root
+  // buffer and queues the root if it is over-full; the threads drain
+  // queued nodes one level at a time, fullest first.  An upsert does
+  // some of the work itself if the root buffer or the queue grows too
+  // big (see DEFAULT_BACKPRESSURE_FACTOR).  0 (the default) flushes
+  // synchronously in upsert.
+  void set_maintenance_threads(unsigned int nthreads)
+  {
+    wait_for_maintenance();
+    stop_maintenance_threads();
+    for (unsigned int i = 0; i < nthreads; i++)
+      maintenance_threads.push_back(std::thread(&betree::maintenance_main, this));
+  }
+
+  // Wait until no background maintenance is queued or running.
+  void wait_for_maintenance(void)
+  {
+    std::unique_lock<std::mutex> lock(maintenance_mutex);
+    maintenance_idle.wait(lock, [this] { return pending_maintenance.empty() && running_maintenance == 0; });
+  }
+
+  // Number of threads that run query_async() and upsert_async()
+  // operations (0 disables them).
+  void set_async_threads(unsigned int nthreads)
+  {
+    delete executor;
+    executor = nthreads > 0 ? new async_executor(nthreads) : NULL;
+  }
+
+  // Let query() first try to walk the tree without pins or latches,
+  // which spares concurrent readers of cached nodes from writing to
+  // shared latches and LRU state.  It falls back on latch crabbing
+  // whenever part of the path is not in memory or is being modified.
+  void set_optimistic_reads(bool enable)
+  {
+    optimistic_reads = enable;
+  }
+
+  // Call hook with every operation as it starts: the opcode (INSERT,
+  // DELETE or UPDATE, or TRACE_QUERY), the key and the value
+  // (default_value for queries and deletes), e.g. to record a trace
+  // (see trace.hpp).  The hook is called on whichever thread runs the
+  // operation, possibly several at once.  An empty hook turns tracing
+  // off.  Set it only while no operations are running.
+  void set_trace_hook(std::function<void(int, const Key &, const Value &)> hook)
+  {
+    trace_hook = hook;
+  }
+
+  // Record the latency of every insert, update, erase, query and scan
+  // step, in nanoseconds, in one histogram per operation (see
+  // latency_histogram.hpp).  Off by default, when it costs a pointer
+  // test per operation.  Turn it on or off only while no operations
+  // are running; turning it off discards what was recorded.
+  void set_latency_tracking(bool enable)
+  {
+    delete[] latencies;
+    latencies = enable ? new latency_histogram[LATENCY_OPS] : NULL;
+  }
+
+  // The latencies recorded for a LATENCY_* operation.  Requires
+  // latency tracking to be on.
+  const latency_histogram &get_latency(int op) const
+  {
+    assert(latencies != NULL && op >= 0 && op < LATENCY_OPS);
+    return latencies[op];
+  }
+
+  void reset_latency(void)
+  {
+    for (int i = 0; latencies && i < LATENCY_OPS; i++)
+      latencies[i].reset();
   }
 
-  // Wrapper methods to call recursive methods to
-  // get Tree stats
-  int get_tree_height()
+  static const char *latency_name(int op)
   {
-    return root->tree_height_recursive(*this, 0);
+    static const char *names[LATENCY_OPS] = {"insert", "update", "erase", "query", "scan", "scan-next"};
+    return names[op];
   }
-  int get_node_count()
+
+  // Print the percentiles, in microseconds, of every operation that
+  // has been recorded.
+  void print_latency(FILE *out) const
+  {
+    bool header = false;
+    for (int i = 0; latencies && i < LATENCY_OPS; i++)
+    {
+      if (latencies[i].count() == 0)
+        continue;
+      if (!header)
+        latency_histogram::print_header(out);
+      header = true;
+      latencies[i].print(out, latency_name(i), 1000.0);
+    }
+  }
+
+  uint64_t get_bytes_upserted(void) const
+  {
+    return bytes_upserted;
+  }
+
+  // Print the swap space's cache and I/O counters, and the write
+  // amplification: bytes written to the backing store per byte of
+  // key and value upserted into this tree.  If several trees share the
+  // swap space, the counters cover all of them.
+  void print_io_stats(FILE *out) const
   {
-    return root->node_count_recursive(*this);
+    swap_space::io_stats io = ss->get_io_stats();
+    swap_space::cache_stats cs = ss->get_cache_stats();
+    uint64_t upserted = bytes_upserted;
+    fprintf(out, "# node loads: %lu (%lu bytes)\n", (unsigned long)io.node_loads, (unsigned long)io.bytes_deserialized);
+    fprintf(out, "# write-backs: %lu (%lu bytes serialized)\n", (unsigned long)io.write_backs, (unsigned long)io.bytes_serialized);
+    fprintf(out, "# evictions: %lu dirty, %lu clean\n", (unsigned long)io.dirty_evictions, (unsigned long)io.clean_evictions);
+    fprintf(out, "# pin waits: %lu latch, %lu load\n", (unsigned long)io.pin_waits, (unsigned long)io.load_waits);
+    fprintf(out, "# cache hit ratio: %f (%lu hits, %lu misses)\n", cs.hit_ratio(), (unsigned long)cs.object_hits, (unsigned long)cs.object_misses);
+    fprintf(out, "# disk reads: %lu (%lu bytes)\n", (unsigned long)io.disk_reads, (unsigned long)io.disk_bytes_read);
+    fprintf(out, "# disk writes: %lu (%lu bytes)\n", (unsigned long)io.disk_writes, (unsigned long)io.disk_bytes_written);
+    fprintf(out, "# write amplification: %f (%lu bytes upserted)\n",
+            upserted ? (double)io.disk_bytes_written / upserted : 0.0, (unsigned long)upserted);
   }
-  int get_pivot_count()
+
+  // Number of children to prefetch ahead during scans and flushes
+  // (0 disables prefetching).
+  void set_prefetch_depth(uint64_t depth)
   {
-    return root->pivot_count_recursive(*this);
+    prefetch_depth = depth;
   }
-  void print_message_count_in_nodes()
+
+  // Tree shape statistics.  These are maintained as nodes split,
+  // merge, flush and adopt, so reading them costs nothing and never
+  // pins a node: a monitoring thread may poll them while the tree is
+  // in use, and sees each counter as of some recent moment.  Levels
+  // are counted up from the leaves (level 0), since after adoptions
+  // the leaves need not all be at the same depth; see node::height.
+  class level_shape
+  {
+  public:
+    uint64_t nodes;
+    uint64_t pivots;
+    uint64_t messages;
+    // Nodes whose epsilon falls in [i, i+1) / SHAPE_EPSILON_BUCKETS.
+    uint64_t epsilons[SHAPE_EPSILON_BUCKETS];
+  };
+
+  level_shape get_level_shape(int level) const
   {
-    root->message_count_recursive(*this);
+    assert(0 <= level && level < SHAPE_MAX_LEVELS);
+    level_shape result;
+    result.nodes = shape_nodes[level];
+    result.pivots = shape_pivots[level];
+    result.messages = shape_messages[level];
+    for (int i = 0; i < SHAPE_EPSILON_BUCKETS; i++)
+      result.epsilons[i] = shape_epsilons[level][i];
+    return result;
+  }
+
+  // Levels above the leaves, i.e. the height of the root.
+  int get_tree_height() const
+  {
+    int height = SHAPE_MAX_LEVELS - 1;
+    while (height > 0 && shape_nodes[height] == 0)
+      height--;
+    return height;
+  }
+
+  uint64_t get_node_count() const
+  {
+    uint64_t count = 0;
+    for (int i = 0; i < SHAPE_MAX_LEVELS; i++)
+      count += shape_nodes[i];
+    return count;
+  }
+
+  uint64_t get_pivot_count() const
+  {
+    uint64_t count = 0;
+    for (int i = 0; i < SHAPE_MAX_LEVELS; i++)
+      count += shape_pivots[i];
+    return count;
+  }
+
+  // Messages buffered anywhere in the tree, leaves included.
+  uint64_t get_message_count() const
+  {
+    uint64_t count = 0;
+    for (int i = 0; i < SHAPE_MAX_LEVELS; i++)
+      count += shape_messages[i];
+    return count;
+  }
+
+  // Replaced by print_shape(), which this now calls; it reports
+  // message counts per level rather than per node.
+  void print_message_count_in_nodes() const
+  {
+    print_shape(stdout);
+  }
+
+  // One line per level, root first: nodes, pivots, messages and the
+  // number of nodes in each epsilon bucket.
+  void print_shape(FILE *out) const
+  {
+    fprintf(out, "# tree height: %d, %lu nodes, %lu pivots, %lu messages\n",
+            get_tree_height(), (unsigned long)get_node_count(),
+            (unsigned long)get_pivot_count(), (unsigned long)get_message_count());
+    fprintf(out, "# %-5s %10s %10s %10s  %s\n", "level", "nodes", "pivots", "messages", "epsilons");
+    for (int i = get_tree_height(); i >= 0; i--)
+    {
+      level_shape shape = get_level_shape(i);
+      fprintf(out, "# %-5d %10lu %10lu %10lu ", i, (unsigned long)shape.nodes,
+              (unsigned long)shape.pivots, (unsigned long)shape.messages);
+      for (int j = 0; j < SHAPE_EPSILON_BUCKETS; j++)
+        fprintf(out, " %lu", (unsigned long)shape.epsilons[j]);
+      fprintf(out, "\n");
+    }
   }
 
   // Insert the specified message and handle a split of the root if it
   // occurs.
   void upsert(int opcode, Key k, Value v)
   {
+    latency_timer timer(latency_of(opcode == INSERT ? LATENCY_INSERT : opcode == DELETE ? LATENCY_ERASE : LATENCY_UPDATE));
+    alloc_scope scope(ALLOC_NODE);
+    if (trace_hook)
+      trace_hook(opcode, k, v);
+    bytes_upserted.fetch_add(payload_bytes(k) + (opcode == DELETE ? 0 : payload_bytes(v)), std::memory_order_relaxed);
+    if (!maintenance_threads.empty())
+    {
+      buffered_upsert(opcode, k, v);
+      return;
+    }
+
+    std::lock_guard<std::mutex> lock(writer_mutex);
+    // Keeps the old root alive until we have released its latch.  Async
+    // maintenance may replace the root meanwhile, so we pin it as a
+    // reader would, and take our timestamp under its latch as
+    // async_upsert_step() does.
+    node_pointer old_root;
+    node_pin root_pin = pin_root(LATCH_EXCLUSIVE, old_root);
     message_map tmp;
     tmp[MessageKey<Key>(k, next_timestamp++)] = Message<Value>(opcode, v);
-    pivot_map new_nodes = root->flush(*this, tmp);
+    pivot_map new_nodes = root_pin->flush(*this, tmp);
     
     if (new_nodes.size() > 0)
-    {
-      auto e = root->epsilon;
-
-      // The root's level should always be 0
-      root = ss->allocate(new node(e, 0, ops_before_update, window_size));
-      root->pivots = new_nodes;
-
-      // set new node_id
-      auto new_node_id = glob_id_inc++;
-      root->set_node_id(new_node_id);
-    }
+      replace_root(root_pin->epsilon, root_pin->height, new_nodes);
   }
 
   void insert(Key k, Value v)
@@ -1269,9 +2751,78 @@ public:
 
   Value query(Key k)
   {
-    Value v = root->query(*this, k);
+    latency_timer timer(latency_of(LATENCY_QUERY));
+    alloc_scope scope(ALLOC_NODE);
+    if (trace_hook)
+      trace_hook(TRACE_QUERY, k, default_value);
+    return walk_query(k);
+  }
 
-    return v;
+  // Non-blocking versions of query() and upsert(), for callers that
+  // cannot wait for the disk (see set_async_threads()).  They return at
+  // once, and the operation runs on the async executor, which sets it
+  // aside whenever it needs a node that is not in memory and runs
+  // other operations meanwhile.  The read's completion puts it back,
+  // and it carries on from the node it stopped at.  The future holds
+  // the result, or the exception (e.g. std::out_of_range) the blocking
+  // call would have thrown.
+  std::future<Value> query_async(Key k)
+  {
+    assert(executor != NULL);
+    std::shared_ptr<async_query> q = std::make_shared<async_query>();
+    q->key = k;
+    q->next = NULL;
+    q->v = default_value;
+    if (trace_hook)
+      trace_hook(TRACE_QUERY, k, default_value);
+    std::future<Value> f = q->result.get_future();
+    executor->submit([this, q](const async_executor::wake_function &wake)
+                     { return async_query_step(*q, wake); });
+    return f;
+  }
+
+  std::future<void> upsert_async(int opcode, Key k, Value v)
+  {
+    assert(executor != NULL);
+    std::shared_ptr<async_upsert> u = std::make_shared<async_upsert>();
+    u->opcode = opcode;
+    u->key = k;
+    u->value = v;
+    if (trace_hook)
+      trace_hook(opcode, k, v);
+    bytes_upserted.fetch_add(payload_bytes(k) + (opcode == DELETE ? 0 : payload_bytes(v)), std::memory_order_relaxed);
+    std::future<void> f = u->result.get_future();
+    executor->submit([this, u](const async_executor::wake_function &wake)
+                     { return async_upsert_step(*u, wake); });
+    return f;
+  }
+
+  // All of k's messages, oldest first.  We crab down k's path with
+  // shared latches, so the parent stays latched until we hold the
+  // child: messages only move between a node and its child while both
+  // are latched exclusively, so none can move from the part of the
+  // path we have yet to read into the part we have already read.
+  // The nodes on the path are the only ones that can hold keys below
+  // the pivots to the right of it, so the same walk usually finds the
+  // next key too (see scan_successor).
+  void get_key_messages(const Key &k,
+                        std::vector<std::pair<MessageKey<Key>, Message<Value>>> &msgs,
+                        scan_successor &succ) const
+  {
+    std::vector<std::pair<MessageKey<Key>, Message<Value>>> ours;
+    node_pin cur = pin_root_shared();
+    while (true)
+    {
+      const node_pointer *next;
+      ours.clear();
+      cur->get_key_messages(k, ours, next, succ);
+      // Messages further down are older.
+      msgs.insert(msgs.begin(), ours.begin(), ours.end());
+      if (next == NULL)
+        break;
+      node_pin child = next->read_pin();
+      cur = std::move(child);
+    }
   }
 
   void dump_messages(void)
@@ -1282,14 +2833,14 @@ public:
 
     try
     {
-      current = root->get_next_message(NULL);
+      current = pin_root_shared()->get_next_message(*this, NULL);
       do
       {
         std::cout << current.first.key << " "
                   << current.first.timestamp << " "
                   << current.second.opcode << " "
                   << current.second.val << std::endl;
-        current = root->get_next_message(&current.first);
+        current = pin_root_shared()->get_next_message(*this, &current.first);
       } while (1);
     }
     catch (std::out_of_range e)
@@ -1318,9 +2869,11 @@ public:
           first(),
           second()
     {
+      latency_timer timer(bet.latency_of(LATENCY_SCAN));
+      alloc_scope scope(ALLOC_NODE);
       try
       {
-        position = bet.root->get_next_message(mkey);
+        position = bet.pin_root_shared()->get_next_message(bet, mkey);
         pos_is_valid = true;
         setup_next_element();
       }
@@ -1354,17 +2907,39 @@ public:
       }
     }
 
+    // position only names the next key to look at.  Its messages are
+    // read afresh in one pass down its path, so a flush or drain that
+    // runs between two steps cannot show us some of them twice or not
+    // at all.  Only when the next key may lie beyond the subtrees that
+    // walk passed through (i.e. when a scan crosses into the next
+    // leaf) do we look for it with a second walk.
     void setup_next_element(void)
     {
       is_valid = false;
-      while (pos_is_valid && (!is_valid || position.first.key == first))
+      while (pos_is_valid && !is_valid)
       {
-        apply(position.first, position.second);
+        Key k = position.first.key;
+        std::vector<std::pair<MessageKey<Key>, Message<Value>>> msgs;
+        scan_successor succ;
+        bet.get_key_messages(k, msgs, succ);
+        for (auto it = msgs.begin(); it != msgs.end(); ++it)
+          apply(it->first, it->second);
+        if (succ.found && (!succ.bounded || !(succ.bound < succ.next.first.key)))
+        {
+          position = succ.next;
+          continue;
+        }
+        if (!succ.found && !succ.bounded)
+        {
+          pos_is_valid = false;
+          continue;
+        }
+        MessageKey<Key> last = MessageKey<Key>::range_end(k);
         try
         {
-          position = bet.root->get_next_message(&position.first);
+          position = bet.pin_root_shared()->get_next_message(bet, &last);
         }
-        catch (std::exception &e)
+        catch (std::out_of_range &e)
         {
           pos_is_valid = false;
         }
@@ -1387,6 +2962,8 @@ public:
 
     iterator &operator++(void)
     {
+      latency_timer timer(bet.latency_of(LATENCY_NEXT));
+      alloc_scope scope(ALLOC_NODE);
       setup_next_element();
       return *this;
     }
@@ -1421,3 +2998,5 @@ public:
     return iterator(*this);
   }
 };
+
+#endif // BETREE_HPP
@@ -0,0 +1,243 @@
+// A plain B+-tree, as a baseline for the betree.
+//
+// Nodes live in a swap_space, just like the betree's, so the two can
+// be compared under the same cache size and backing store.  Leaves
+// map keys to values and internal nodes map the smallest key under
+// each child to that child.  A node that grows past max_node_size
+// entries is split in half on the way back up from an upsert, and a
+// split root gets a new root above it.  There are no buffers: every
+// upsert goes straight down to its leaf.
+//
+// Erased keys are simply taken out of their leaf; leaves are never
+// merged.  The tree is not thread-safe.  Node contents are charged to
+// ALLOC_NODE, as the betree's are (see alloc_stats.hpp).
+
+#ifndef BPLUS_TREE_HPP
+#define BPLUS_TREE_HPP
+
+#include <map>
+#include <iterator>
+#include <stdexcept>
+#include "swap_space.hpp"
+
+template <class Key, class Value>
+class bplus_tree
+{
+private:
+  class node;
+  typedef typename swap_space::pointer<node> node_pointer;
+  typedef typename std::map<Key, node_pointer> child_map;
+  typedef typename std::map<Key, Value> record_map;
+
+  class node : public serializable
+  {
+  public:
+    child_map children;
+    record_map records;
+
+    bool is_leaf(void) const
+    {
+      return children.empty();
+    }
+
+    uint64_t size(void) const
+    {
+      return children.size() + records.size();
+    }
+
+    Key first_key(void) const
+    {
+      return is_leaf() ? records.begin()->first : children.begin()->first;
+    }
+
+    // The child whose subtree holds k.  Keys smaller than every child's
+    // go to the first child.
+    typename child_map::const_iterator find_child(const Key &k) const
+    {
+      auto it = children.upper_bound(k);
+      if (it != children.begin())
+        --it;
+      return it;
+    }
+
+    typename child_map::iterator find_child(const Key &k)
+    {
+      auto it = children.upper_bound(k);
+      if (it != children.begin())
+        --it;
+      return it;
+    }
+
+    // Set k to v, or add v to k's value if add is set.  Returns true if
+    // this node is now too big and its parent should split it.
+    bool upsert(bplus_tree &t, const Key &k, const Value &v, bool add)
+    {
+      if (is_leaf())
+      {
+        auto it = records.find(k);
+        if (it == records.end())
+          records[k] = add ? Value() + v : v;
+        else
+          it->second = add ? it->second + v : v;
+        return size() > t.max_node_size;
+      }
+
+      auto it = find_child(k);
+      // A new smallest key becomes the first child's key.
+      if (k < it->first)
+      {
+        node_pointer child = it->second;
+        children.erase(it);
+        it = children.insert(std::make_pair(k, child)).first;
+      }
+      if (it->second->upsert(t, k, v, add))
+        children.insert(it->second->split(t));
+      return size() > t.max_node_size;
+    }
+
+    // Move the upper half of this node into a new node, and return the
+    // new node with its first key.
+    std::pair<Key, node_pointer> split(bplus_tree &t)
+    {
+      node *right = new node();
+      if (is_leaf())
+      {
+        auto mid = records.begin();
+        std::advance(mid, records.size() / 2);
+        right->records.insert(mid, records.end());
+        records.erase(mid, records.end());
+      }
+      else
+      {
+        auto mid = children.begin();
+        std::advance(mid, children.size() / 2);
+        right->children.insert(mid, children.end());
+        children.erase(mid, children.end());
+      }
+      Key k = right->first_key();
+      return std::make_pair(k, t.ss->allocate(right));
+    }
+
+    void erase(bplus_tree &t, const Key &k)
+    {
+      if (is_leaf())
+        records.erase(k);
+      else if (!(k < children.begin()->first))
+        find_child(k)->second->erase(t, k);
+    }
+
+    Value query(const bplus_tree &t, const Key &k) const
+    {
+      if (is_leaf())
+      {
+        auto it = records.find(k);
+        if (it == records.end())
+          throw std::out_of_range("Key does not exist");
+        return it->second;
+      }
+      return find_child(k)->second->query(t, k);
+    }
+
+    // Count up to n records with keys of at least k in the leaf where k
+    // belongs.  If the tree has leaves after that one, set next to the
+    // first key that can be in them and more to true.
+    uint64_t scan_leaf(const bplus_tree &t, Key k, uint64_t n, Key &next, bool &more) const
+    {
+      if (is_leaf())
+      {
+        uint64_t found = 0;
+        for (auto it = records.lower_bound(k); found < n && it != records.end(); ++it)
+          found++;
+        return found;
+      }
+      auto it = find_child(k);
+      auto after = std::next(it);
+      if (after != children.end())
+      {
+        next = after->first;
+        more = true;
+      }
+      return it->second->scan_leaf(t, k, n, next, more);
+    }
+
+    void _serialize(std::iostream &fs, serialization_context &context)
+    {
+      serialize(fs, context, children);
+      serialize(fs, context, records);
+    }
+
+    void _deserialize(std::iostream &fs, serialization_context &context)
+    {
+      deserialize(fs, context, children);
+      deserialize(fs, context, records);
+    }
+  };
+
+  swap_space *ss;
+  uint64_t max_node_size;
+  node_pointer root;
+
+  void upsert(const Key &k, const Value &v, bool add)
+  {
+    alloc_scope scope(ALLOC_NODE);
+    if (!root->upsert(*this, k, v, add))
+      return;
+    std::pair<Key, node_pointer> right = root->split(*this);
+    const node_pointer &croot = root;
+    Key left_key = croot->first_key();
+    node *new_root = new node();
+    new_root->children[left_key] = root;
+    new_root->children.insert(right);
+    root = ss->allocate(new_root);
+  }
+
+public:
+  bplus_tree(swap_space *sspace, uint64_t maxnodesize = 64)
+      : ss(sspace),
+        max_node_size(maxnodesize)
+  {
+    assert(max_node_size >= 4);
+    alloc_scope scope(ALLOC_NODE);
+    root = ss->allocate(new node());
+  }
+
+  void insert(Key k, Value v)
+  {
+    upsert(k, v, false);
+  }
+
+  // Add v (with operator+) to k's value, as betree::update() does.
+  void update(Key k, Value v)
+  {
+    upsert(k, v, true);
+  }
+
+  void erase(Key k)
+  {
+    alloc_scope scope(ALLOC_NODE);
+    root->erase(*this, k);
+  }
+
+  // Throws std::out_of_range if k has no value.
+  Value query(Key k) const
+  {
+    alloc_scope scope(ALLOC_NODE);
+    return root->query(*this, k);
+  }
+
+  // Count up to n records with keys of at least k, in key order.
+  uint64_t scan(Key k, uint64_t n) const
+  {
+    alloc_scope scope(ALLOC_NODE);
+    uint64_t found = 0;
+    bool more = true;
+    while (found < n && more)
+    {
+      more = false;
+      found += root->scan_leaf(*this, k, n - found, k, more);
+    }
+    return found;
+  }
+};
+
+#endif // BPLUS_TREE_HPP
@@ -0,0 +1,203 @@
+#include "compressor.hpp"
+#include <cstdint>
+#include <cstring>
+#include <vector>
+
+// Matches are found through a hash table of the last position each
+// 4-byte sequence was seen at.
+#define LZ_HASH_LOG (12)
+// Offsets are two bytes.
+#define LZ_MAX_OFFSET (65535)
+// The stream always ends with at least this many literals, and we
+// don't look for matches in inputs shorter than LZ_MIN_INPUT.
+#define LZ_LAST_LITERALS (5)
+#define LZ_MIN_INPUT (13)
+
+static uint32_t read32(const char *p)
+{
+  uint32_t v;
+  memcpy(&v, p, sizeof(v));
+  return v;
+}
+
+static uint32_t lz_hash(uint32_t v)
+{
+  return (v * 2654435761U) >> (32 - LZ_HASH_LOG);
+}
+
+//write the part of a length that does not fit in a nibble.
+static void put_length(std::string &out, size_t len)
+{
+  while (len >= 255) {
+    out.push_back((char)255);
+    len -= 255;
+  }
+  out.push_back((char)len);
+}
+
+static void put_sequence(std::string &out, const char *literals, size_t nliterals,
+			 size_t offset, size_t match_len)
+{
+  size_t ml = match_len ? match_len - LZ_MIN_MATCH : 0;
+  unsigned char token = (nliterals < 15 ? nliterals : 15) << 4;
+  token |= ml < 15 ? ml : 15;
+  out.push_back((char)token);
+  if (nliterals >= 15)
+    put_length(out, nliterals - 15);
+  out.append(literals, nliterals);
+  if (match_len == 0)
+    return;
+  out.push_back((char)(offset & 0xff));
+  out.push_back((char)(offset >> 8));
+  if (ml >= 15)
+    put_length(out, ml - 15);
+}
+
+void lz_compress(const char *src, size_t len, std::string &out)
+{
+  size_t anchor = 0;
+  if (len >= LZ_MIN_INPUT) {
+    // Positions are stored +1 so that 0 means empty.
+    std::vector<uint32_t> table(1 << LZ_HASH_LOG, 0);
+    size_t match_limit = len - LZ_LAST_LITERALS;
+    size_t ip = 0;
+    while (ip + LZ_MIN_MATCH <= match_limit) {
+      uint32_t seq = read32(src + ip);
+      uint32_t h = lz_hash(seq);
+      size_t ref = table[h];
+      table[h] = ip + 1;
+      if (ref == 0 || ip - (ref - 1) > LZ_MAX_OFFSET || read32(src + ref - 1) != seq) {
+	ip++;
+	continue;
+      }
+      ref--;
+      size_t match_len = LZ_MIN_MATCH;
+      while (ip + match_len < match_limit && src[ref + match_len] == src[ip + match_len])
+	match_len++;
+      put_sequence(out, src + anchor, ip - anchor, ip - ref, match_len);
+      ip += match_len;
+      anchor = ip;
+    }
+  }
+  put_sequence(out, src + anchor, len - anchor, 0, 0);
+}
+
+//read the part of a length that did not fit in a nibble.
+static bool get_length(const unsigned char *&ip, const unsigned char *end, size_t &len)
+{
+  unsigned char b;
+  do {
+    if (ip >= end)
+      return false;
+    b = *ip++;
+    len += b;
+  } while (b == 255);
+  return true;
+}
+
+bool lz_decompress(const char *src, size_t len, char *dst, size_t dst_len)
+{
+  const unsigned char *ip = (const unsigned char *)src;
+  const unsigned char *end = ip + len;
+  size_t op = 0;
+
+  while (ip < end) {
+    unsigned char token = *ip++;
+
+    size_t nliterals = token >> 4;
+    if (nliterals == 15 && !get_length(ip, end, nliterals))
+      return false;
+    if (nliterals > (size_t)(end - ip) || nliterals > dst_len - op)
+      return false;
+    memcpy(dst + op, ip, nliterals);
+    ip += nliterals;
+    op += nliterals;
+
+    // The last sequence has no match.
+    if (ip == end)
+      break;
+
+    if (end - ip < 2)
+      return false;
+    size_t offset = ip[0] | (ip[1] << 8);
+    ip += 2;
+    size_t match_len = token & 15;
+    if (match_len == 15 && !get_length(ip, end, match_len))
+      return false;
+    match_len += LZ_MIN_MATCH;
+    if (offset == 0 || offset > op || match_len > dst_len - op)
+      return false;
+    // Matches may overlap their own output, so copy byte by byte.
+    for (size_t i = 0; i < match_len; i++, op++)
+      dst[op] = dst[op - offset];
+  }
+
+  return op == dst_len;
+}
+
+//start a block with the header for an image of size bytes.
+static void put_block_header(std::string &out, int codec, uint64_t size)
+{
+  out.clear();
+  out.push_back((char)BLOCK_MAGIC);
+  out.push_back((char)codec);
+  for (int i = 0; i < 8; i++)
+    out.push_back((char)((size >> (8 * i)) & 0xff));
+}
+
+void encode_block(const std::string &image, int codec, std::string &out)
+{
+  put_block_header(out, codec, image.size());
+  if (codec == CODEC_LZ) {
+    lz_compress(image.data(), image.size(), out);
+    if (out.size() < BLOCK_HEADER_SIZE + image.size())
+      return;
+    out.resize(BLOCK_HEADER_SIZE);
+    out[1] = (char)CODEC_NONE;
+  }
+  out.append(image);
+}
+
+void encode_packed_block(const std::string &image, const std::string &packed, std::string &out)
+{
+  if (packed.size() < image.size()) {
+    put_block_header(out, CODEC_LZ, image.size());
+    out.append(packed);
+  } else {
+    put_block_header(out, CODEC_NONE, image.size());
+    out.append(image);
+  }
+}
+
+bool decode_block(std::string &block, size_t &offset)
+{
+  offset = 0;
+  if (block.empty() || (unsigned char)block[0] != BLOCK_MAGIC)
+    return true;
+  if (block.size() < BLOCK_HEADER_SIZE)
+    return false;
+
+  int codec = (unsigned char)block[1];
+  uint64_t size = 0;
+  for (int i = 0; i < 8; i++)
+    size |= (uint64_t)(unsigned char)block[2 + i] << (8 * i);
+  const char *payload = block.data() + BLOCK_HEADER_SIZE;
+  size_t payload_len = block.size() - BLOCK_HEADER_SIZE;
+
+  switch (codec) {
+  case CODEC_NONE:
+    if (payload_len != size)
+      return false;
+    offset = BLOCK_HEADER_SIZE;
+    return true;
+  case CODEC_LZ: {
+    std::string image(size, '\0');
+    if (!lz_decompress(payload, payload_len, &image[0], size))
+      return false;
+    block.swap(image);
+    return true;
+  }
+  default:
+    return false;
+  }
+}
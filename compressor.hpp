@@ -0,0 +1,55 @@
+// A small, fast LZ77 compressor in the spirit of LZ4, so that the
+// swap space can compress serialized nodes without any external
+// dependency.
+//
+// The compressed stream is a sequence of (literals, match) pairs.
+// Each pair starts with a token byte: the high nibble is the number
+// of literal bytes, the low nibble the match length minus
+// LZ_MIN_MATCH.  A nibble of 15 means more length bytes follow, each
+// adding up to 255.  The literals come next, then a two-byte
+// little-endian offset back into the output.  The last pair has
+// literals only.  The uncompressed size is not stored; callers keep
+// it themselves.
+
+#ifndef COMPRESSOR_HPP
+#define COMPRESSOR_HPP
+
+#include <cstddef>
+#include <string>
+
+// On disk, a compressed image is framed by a small header: a magic
+// byte, a codec byte and the uncompressed size as eight little-endian
+// bytes.  Images written without a header (the plain textual format
+// always starts with a letter) are read back unchanged.
+
+#define LZ_MIN_MATCH (4)
+
+#define BLOCK_MAGIC (0xbe)
+#define BLOCK_HEADER_SIZE (10)
+
+// Codecs recorded in the block header.
+#define CODEC_NONE (0)
+#define CODEC_LZ (1)
+
+// Append the compressed form of src[0..len) to out.
+void lz_compress(const char *src, size_t len, std::string &out);
+
+// Decompress src[0..len) into exactly dst_len bytes at dst.  Returns
+// false if the input is corrupt or does not decompress to dst_len bytes.
+bool lz_decompress(const char *src, size_t len, char *dst, size_t dst_len);
+
+// Frame image with a block header, compressing it with codec.  Falls
+// back to CODEC_NONE if compression does not make it smaller.
+void encode_block(const std::string &image, int codec, std::string &out);
+
+// The same as encode_block(image, CODEC_LZ, out), for an image that has
+// already been compressed into packed with lz_compress.
+void encode_packed_block(const std::string &image, const std::string &packed, std::string &out);
+
+// Undo encode_block in place.  Afterwards the image is the tail of
+// block starting at offset: only a compressed block is rewritten, so
+// an uncompressed one is never copied.  Returns false if the block is
+// corrupt.
+bool decode_block(std::string &block, size_t &offset);
+
+#endif // COMPRESSOR_HPP
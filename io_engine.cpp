@@ -0,0 +1,497 @@
+#include "io_engine.hpp"
+#include <cassert>
+#include <cerrno>
+#include <cstring>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#ifdef __linux__
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+#endif
+
+// Never hand the kernel more than this many bytes in one read/write.
+#define MAX_IO_CHUNK (1ULL << 30)
+
+//size the buffer of a read request to the file it is reading.
+static void prepare_request(io_request *req)
+{
+  req->progress = 0;
+  if (req->op == IO_READ) {
+    struct stat st;
+    if (fstat(req->fd, &st) < 0) {
+      req->error = errno;
+      return;
+    }
+    req->buffer.resize(st.st_size);
+  }
+}
+
+//run whatever is left of a request with blocking system calls, then
+//close its file.  Does not set done; the engine does that under its lock.
+static void run_request_sync(io_request *req)
+{
+  while (req->error == 0 && req->progress < req->buffer.size()) {
+    size_t len = req->buffer.size() - req->progress;
+    if (len > MAX_IO_CHUNK)
+      len = MAX_IO_CHUNK;
+    ssize_t r;
+    if (req->op == IO_READ)
+      r = pread(req->fd, &req->buffer[req->progress], len, req->progress);
+    else
+      r = pwrite(req->fd, req->buffer.data() + req->progress, len, req->progress);
+    if (r < 0 && errno == EINTR)
+      continue;
+    if (r < 0)
+      req->error = errno;
+    else if (r == 0)
+      req->error = EIO;
+    else
+      req->progress += r;
+  }
+  if (req->error == 0 && req->op == IO_WRITE && req->sync && fsync(req->fd) < 0)
+    req->error = errno;
+  close(req->fd);
+  req->fd = -1;
+}
+
+//add a callback to those to be called once req is done.
+static void chain_callback(io_request *req, std::function<void(void)> callback)
+{
+  if (!req->on_done) {
+    req->on_done = callback;
+    return;
+  }
+  std::function<void(void)> first;
+  first.swap(req->on_done);
+  req->on_done = [first, callback]
+    {
+      first();
+      callback();
+    };
+}
+
+io_engine *io_engine::create(bool allow_uring,
+                             unsigned int queue_depth,
+                             unsigned int nthreads)
+{
+#ifdef __linux__
+  if (allow_uring) {
+    io_engine *e = uring_io_engine::create(queue_depth);
+    if (e)
+      return e;
+  }
+#endif
+  return new thread_pool_io_engine(nthreads);
+}
+
+///////////////////////////////////////////////
+// Implementation of the thread_pool_io_engine //
+///////////////////////////////////////////////
+
+thread_pool_io_engine::thread_pool_io_engine(unsigned int nthreads)
+  : stopping(false)
+{
+  assert(nthreads > 0);
+  for (unsigned int i = 0; i < nthreads; i++)
+    workers.push_back(std::thread(&thread_pool_io_engine::worker_main, this));
+}
+
+thread_pool_io_engine::~thread_pool_io_engine(void)
+{
+  {
+    std::lock_guard<std::mutex> lock(mtx);
+    stopping = true;
+  }
+  work_cond.notify_all();
+  for (auto it = workers.begin(); it != workers.end(); ++it)
+    it->join();
+}
+
+void thread_pool_io_engine::submit(io_request *req)
+{
+  assert(req->fd >= 0);
+  prepare_request(req);
+  {
+    std::lock_guard<std::mutex> lock(mtx);
+    queue.push_back(req);
+  }
+  work_cond.notify_one();
+}
+
+void thread_pool_io_engine::wait(io_request *req)
+{
+  std::unique_lock<std::mutex> lock(mtx);
+  done_cond.wait(lock, [req] { return req->done; });
+}
+
+bool thread_pool_io_engine::poll(io_request *req)
+{
+  std::lock_guard<std::mutex> lock(mtx);
+  return req->done;
+}
+
+bool thread_pool_io_engine::notify(io_request *req, std::function<void(void)> callback)
+{
+  std::lock_guard<std::mutex> lock(mtx);
+  if (req->done)
+    return false;
+  chain_callback(req, callback);
+  return true;
+}
+
+//workers drain the queue before exiting so no request is lost.
+void thread_pool_io_engine::worker_main(void)
+{
+  while (true) {
+    io_request *req;
+    {
+      std::unique_lock<std::mutex> lock(mtx);
+      work_cond.wait(lock, [this] { return stopping || !queue.empty(); });
+      if (queue.empty())
+        return;
+      req = queue.front();
+      queue.pop_front();
+    }
+    run_request_sync(req);
+    std::function<void(void)> callback;
+    {
+      std::lock_guard<std::mutex> lock(mtx);
+      req->done = true;
+      callback.swap(req->on_done);
+    }
+    done_cond.notify_all();
+    if (callback)
+      callback();
+  }
+}
+
+#ifdef __linux__
+
+/////////////////////////////////////////
+// Implementation of the uring_io_engine //
+/////////////////////////////////////////
+
+static int sys_io_uring_setup(unsigned int entries, struct io_uring_params *p)
+{
+  return syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int sys_io_uring_enter(int fd, unsigned int to_submit,
+                              unsigned int min_complete, unsigned int flags)
+{
+  return syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags, NULL, 0);
+}
+
+uring_io_engine::uring_io_engine(void)
+  : reaping(false),
+    watched(0),
+    stopping(false),
+    ring_fd(-1),
+    inflight(0),
+    sq_ring(MAP_FAILED),
+    sq_ring_size(0),
+    cq_ring(MAP_FAILED),
+    cq_ring_size(0),
+    sqes_mem(MAP_FAILED),
+    sqes_size(0)
+{}
+
+uring_io_engine *uring_io_engine::create(unsigned int queue_depth)
+{
+  uring_io_engine *e = new uring_io_engine();
+  if (!e->setup(queue_depth)) {
+    delete e;
+    return NULL;
+  }
+  return e;
+}
+
+//create the ring and map its submission queue, completion queue and
+//submission entries into our address space.
+bool uring_io_engine::setup(unsigned int queue_depth)
+{
+  struct io_uring_params p;
+  memset(&p, 0, sizeof(p));
+  ring_fd = sys_io_uring_setup(queue_depth, &p);
+  if (ring_fd < 0)
+    return false;
+
+  sq_ring_size = p.sq_off.array + p.sq_entries * sizeof(unsigned int);
+  cq_ring_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+  bool single_mmap = p.features & IORING_FEAT_SINGLE_MMAP;
+  if (single_mmap) {
+    if (cq_ring_size > sq_ring_size)
+      sq_ring_size = cq_ring_size;
+    cq_ring_size = sq_ring_size;
+  }
+
+  sq_ring = mmap(NULL, sq_ring_size, PROT_READ | PROT_WRITE,
+                 MAP_SHARED | MAP_POPULATE, ring_fd, IORING_OFF_SQ_RING);
+  if (sq_ring == MAP_FAILED)
+    return false;
+  if (single_mmap) {
+    cq_ring = sq_ring;
+  } else {
+    cq_ring = mmap(NULL, cq_ring_size, PROT_READ | PROT_WRITE,
+                   MAP_SHARED | MAP_POPULATE, ring_fd, IORING_OFF_CQ_RING);
+    if (cq_ring == MAP_FAILED)
+      return false;
+  }
+  sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+  sqes_mem = mmap(NULL, sqes_size, PROT_READ | PROT_WRITE,
+                  MAP_SHARED | MAP_POPULATE, ring_fd, IORING_OFF_SQES);
+  if (sqes_mem == MAP_FAILED)
+    return false;
+
+  char *sq = (char *)sq_ring;
+  sq_head = (unsigned int *)(sq + p.sq_off.head);
+  sq_tail = (unsigned int *)(sq + p.sq_off.tail);
+  sq_mask = (unsigned int *)(sq + p.sq_off.ring_mask);
+  sq_entries = (unsigned int *)(sq + p.sq_off.ring_entries);
+  sq_array = (unsigned int *)(sq + p.sq_off.array);
+
+  char *cq = (char *)cq_ring;
+  cq_head = (unsigned int *)(cq + p.cq_off.head);
+  cq_tail = (unsigned int *)(cq + p.cq_off.tail);
+  cq_mask = (unsigned int *)(cq + p.cq_off.ring_mask);
+  cqes = cq + p.cq_off.cqes;
+  return true;
+}
+
+uring_io_engine::~uring_io_engine(void)
+{
+  {
+    std::unique_lock<std::mutex> lock(mtx);
+    while (inflight > 0)
+      reap_blocking(lock);
+    stopping = true;
+  }
+  watch_cond.notify_all();
+  if (notifier.joinable())
+    notifier.join();
+  if (sqes_mem != MAP_FAILED)
+    munmap(sqes_mem, sqes_size);
+  if (cq_ring != MAP_FAILED && cq_ring != sq_ring)
+    munmap(cq_ring, cq_ring_size);
+  if (sq_ring != MAP_FAILED)
+    munmap(sq_ring, sq_ring_size);
+  if (ring_fd >= 0)
+    close(ring_fd);
+}
+
+void uring_io_engine::submit(io_request *req)
+{
+  assert(req->fd >= 0);
+  prepare_request(req);
+  std::lock_guard<std::mutex> lock(mtx);
+  if (req->error) {
+    run_request_sync(req);
+    finish(req);
+    return;
+  }
+  push(req);
+}
+
+void uring_io_engine::wait(io_request *req)
+{
+  std::unique_lock<std::mutex> lock(mtx);
+  while (!req->done)
+    reap_blocking(lock);
+  run_callbacks(lock);
+}
+
+//while somebody sleeps in the kernel, only they take completions off
+//the queue (see reap_blocking()).
+bool uring_io_engine::poll(io_request *req)
+{
+  std::unique_lock<std::mutex> lock(mtx);
+  if (!req->done && !reaping)
+    reap();
+  bool done = req->done;
+  run_callbacks(lock);
+  return done;
+}
+
+bool uring_io_engine::notify(io_request *req, std::function<void(void)> callback)
+{
+  std::lock_guard<std::mutex> lock(mtx);
+  if (req->done)
+    return false;
+  if (!req->on_done)
+    watched++;
+  chain_callback(req, callback);
+  if (!notifier.joinable())
+    notifier = std::thread(&uring_io_engine::notifier_main, this);
+  watch_cond.notify_one();
+  return true;
+}
+
+//a request with a callback is in flight until it is done, so while
+//any are watched there is a completion coming to wake us.
+void uring_io_engine::notifier_main(void)
+{
+  std::unique_lock<std::mutex> lock(mtx);
+  while (true) {
+    watch_cond.wait(lock, [this] { return stopping || watched > 0 || !callbacks.empty(); });
+    if (watched > 0)
+      reap_blocking(lock);
+    run_callbacks(lock);
+    if (stopping && watched == 0 && callbacks.empty())
+      return;
+  }
+}
+
+//run the callbacks of finished requests without holding mtx.  The
+//caller holds mtx through lock.
+void uring_io_engine::run_callbacks(std::unique_lock<std::mutex> &lock)
+{
+  while (!callbacks.empty()) {
+    std::vector<std::function<void(void)>> ready;
+    ready.swap(callbacks);
+    lock.unlock();
+    for (auto it = ready.begin(); it != ready.end(); ++it)
+      (*it)();
+    ready.clear();
+    lock.lock();
+  }
+}
+
+//queue the next step of a request: the rest of its data, or the
+//fsync that finishes a write that asked for one.  Requires mtx.
+void uring_io_engine::push(io_request *req)
+{
+  //the ring is full, so completions are on their way; wait for one
+  //here, holding mtx, as this is rare.
+  while (inflight >= *sq_entries) {
+    wait_for_completion();
+    reap();
+  }
+
+  unsigned int tail = *sq_tail;
+  unsigned int idx = tail & *sq_mask;
+  struct io_uring_sqe *sqe = &((struct io_uring_sqe *)sqes_mem)[idx];
+  memset(sqe, 0, sizeof(*sqe));
+  sqe->fd = req->fd;
+  sqe->user_data = (uint64_t)(uintptr_t)req;
+
+  uint64_t len = req->buffer.size() - req->progress;
+  if (len > MAX_IO_CHUNK)
+    len = MAX_IO_CHUNK;
+  if (req->op == IO_READ) {
+    sqe->opcode = IORING_OP_READ;
+    sqe->addr = (uint64_t)(uintptr_t)&req->buffer[req->progress];
+    sqe->len = len;
+    sqe->off = req->progress;
+  } else if (req->progress < req->buffer.size() || !req->sync) {
+    sqe->opcode = IORING_OP_WRITE;
+    sqe->addr = (uint64_t)(uintptr_t)(req->buffer.data() + req->progress);
+    sqe->len = len;
+    sqe->off = req->progress;
+  } else {
+    sqe->opcode = IORING_OP_FSYNC;
+  }
+
+  sq_array[idx] = idx;
+  __atomic_store_n(sq_tail, tail + 1, __ATOMIC_RELEASE);
+  inflight++;
+  int r;
+  do {
+    r = sys_io_uring_enter(ring_fd, 1, 0, 0);
+  } while (r < 0 && errno == EINTR);
+  assert(r >= 0);
+}
+
+//sleep until the kernel has posted at least one completion.
+void uring_io_engine::wait_for_completion(void)
+{
+  int r;
+  do {
+    r = sys_io_uring_enter(ring_fd, 0, 1, IORING_ENTER_GETEVENTS);
+  } while (r < 0 && errno == EINTR);
+  assert(r >= 0);
+}
+
+//wait for at least one completion, then handle all of them, without
+//holding mtx while we sleep.  If somebody else is already asleep in
+//the kernel, wait for them instead.  Nobody else empties the
+//completion queue meanwhile, so a completion posted before we got
+//into the kernel is still there to wake us.  The caller holds mtx
+//through lock, and must check again whatever it is waiting for.
+void uring_io_engine::reap_blocking(std::unique_lock<std::mutex> &lock)
+{
+  if (reaping) {
+    reaped.wait(lock);
+    return;
+  }
+  reaping = true;
+  lock.unlock();
+  wait_for_completion();
+  lock.lock();
+  reaping = false;
+  reap();
+  reaped.notify_all();
+}
+
+//handle every completion the kernel has posted.  Requires mtx.
+void uring_io_engine::reap(void)
+{
+  unsigned int head = *cq_head;
+  while (head != __atomic_load_n(cq_tail, __ATOMIC_ACQUIRE)) {
+    struct io_uring_cqe *cqe = &((struct io_uring_cqe *)cqes)[head & *cq_mask];
+    io_request *req = (io_request *)(uintptr_t)cqe->user_data;
+    int res = cqe->res;
+    head++;
+    __atomic_store_n(cq_head, head, __ATOMIC_RELEASE);
+    inflight--;
+    complete(req, res);
+  }
+}
+
+//account for one finished step of a request and queue the next one.
+//If the kernel refuses an operation (e.g. IORING_OP_READ on a kernel
+//older than 5.6) we finish the request synchronously instead.
+void uring_io_engine::complete(io_request *req, int res)
+{
+  if (res == -EINTR || res == -EAGAIN) {
+    push(req);
+    return;
+  }
+  if (res < 0) {
+    run_request_sync(req);
+    finish(req);
+    return;
+  }
+
+  bool fsync_done = req->op == IO_WRITE && req->sync && req->progress == req->buffer.size();
+  if (!fsync_done) {
+    if (res == 0 && req->progress < req->buffer.size()) {
+      req->error = EIO;
+    } else {
+      req->progress += res;
+      if (req->progress < req->buffer.size() || (req->op == IO_WRITE && req->sync)) {
+        push(req);
+        return;
+      }
+    }
+  }
+  close(req->fd);
+  req->fd = -1;
+  finish(req);
+}
+
+//mark a request done and set its callback aside to be run once mtx
+//is released.  Requires mtx.
+void uring_io_engine::finish(io_request *req)
+{
+  req->done = true;
+  if (req->on_done) {
+    callbacks.push_back(std::function<void(void)>());
+    callbacks.back().swap(req->on_done);
+    watched--;
+  }
+}
+
+#endif // __linux__
@@ -0,0 +1,182 @@
+// Asynchronous I/O engines used by the backing store.
+//
+// An engine takes whole-file reads and writes on already-open file
+// descriptors and runs them in the background.  submit() returns
+// immediately; wait() blocks until the request has finished and
+// poll() checks without blocking; notify() asks for a callback once
+// it has finished instead.  A write that asks for it (see
+// io_request::sync) is followed by an fsync, so that it is durable
+// once it is done; any other write may still be in the page cache.
+// The engine closes the file descriptor when the request finishes.
+//
+// On Linux we talk to io_uring directly through its system calls, so
+// there is no dependency on liburing.  If the kernel refuses to set
+// up a ring (old kernel, seccomp, ...), or on other platforms, we
+// fall back to a small pool of threads doing pread/pwrite.
+
+#ifndef IO_ENGINE_HPP
+#define IO_ENGINE_HPP
+
+#include <cstdint>
+#include <string>
+#include <deque>
+#include <vector>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <condition_variable>
+
+#define IO_READ (0)
+#define IO_WRITE (1)
+
+// Default number of requests an engine keeps in flight at once.
+#define DEFAULT_IO_QUEUE_DEPTH (64)
+// Default number of workers in the thread pool engine.
+#define DEFAULT_IO_THREADS (4)
+
+// A read or write of one whole object version.
+class io_request
+{
+public:
+  io_request(int opc, uint64_t oid, uint64_t ver)
+      : op(opc),
+        obj_id(oid),
+        version(ver),
+        buffer(),
+        error(0),
+        done(false),
+        sync(false),
+        on_done(),
+        fd(-1),
+        progress(0)
+  {
+  }
+
+  int op;
+  uint64_t obj_id;
+  uint64_t version;
+  // The data to write, or the data that was read.
+  std::string buffer;
+  // 0 on success, otherwise an errno value.
+  int error;
+  bool done;
+  // For a write: fsync the file before the request is done.
+  bool sync;
+  // Set through io_engine::notify().
+  std::function<void(void)> on_done;
+
+  // Owned by the engine while the request is in flight.
+  int fd;
+  uint64_t progress;
+};
+
+class io_engine
+{
+public:
+  virtual ~io_engine(void) {}
+  virtual void submit(io_request *req) = 0;
+  virtual void wait(io_request *req) = 0;
+  virtual bool poll(io_request *req) = 0;
+  // Arrange for callback to be called once req is done, from whatever
+  // thread finishes it and without any engine lock held; it must not
+  // touch req, which its owner may free as soon as it is done.
+  // Returns false, without calling it, if req is already done.
+  virtual bool notify(io_request *req, std::function<void(void)> callback) = 0;
+  virtual const char *name(void) const = 0;
+
+  // Build the best engine available on this machine.
+  static io_engine *create(bool allow_uring = true,
+                           unsigned int queue_depth = DEFAULT_IO_QUEUE_DEPTH,
+                           unsigned int nthreads = DEFAULT_IO_THREADS);
+};
+
+// Workers pull requests off a queue and run them with plain blocking
+// system calls.
+class thread_pool_io_engine : public io_engine
+{
+public:
+  thread_pool_io_engine(unsigned int nthreads);
+  ~thread_pool_io_engine(void);
+  void submit(io_request *req);
+  void wait(io_request *req);
+  bool poll(io_request *req);
+  bool notify(io_request *req, std::function<void(void)> callback);
+  const char *name(void) const { return "thread pool"; }
+
+private:
+  void worker_main(void);
+
+  std::mutex mtx;
+  std::condition_variable work_cond;
+  std::condition_variable done_cond;
+  std::deque<io_request *> queue;
+  std::vector<std::thread> workers;
+  bool stopping;
+};
+
+#ifdef __linux__
+
+// Requests are pushed onto the io_uring submission queue and reaped
+// from the completion queue by whichever thread calls wait() or
+// poll().  One waiter at a time sleeps in the kernel, without mtx;
+// the others wait for it on reaped.  Nobody may be waiting for a
+// request with a callback, so while there are any in flight a
+// notifier thread waits for them.
+class uring_io_engine : public io_engine
+{
+public:
+  // Returns NULL if the kernel does not support io_uring.
+  static uring_io_engine *create(unsigned int queue_depth);
+  ~uring_io_engine(void);
+  void submit(io_request *req);
+  void wait(io_request *req);
+  bool poll(io_request *req);
+  bool notify(io_request *req, std::function<void(void)> callback);
+  const char *name(void) const { return "io_uring"; }
+
+private:
+  uring_io_engine(void);
+  bool setup(unsigned int queue_depth);
+  void push(io_request *req);
+  void wait_for_completion(void);
+  void reap(void);
+  void reap_blocking(std::unique_lock<std::mutex> &lock);
+  void complete(io_request *req, int res);
+  void finish(io_request *req);
+  void run_callbacks(std::unique_lock<std::mutex> &lock);
+  void notifier_main(void);
+
+  std::mutex mtx;
+  std::condition_variable reaped;
+  bool reaping;
+  // Requests in flight with a callback, and the callbacks of finished
+  // requests that have yet to be run.
+  unsigned int watched;
+  std::vector<std::function<void(void)>> callbacks;
+  std::condition_variable watch_cond;
+  std::thread notifier;
+  bool stopping;
+  int ring_fd;
+  unsigned int inflight;
+
+  void *sq_ring;
+  size_t sq_ring_size;
+  void *cq_ring;
+  size_t cq_ring_size;
+  void *sqes_mem;
+  size_t sqes_size;
+
+  unsigned int *sq_head;
+  unsigned int *sq_tail;
+  unsigned int *sq_mask;
+  unsigned int *sq_entries;
+  unsigned int *sq_array;
+  unsigned int *cq_head;
+  unsigned int *cq_tail;
+  unsigned int *cq_mask;
+  void *cqes;
+};
+
+#endif // __linux__
+
+#endif // IO_ENGINE_HPP
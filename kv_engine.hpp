@@ -0,0 +1,166 @@
+// Key-value engines that the benchmark driver (ycsb.cpp) can run side
+// by side on the same workload:
+//
+//   bplus-tree     a plain B+-tree (bplus_tree.hpp)
+//   fixed-<e>      a betree with epsilon e
+//   adaptive-<e>   a betree that adapts epsilon per node, starting at e
+//
+// Every engine keeps its nodes in a swap_space it is handed, so engines
+// given swap spaces with the same cache size and the same kind of
+// backing store run under the same memory budget and pay for the same
+// kind of I/O, and the swap space's counters (swap_space::io_stats)
+// compare directly.  Keys are uint64_t and values strings.
+
+#ifndef KV_ENGINE_HPP
+#define KV_ENGINE_HPP
+
+#include <cstdio>
+#include <string>
+#include "betree.hpp"
+#include "bplus_tree.hpp"
+
+#define ENGINE_BPLUS_TREE (0)
+#define ENGINE_BETREE (1)
+
+class engine_config
+{
+public:
+  std::string name;
+  int type;
+  // For ENGINE_BETREE.
+  bool is_dynamic;
+  float epsilon;
+
+  uint64_t max_node_size;
+  uint64_t min_flush_size;
+  uint64_t maintenance_threads;
+  bool optimistic_reads;
+};
+
+class kv_engine
+{
+public:
+  virtual ~kv_engine(void) {}
+
+  // Overwrites the value k had, if any.
+  virtual void insert(uint64_t k, const std::string &v) = 0;
+  // Returns false if k has no value.
+  virtual bool query(uint64_t k) = 0;
+  // Reads up to n records from k on, and returns how many there were.
+  virtual uint64_t scan(uint64_t k, uint64_t n) = 0;
+  // Wait until no background work is queued or running.
+  virtual void wait_for_maintenance(void) {}
+  // The mean epsilon of the nodes.  A B+-tree is a betree with
+  // epsilon 1.
+  virtual double mean_epsilon(void) const = 0;
+
+  // A new engine of the configured type on sspace.
+  static kv_engine *create(const engine_config &c, swap_space *sspace);
+};
+
+class betree_engine : public kv_engine
+{
+public:
+  betree_engine(const engine_config &c, swap_space *sspace)
+      : tree(sspace, c.max_node_size, c.max_node_size / 4, c.min_flush_size,
+             c.is_dynamic, c.epsilon, 0, 100, 100)
+  {
+    tree.set_maintenance_threads(c.maintenance_threads);
+    tree.set_optimistic_reads(c.optimistic_reads);
+  }
+
+  void insert(uint64_t k, const std::string &v)
+  {
+    tree.insert(k, v);
+  }
+
+  bool query(uint64_t k)
+  {
+    try
+    {
+      tree.query(k);
+      return true;
+    }
+    catch (std::out_of_range &)
+    {
+      return false;
+    }
+  }
+
+  uint64_t scan(uint64_t k, uint64_t n)
+  {
+    uint64_t found = 0;
+    for (auto it = tree.lower_bound(k); found < n && it != tree.end(); ++it)
+      found++;
+    return found;
+  }
+
+  void wait_for_maintenance(void)
+  {
+    tree.wait_for_maintenance();
+  }
+
+  double mean_epsilon(void) const
+  {
+    double sum = 0;
+    uint64_t nodes = 0;
+    for (int i = 0; i <= tree.get_tree_height(); i++)
+    {
+      betree<uint64_t, std::string>::level_shape shape = tree.get_level_shape(i);
+      for (int j = 0; j < SHAPE_EPSILON_BUCKETS; j++)
+        sum += shape.epsilons[j] * (j + 0.5) / SHAPE_EPSILON_BUCKETS;
+      nodes += shape.nodes;
+    }
+    return nodes ? sum / nodes : 0.0;
+  }
+
+  betree<uint64_t, std::string> tree;
+};
+
+class bplus_tree_engine : public kv_engine
+{
+public:
+  bplus_tree_engine(const engine_config &c, swap_space *sspace)
+      : tree(sspace, c.max_node_size)
+  {
+  }
+
+  void insert(uint64_t k, const std::string &v)
+  {
+    tree.insert(k, v);
+  }
+
+  bool query(uint64_t k)
+  {
+    try
+    {
+      tree.query(k);
+      return true;
+    }
+    catch (std::out_of_range &)
+    {
+      return false;
+    }
+  }
+
+  uint64_t scan(uint64_t k, uint64_t n)
+  {
+    return tree.scan(k, n);
+  }
+
+  double mean_epsilon(void) const
+  {
+    return 1.0;
+  }
+
+  bplus_tree<uint64_t, std::string> tree;
+};
+
+inline kv_engine *kv_engine::create(const engine_config &c, swap_space *sspace)
+{
+  if (c.type == ENGINE_BPLUS_TREE)
+    return new bplus_tree_engine(c, sspace);
+  return new betree_engine(c, sspace);
+}
+
+#endif // KV_ENGINE_HPP
@@ -0,0 +1,96 @@
+#include "latency_histogram.hpp"
+
+latency_histogram::latency_histogram(void)
+{
+  reset();
+}
+
+//values below 2 * HALF get a bucket each.  above that, a value whose
+//top bit is bit m keeps its top SUB_BITS bits: it goes to bucket
+//shift * HALF + (value >> shift), where shift = m - (SUB_BITS - 1).
+int latency_histogram::bucket_of(uint64_t value)
+{
+  if (value < 2 * (uint64_t)HALF)
+    return value;
+  int m = 63 - __builtin_clzll(value);
+  int shift = m - (LATENCY_HISTOGRAM_SUB_BITS - 1);
+  return shift * HALF + (value >> shift);
+}
+
+uint64_t latency_histogram::bucket_top(int i)
+{
+  if (i < 2 * HALF)
+    return i;
+  int shift = i / HALF - 1;
+  uint64_t sub = i - shift * HALF;
+  return ((sub + 1) << shift) - 1;
+}
+
+void latency_histogram::record(uint64_t value)
+{
+  counts[bucket_of(value)].fetch_add(1, std::memory_order_relaxed);
+  total.fetch_add(1, std::memory_order_relaxed);
+  sum.fetch_add(value, std::memory_order_relaxed);
+  uint64_t cur = lowest.load(std::memory_order_relaxed);
+  while (value < cur && !lowest.compare_exchange_weak(cur, value, std::memory_order_relaxed))
+    ;
+  cur = highest.load(std::memory_order_relaxed);
+  while (value > cur && !highest.compare_exchange_weak(cur, value, std::memory_order_relaxed))
+    ;
+}
+
+void latency_histogram::reset(void)
+{
+  for (int i = 0; i < NBUCKETS; i++)
+    counts[i] = 0;
+  total = 0;
+  sum = 0;
+  lowest = UINT64_MAX;
+  highest = 0;
+}
+
+void latency_histogram::merge(const latency_histogram &other)
+{
+  for (int i = 0; i < NBUCKETS; i++)
+    counts[i] += other.counts[i];
+  total += other.total;
+  sum += other.sum;
+  if (other.lowest < lowest)
+    lowest = other.lowest.load();
+  if (other.highest > highest)
+    highest = other.highest.load();
+}
+
+uint64_t latency_histogram::percentile(double p) const
+{
+  uint64_t n = total;
+  if (n == 0)
+    return 0;
+  //the rank of the value we want, counting from 1.
+  uint64_t rank = (uint64_t)(p / 100.0 * n + 0.5);
+  if (rank < 1)
+    rank = 1;
+  if (rank > n)
+    rank = n;
+  uint64_t seen = 0;
+  for (int i = 0; i < NBUCKETS; i++) {
+    seen += counts[i];
+    if (seen >= rank)
+      return bucket_top(i) < highest ? bucket_top(i) : highest.load();
+  }
+  return highest;
+}
+
+void latency_histogram::print_header(FILE *out)
+{
+  fprintf(out, "# %-10s %10s %10s %10s %10s %10s %10s %10s %10s\n",
+          "op", "count", "mean", "p50", "p90", "p99", "p99.9", "p99.99", "max");
+}
+
+void latency_histogram::print(FILE *out, const char *name, double scale) const
+{
+  fprintf(out, "# %-10s %10lu %10.2f %10.2f %10.2f %10.2f %10.2f %10.2f %10.2f\n",
+          name, (unsigned long)count(), mean() / scale,
+          percentile(50) / scale, percentile(90) / scale, percentile(99) / scale,
+          percentile(99.9) / scale, percentile(99.99) / scale, max() / scale);
+}
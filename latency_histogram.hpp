@@ -0,0 +1,88 @@
+// A fixed-size latency histogram in the style of HdrHistogram.
+//
+// Values (nanoseconds, say) are counted in buckets whose width grows
+// with the value: every power of two is split into
+// 2^(LATENCY_HISTOGRAM_SUB_BITS - 1) equal buckets, so any recorded
+// value is known to within about 1.5% however large it is, and the
+// whole 64-bit range fits in a few thousand counters.  Recording is
+// one relaxed atomic increment (plus the running min and max), so
+// several threads may record into the same histogram; reading it
+// while they do gives an approximate but usable picture.
+//
+// latency_timer records how long a scope took into a histogram, or
+// does nothing at all (not even read the clock) if given NULL, which
+// is how callers make recording free when it is turned off.
+
+#ifndef LATENCY_HISTOGRAM_HPP
+#define LATENCY_HISTOGRAM_HPP
+
+#include <cstdint>
+#include <cstdio>
+#include <atomic>
+#include <chrono>
+
+// Each power of two is split into 2^(SUB_BITS - 1) buckets.
+#define LATENCY_HISTOGRAM_SUB_BITS (7)
+
+class latency_histogram
+{
+public:
+  latency_histogram(void);
+
+  void record(uint64_t value);
+  void reset(void);
+  // Add other's counts to ours.
+  void merge(const latency_histogram &other);
+
+  uint64_t count(void) const { return total; }
+  uint64_t min(void) const { return total ? lowest.load() : 0; }
+  uint64_t max(void) const { return highest; }
+  double mean(void) const { return total ? (double)sum / total : 0.0; }
+  // The smallest value that at least p percent of the recorded values
+  // are no greater than, to the precision of the buckets.
+  uint64_t percentile(double p) const;
+
+  // One line: name, count, mean, p50, p90, p99, p99.9, p99.99 and max,
+  // with values divided by scale (e.g. 1000 to print ns as us).
+  void print(FILE *out, const char *name, double scale = 1.0) const;
+  // The column headings matching print().
+  static void print_header(FILE *out);
+
+private:
+  static const int HALF = 1 << (LATENCY_HISTOGRAM_SUB_BITS - 1);
+  static const int NBUCKETS = (64 - LATENCY_HISTOGRAM_SUB_BITS + 2) * HALF;
+
+  static int bucket_of(uint64_t value);
+  // The largest value that falls in bucket i.
+  static uint64_t bucket_top(int i);
+
+  std::atomic<uint64_t> counts[NBUCKETS];
+  std::atomic<uint64_t> total;
+  std::atomic<uint64_t> sum;
+  std::atomic<uint64_t> lowest;
+  std::atomic<uint64_t> highest;
+};
+
+class latency_timer
+{
+public:
+  latency_timer(latency_histogram *h)
+    : hist(h)
+  {
+    if (hist)
+      start = std::chrono::steady_clock::now();
+  }
+
+  ~latency_timer(void)
+  {
+    if (hist)
+      hist->record(std::chrono::duration_cast<std::chrono::nanoseconds>(
+                       std::chrono::steady_clock::now() - start).count());
+  }
+
+private:
+  latency_histogram *hist;
+  std::chrono::steady_clock::time_point start;
+};
+
+#endif // LATENCY_HISTOGRAM_HPP
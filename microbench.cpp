@@ -0,0 +1,358 @@
+// Microbenchmarks of the swap space and serialization hot paths.
+//
+// Each benchmark runs one primitive over and over on synthetic leaves
+// of a fixed size (a full leaf of max_node_size messages with -v byte
+// values) and prints the time and the heap allocations per operation.
+// The swap space benchmarks use an in_memory_backing_store, so they
+// measure our code rather than the disk.
+//
+//   pin            pin an in-memory node and read through the pin
+//   load-clean     load a node from the backing store, evicting a
+//                  clean one (which is serialized but not written)
+//   load-dirty     the same, but the evicted node is dirty, so it is
+//                  also written back; the difference from load-clean
+//                  is the cost of a write_back
+//   serialize-map  serialize a leaf's message map
+//   deserialize-map
+//   serialize-string
+//   deserialize-string
+//                  the same for a single value
+//   split          split a full leaf into new nodes
+//
+// Allocations are counted by alloc_stats.hpp, so they include
+// everything the primitive allocates, not only the node.
+
+#include <string.h>
+#include <unistd.h>
+#include "betree.hpp"
+
+#define DEFAULT_MICROBENCH_NOPS (100000)
+#define DEFAULT_MICROBENCH_VALUE_SIZE (100)
+// split builds this many leaves at a time, untimed, and then splits
+// them.
+#define DEFAULT_MICROBENCH_SPLIT_BATCH (256)
+
+// Time and allocations accumulated over the timed parts of a
+// benchmark.
+class measurement
+{
+public:
+  void start(void)
+  {
+    alloc_counts now = alloc_stats::get().total;
+    allocs_at_start = now.allocations;
+    bytes_at_start = now.bytes_allocated;
+    started = std::chrono::steady_clock::now();
+  }
+
+  void stop(void)
+  {
+    ns += std::chrono::duration_cast<std::chrono::nanoseconds>(
+              std::chrono::steady_clock::now() - started)
+              .count();
+    alloc_counts now = alloc_stats::get().total;
+    allocs += now.allocations - allocs_at_start;
+    bytes += now.bytes_allocated - bytes_at_start;
+  }
+
+  static void print_header(FILE *out)
+  {
+    fprintf(out, "# %-18s %10s %12s %12s %12s\n", "benchmark", "ops", "ns/op", "allocs/op", "bytes/op");
+  }
+
+  void print(FILE *out, const char *name, uint64_t nops) const
+  {
+    fprintf(out, "# %-18s %10lu %12.1f %12.2f %12.1f\n", name, (unsigned long)nops,
+            (double)ns / nops, (double)allocs / nops, (double)bytes / nops);
+  }
+
+private:
+  std::chrono::steady_clock::time_point started;
+  uint64_t allocs_at_start = 0;
+  uint64_t bytes_at_start = 0;
+  uint64_t ns = 0;
+  uint64_t allocs = 0;
+  uint64_t bytes = 0;
+};
+
+// A friend of betree, so that it can work on nodes directly.
+class betree_microbench
+{
+public:
+  typedef betree<uint64_t, std::string> tree;
+  typedef tree::node node;
+  typedef tree::node_pointer node_pointer;
+  typedef tree::pivot_map pivot_map;
+  typedef tree::message_map message_map;
+
+  betree_microbench(uint64_t nops, uint64_t value_size)
+      : nops(nops),
+        value(value_size, 'x')
+  {
+  }
+
+  // Fill a leaf with as many messages as it can hold.
+  void fill_leaf(node &n, uint64_t first_key)
+  {
+    for (uint64_t i = 0; i < n.max_node_size; i++)
+      n.elements[MessageKey<uint64_t>(first_key + i, i)] = Message<std::string>(INSERT, value);
+  }
+
+  measurement pin(void)
+  {
+    in_memory_backing_store store;
+    swap_space sspace(&store, 4);
+    node *n = new node();
+    uint64_t size = n->max_node_size;
+    fill_leaf(*n, 0);
+    const node_pointer p = sspace.allocate(n);
+    uint64_t sink = 0;
+    measurement m;
+    m.start();
+    for (uint64_t i = 0; i < nops; i++)
+      sink += p->elements.size();
+    m.stop();
+    assert(sink == nops * size);
+    return m;
+  }
+
+  // Two nodes and room for one, so every access loads one and evicts
+  // the other.
+  measurement load(bool dirty)
+  {
+    in_memory_backing_store store;
+    swap_space sspace(&store, 1);
+    node *a = new node();
+    node *b = new node();
+    uint64_t size = a->max_node_size;
+    fill_leaf(*a, 0);
+    fill_leaf(*b, size);
+    node_pointer pa = sspace.allocate(a);
+    node_pointer pb = sspace.allocate(b);
+    const node_pointer &ca = pa;
+    const node_pointer &cb = pb;
+    // Get both onto the backing store before timing.
+    ca->elements.size();
+    cb->elements.size();
+    uint64_t sink = 0;
+    measurement m;
+    m.start();
+    for (uint64_t i = 0; i < nops; i++)
+    {
+      if (dirty)
+        sink += (i % 2 ? pb : pa)->elements.size();
+      else
+        sink += (i % 2 ? cb : ca)->elements.size();
+    }
+    m.stop();
+    assert(sink == nops * size);
+    return m;
+  }
+
+  measurement serialize_map(void)
+  {
+    in_memory_backing_store store;
+    swap_space sspace(&store, 4);
+    serialization_context ctxt(sspace);
+    node n;
+    fill_leaf(n, 0);
+    uint64_t sink = 0;
+    measurement m;
+    m.start();
+    for (uint64_t i = 0; i < nops; i++)
+    {
+      std::stringstream out;
+      serialize(out, ctxt, n.elements);
+      sink += out.tellp();
+    }
+    m.stop();
+    assert(sink > 0);
+    return m;
+  }
+
+  measurement deserialize_map(void)
+  {
+    in_memory_backing_store store;
+    swap_space sspace(&store, 4);
+    serialization_context ctxt(sspace);
+    node n;
+    fill_leaf(n, 0);
+    std::stringstream out;
+    serialize(out, ctxt, n.elements);
+    std::string image = out.str();
+    uint64_t sink = 0;
+    measurement m;
+    m.start();
+    for (uint64_t i = 0; i < nops; i++)
+    {
+      std::stringstream in(image);
+      // In an arena, as a node's elements are.
+      arena contents;
+      message_map elements((message_map::allocator_type(&contents)));
+      deserialize(in, ctxt, elements);
+      sink += elements.size();
+    }
+    m.stop();
+    assert(sink == nops * n.elements.size());
+    return m;
+  }
+
+  measurement serialize_string(void)
+  {
+    in_memory_backing_store store;
+    swap_space sspace(&store, 4);
+    serialization_context ctxt(sspace);
+    uint64_t sink = 0;
+    measurement m;
+    m.start();
+    for (uint64_t i = 0; i < nops; i++)
+    {
+      std::stringstream out;
+      serialize(out, ctxt, value);
+      sink += out.tellp();
+    }
+    m.stop();
+    assert(sink > 0);
+    return m;
+  }
+
+  measurement deserialize_string(void)
+  {
+    in_memory_backing_store store;
+    swap_space sspace(&store, 4);
+    serialization_context ctxt(sspace);
+    std::stringstream out;
+    serialize(out, ctxt, value);
+    std::string image = out.str();
+    uint64_t sink = 0;
+    measurement m;
+    m.start();
+    for (uint64_t i = 0; i < nops; i++)
+    {
+      std::stringstream in(image);
+      std::string v;
+      deserialize(in, ctxt, v);
+      sink += v.size();
+    }
+    m.stop();
+    assert(sink == nops * value.size());
+    return m;
+  }
+
+  // The leaves are built, and the nodes they split into freed, outside
+  // the timed part.
+  measurement split(void)
+  {
+    in_memory_backing_store store;
+    swap_space sspace(&store, 4 * DEFAULT_MICROBENCH_SPLIT_BATCH);
+    tree bet(&sspace);
+    measurement m;
+    for (uint64_t done = 0; done < nops; done += DEFAULT_MICROBENCH_SPLIT_BATCH)
+    {
+      uint64_t batch = std::min<uint64_t>(DEFAULT_MICROBENCH_SPLIT_BATCH, nops - done);
+      std::vector<node> leaves(batch);
+      for (auto it = leaves.begin(); it != leaves.end(); ++it)
+        fill_leaf(*it, 0);
+      std::vector<pivot_map> results(batch);
+      m.start();
+      for (uint64_t i = 0; i < batch; i++)
+        results[i] = leaves[i].split(bet);
+      m.stop();
+    }
+    return m;
+  }
+
+  uint64_t nops;
+  std::string value;
+};
+
+void usage(char *name)
+{
+  std::cout
+      << "Usage: " << name << " [OPTIONS]" << std::endl
+      << "Times the swap space and serialization primitives" << std::endl
+      << std::endl
+      << "Options are" << std::endl
+      << "    -m <benchmark>                (one of those listed in microbench.cpp) [ default: all ]" << std::endl
+      << "    -t <number_of_operations>     (per benchmark)   [ default: " << DEFAULT_MICROBENCH_NOPS << " ]" << std::endl
+      << "    -v <value_size>               (in bytes)        [ default: " << DEFAULT_MICROBENCH_VALUE_SIZE << " ]" << std::endl;
+}
+
+int main(int argc, char **argv)
+{
+  const char *only = NULL;
+  uint64_t nops = DEFAULT_MICROBENCH_NOPS;
+  uint64_t value_size = DEFAULT_MICROBENCH_VALUE_SIZE;
+
+  int opt;
+  char *term;
+
+  //////////////////////
+  // Argument parsing //
+  //////////////////////
+
+  while ((opt = getopt(argc, argv, "m:t:v:")) != -1)
+  {
+    switch (opt)
+    {
+    case 'm':
+      only = optarg;
+      break;
+    case 't':
+      nops = strtoull(optarg, &term, 10);
+      if (*term || nops == 0)
+      {
+        std::cerr << "Argument to -t must be a positive integer" << std::endl;
+        usage(argv[0]);
+        exit(1);
+      }
+      break;
+    case 'v':
+      value_size = strtoull(optarg, &term, 10);
+      if (*term)
+      {
+        std::cerr << "Argument to -v must be an integer" << std::endl;
+        usage(argv[0]);
+        exit(1);
+      }
+      break;
+    default:
+      std::cerr << "Unknown option '" << (char)opt << "'" << std::endl;
+      usage(argv[0]);
+      exit(1);
+    }
+  }
+
+  ////////////////////////
+  // Run the benchmarks //
+  ////////////////////////
+
+  betree_microbench mb(nops, value_size);
+  bool ran = false;
+  measurement::print_header(stdout);
+#define RUN(name, call)                          \
+  if (only == NULL || strcmp(only, name) == 0)   \
+  {                                              \
+    measurement m = call;                        \
+    m.print(stdout, name, nops);                 \
+    ran = true;                                  \
+  }
+  RUN("pin", mb.pin());
+  RUN("load-clean", mb.load(false));
+  RUN("load-dirty", mb.load(true));
+  RUN("serialize-map", mb.serialize_map());
+  RUN("deserialize-map", mb.deserialize_map());
+  RUN("serialize-string", mb.serialize_string());
+  RUN("deserialize-string", mb.deserialize_string());
+  RUN("split", mb.split());
+#undef RUN
+
+  if (!ran)
+  {
+    std::cerr << "Unknown benchmark '" << only << "'" << std::endl;
+    usage(argv[0]);
+    exit(1);
+  }
+
+  return 0;
+}
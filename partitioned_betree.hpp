@@ -0,0 +1,226 @@
+// A key-partitioned collection of betrees with the betree interface.
+//
+// Every write to a betree goes through its root, so one tree takes
+// one write at a time however many threads call it.  A
+// partitioned_betree routes each key to one of N independent betrees,
+// so writes to different partitions run in parallel.  Each partition
+// should have its own swap_space (and its own backing store
+// directory): partitions then share no cache state either.  The
+// caller builds and owns the trees, and may tune each one as usual.
+//
+// Keys are routed either by range, given N - 1 sorted split keys, or
+// by hash (std::hash<Key>).  Range partitioning keeps each
+// partition's keys contiguous, so a scan walks the partitions one
+// after another; hash partitioning spreads any key distribution
+// evenly, and a scan merges all N partitions' iterators.
+
+#ifndef PARTITIONED_BETREE_HPP
+#define PARTITIONED_BETREE_HPP
+
+#include <cassert>
+#include <deque>
+#include <vector>
+#include <algorithm>
+#include <functional>
+
+#include "betree.hpp"
+
+#define PARTITION_BY_RANGE (0)
+#define PARTITION_BY_HASH (1)
+
+template <class Key, class Value>
+class partitioned_betree
+{
+public:
+  typedef betree<Key, Value> tree;
+
+  // Range partitioning: keys below split_keys[0] go to trees[0], keys
+  // in [split_keys[i - 1], split_keys[i]) go to trees[i], and keys
+  // from split_keys.back() up go to the last tree.
+  partitioned_betree(const std::vector<tree *> &trees_,
+                     const std::vector<Key> &split_keys_)
+      : trees(trees_),
+        split_keys(split_keys_),
+        scheme(PARTITION_BY_RANGE)
+  {
+    assert(trees.size() == split_keys.size() + 1);
+    assert(std::is_sorted(split_keys.begin(), split_keys.end()));
+  }
+
+  // Hash partitioning.
+  partitioned_betree(const std::vector<tree *> &trees_)
+      : trees(trees_),
+        split_keys(),
+        scheme(PARTITION_BY_HASH)
+  {
+    assert(trees.size() > 0);
+  }
+
+  uint64_t partitions(void) const
+  {
+    return trees.size();
+  }
+
+  tree *partition(uint64_t i) const
+  {
+    return trees[i];
+  }
+
+  uint64_t partition_of(const Key &k) const
+  {
+    if (scheme == PARTITION_BY_HASH)
+      return std::hash<Key>()(k) % trees.size();
+    return std::upper_bound(split_keys.begin(), split_keys.end(), k) - split_keys.begin();
+  }
+
+  void insert(Key k, Value v)
+  {
+    trees[partition_of(k)]->insert(k, v);
+  }
+
+  void update(Key k, Value v)
+  {
+    trees[partition_of(k)]->update(k, v);
+  }
+
+  void erase(Key k)
+  {
+    trees[partition_of(k)]->erase(k);
+  }
+
+  Value query(Key k)
+  {
+    return trees[partition_of(k)]->query(k);
+  }
+
+  // Iterates over the whole key space in key order.  With range
+  // partitions it holds one partition's iterator at a time and moves
+  // on to the next partition when it runs out.  With hash partitions
+  // it holds one iterator per partition and always yields the
+  // smallest of their current keys.
+  class iterator
+  {
+  public:
+    iterator(const partitioned_betree &pt)
+        : pt(pt),
+          parts(),
+          next_part(pt.trees.size()),
+          cur(-1),
+          first(),
+          second()
+    {
+    }
+
+    iterator(const partitioned_betree &pt, const Key *start, bool inclusive)
+        : pt(pt),
+          parts(),
+          next_part(0),
+          cur(-1),
+          first(),
+          second()
+    {
+      if (pt.scheme == PARTITION_BY_RANGE)
+      {
+        if (start)
+          next_part = pt.partition_of(*start);
+        parts.push_back(open(*pt.trees[next_part++], start, inclusive));
+      }
+      else
+      {
+        for (; next_part < pt.trees.size(); next_part++)
+          parts.push_back(open(*pt.trees[next_part], start, inclusive));
+      }
+      pick();
+    }
+
+    bool operator==(const iterator &other) const
+    {
+      return &pt == &other.pt &&
+             (cur < 0) == (other.cur < 0) &&
+             (cur < 0 || (first == other.first && second == other.second));
+    }
+
+    bool operator!=(const iterator &other) const
+    {
+      return !operator==(other);
+    }
+
+    iterator &operator++(void)
+    {
+      assert(cur >= 0);
+      ++parts[cur];
+      pick();
+      return *this;
+    }
+
+    const partitioned_betree &pt;
+    std::deque<typename tree::iterator> parts;
+    uint64_t next_part;
+    // Index in parts of the iterator holding the current key, or -1
+    // at the end.
+    int cur;
+    Key first;
+    Value second;
+
+  private:
+    static typename tree::iterator open(const tree &t, const Key *start, bool inclusive)
+    {
+      if (start == NULL)
+        return t.begin();
+      return inclusive ? t.lower_bound(*start) : t.upper_bound(*start);
+    }
+
+    void pick(void)
+    {
+      cur = -1;
+      if (pt.scheme == PARTITION_BY_RANGE)
+      {
+        while (!parts.front().is_valid && next_part < pt.trees.size())
+        {
+          parts.pop_front();
+          parts.push_back(pt.trees[next_part++]->begin());
+        }
+        if (parts.front().is_valid)
+          cur = 0;
+      }
+      else
+      {
+        for (int i = 0; i < (int)parts.size(); i++)
+          if (parts[i].is_valid && (cur < 0 || parts[i].first < parts[cur].first))
+            cur = i;
+      }
+      if (cur >= 0)
+      {
+        first = parts[cur].first;
+        second = parts[cur].second;
+      }
+    }
+  };
+
+  iterator begin(void) const
+  {
+    return iterator(*this, NULL, true);
+  }
+
+  iterator lower_bound(Key key) const
+  {
+    return iterator(*this, &key, true);
+  }
+
+  iterator upper_bound(Key key) const
+  {
+    return iterator(*this, &key, false);
+  }
+
+  iterator end(void) const
+  {
+    return iterator(*this);
+  }
+
+private:
+  std::vector<tree *> trees;
+  std::vector<Key> split_keys;
+  int scheme;
+};
+
+#endif // PARTITIONED_BETREE_HPP
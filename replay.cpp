@@ -0,0 +1,260 @@
+// Replays a binary operation trace (see trace.hpp) against a fresh
+// betree.
+//
+// By default the replay is closed-loop: each operation starts as soon
+// as the previous one finishes, and we report the throughput.  With
+// -R <rate> it is open-loop: operation i is due i / rate seconds after
+// the start, and with -u it is due as long after the first operation
+// as it was when the trace was recorded.
+// An operation that comes due while the previous one is still running
+// starts late, and its response time is counted from when it was due,
+// so a stall shows up in every operation it holds up rather than only
+// in the one that stalled.
+//
+// It ends with the heap allocations per replayed operation and the
+// heap by category (see alloc_stats.hpp).
+
+#include <string.h>
+#include <unistd.h>
+#include <thread>
+#include "betree.hpp"
+#include "trace.hpp"
+
+#define DEFAULT_REPLAY_MAX_NODE_SIZE (1ULL << 6)
+#define DEFAULT_REPLAY_MIN_FLUSH_SIZE (DEFAULT_REPLAY_MAX_NODE_SIZE / 4)
+#define DEFAULT_REPLAY_CACHE_SIZE (1000)
+#define DEFAULT_REPLAY_EPSILON (0.4)
+
+void usage(char *name)
+{
+  std::cout
+      << "Usage: " << name << " [OPTIONS]" << std::endl
+      << "Replays an operation trace against the betree" << std::endl
+      << std::endl
+      << "Options are" << std::endl
+      << "  Required:" << std::endl
+      << "    -d <backing_store_directory>                    [ default: none, parameter is required ]" << std::endl
+      << "    -i <trace_file>                                 [ default: none, parameter is required ]" << std::endl
+      << "  Replay options:" << std::endl
+      << "    -R <ops_per_second>           (open-loop at this rate) [ default: closed-loop ]" << std::endl
+      << "    -u                            (open-loop at the traced times) [ default: closed-loop ]" << std::endl
+      << "  Betree tuning parameters:" << std::endl
+      << "    -N <max_node_size>            (in elements)     [ default: " << DEFAULT_REPLAY_MAX_NODE_SIZE << " ]" << std::endl
+      << "    -f <min_flush_size>           (in elements)     [ default: " << DEFAULT_REPLAY_MIN_FLUSH_SIZE << " ]" << std::endl
+      << "    -C <max_cache_size>           (in betree nodes) [ default: " << DEFAULT_REPLAY_CACHE_SIZE << " ]" << std::endl
+      << "    -e <starting_epsilon>                           [ default: " << DEFAULT_REPLAY_EPSILON << " ]" << std::endl
+      << "    -a                            (adapt epsilon per node) [ default: off ]" << std::endl
+      << "    -M <maintenance_threads>      (background flushes) [ default: 0 (off) ]" << std::endl
+      << "    -Q                            (optimistic lock-free queries) [ default: off ]" << std::endl;
+}
+
+void do_record(betree<uint64_t, std::string> &b, const trace_reader::record &r)
+{
+  switch (r.opcode)
+  {
+  case INSERT:
+    b.insert(r.key, std::string(r.value, r.length));
+    break;
+  case UPDATE:
+    b.update(r.key, std::string(r.value, r.length));
+    break;
+  case DELETE:
+    b.erase(r.key);
+    break;
+  case TRACE_QUERY:
+    try
+    {
+      b.query(r.key);
+    }
+    catch (std::out_of_range &)
+    {
+    }
+    break;
+  default:
+    std::cerr << "Unknown opcode " << r.opcode << " in trace" << std::endl;
+    exit(1);
+  }
+}
+
+int main(int argc, char **argv)
+{
+  char *backing_store_dir = NULL;
+  char *trace_file = NULL;
+  double rate = 0;
+  bool traced_times = false;
+  uint64_t max_node_size = DEFAULT_REPLAY_MAX_NODE_SIZE;
+  uint64_t min_flush_size = DEFAULT_REPLAY_MIN_FLUSH_SIZE;
+  uint64_t cache_size = DEFAULT_REPLAY_CACHE_SIZE;
+  float starting_epsilon = DEFAULT_REPLAY_EPSILON;
+  bool is_dynamic = false;
+  uint64_t maintenance_threads = 0;
+  bool optimistic_reads = false;
+
+  int opt;
+  char *term;
+
+  //////////////////////
+  // Argument parsing //
+  //////////////////////
+
+  while ((opt = getopt(argc, argv, "d:i:R:uN:f:C:e:aM:Q")) != -1)
+  {
+    switch (opt)
+    {
+    case 'd':
+      backing_store_dir = optarg;
+      break;
+    case 'i':
+      trace_file = optarg;
+      break;
+    case 'R':
+      rate = strtod(optarg, &term);
+      if (*term || rate <= 0)
+      {
+        std::cerr << "Argument to -R must be a positive number" << std::endl;
+        usage(argv[0]);
+        exit(1);
+      }
+      break;
+    case 'u':
+      traced_times = true;
+      break;
+    case 'N':
+      max_node_size = strtoull(optarg, &term, 10);
+      if (*term)
+      {
+        std::cerr << "Argument to -N must be an integer" << std::endl;
+        usage(argv[0]);
+        exit(1);
+      }
+      break;
+    case 'f':
+      min_flush_size = strtoull(optarg, &term, 10);
+      if (*term)
+      {
+        std::cerr << "Argument to -f must be an integer" << std::endl;
+        usage(argv[0]);
+        exit(1);
+      }
+      break;
+    case 'C':
+      cache_size = strtoull(optarg, &term, 10);
+      if (*term)
+      {
+        std::cerr << "Argument to -C must be an integer" << std::endl;
+        usage(argv[0]);
+        exit(1);
+      }
+      break;
+    case 'e':
+      starting_epsilon = strtof(optarg, &term);
+      if (*term || starting_epsilon <= 0 || starting_epsilon > 1)
+      {
+        std::cerr << "Argument to -e must be a number in (0, 1]" << std::endl;
+        usage(argv[0]);
+        exit(1);
+      }
+      break;
+    case 'a':
+      is_dynamic = true;
+      break;
+    case 'M':
+      maintenance_threads = strtoull(optarg, &term, 10);
+      if (*term)
+      {
+        std::cerr << "Argument to -M must be an integer" << std::endl;
+        usage(argv[0]);
+        exit(1);
+      }
+      break;
+    case 'Q':
+      optimistic_reads = true;
+      break;
+    default:
+      std::cerr << "Unknown option '" << (char)opt << "'" << std::endl;
+      usage(argv[0]);
+      exit(1);
+    }
+  }
+
+  if (backing_store_dir == NULL || trace_file == NULL)
+  {
+    std::cerr << "-d <backing_store_directory> and -i <trace_file> are required" << std::endl;
+    usage(argv[0]);
+    exit(1);
+  }
+  if (rate > 0 && traced_times)
+  {
+    std::cerr << "-R and -u cannot be used together" << std::endl;
+    usage(argv[0]);
+    exit(1);
+  }
+
+  trace_reader tr(trace_file);
+  if (traced_times && !tr.has_timestamps())
+  {
+    std::cerr << "The trace has no timestamps to replay with -u" << std::endl;
+    exit(1);
+  }
+
+  one_file_per_object_backing_store ofpobs(backing_store_dir);
+  swap_space sspace(&ofpobs, cache_size);
+  betree<uint64_t, std::string> b(&sspace, max_node_size, max_node_size / 4, min_flush_size,
+                                  is_dynamic, starting_epsilon, 0, 100, 100);
+  b.set_maintenance_threads(maintenance_threads);
+  b.set_optimistic_reads(optimistic_reads);
+  b.set_latency_tracking(true);
+
+  ////////////////////////
+  // Replay the trace   //
+  ////////////////////////
+
+  bool open_loop = rate > 0 || traced_times;
+  latency_histogram response;
+  uint64_t nops = 0;
+  uint64_t late = 0;
+  uint64_t first_timestamp = 0;
+  trace_reader::record r;
+  alloc_stats heap_before = alloc_stats::get();
+  std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+  while (tr.next(r))
+  {
+    std::chrono::steady_clock::time_point begin = std::chrono::steady_clock::now();
+    if (open_loop)
+    {
+      if (nops == 0)
+        first_timestamp = r.timestamp;
+      uint64_t due_ns = traced_times ? r.timestamp - first_timestamp : (uint64_t)(nops * 1e9 / rate);
+      std::chrono::steady_clock::time_point due = start + std::chrono::nanoseconds(due_ns);
+      if (begin < due)
+        std::this_thread::sleep_until(due);
+      else
+        late++;
+      begin = due;
+    }
+    do_record(b, r);
+    response.record(std::chrono::duration_cast<std::chrono::nanoseconds>(
+                        std::chrono::steady_clock::now() - begin).count());
+    nops++;
+  }
+  b.wait_for_maintenance();
+  uint64_t timer = std::chrono::duration_cast<std::chrono::microseconds>(
+                       std::chrono::steady_clock::now() - start).count();
+  alloc_stats heap_after = alloc_stats::get();
+
+  double throughput = timer ? (1.0 * nops * 1000000) / timer : 0.0;
+  printf("# replayed: %lu %lu %f\n", (unsigned long)nops, (unsigned long)timer, throughput);
+  if (open_loop)
+    printf("# started late: %lu\n", (unsigned long)late);
+  latency_histogram::print_header(stdout);
+  response.print(stdout, "response", 1000.0);
+  for (int i = 0; i < LATENCY_OPS; i++)
+    if (b.get_latency(i).count())
+      b.get_latency(i).print(stdout, b.latency_name(i), 1000.0);
+  b.print_io_stats(stdout);
+  heap_after.print_per_op(stdout, heap_before, nops);
+  heap_after.print(stdout);
+  b.print_shape(stdout);
+
+  return 0;
+}
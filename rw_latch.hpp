@@ -0,0 +1,120 @@
+// A reader/writer latch.
+//
+// Any number of threads may hold the latch shared, or one thread may
+// hold it exclusive.  Waiting writers keep new readers out, so a
+// steady stream of readers cannot starve a writer.  The latch is not
+// recursive: a thread must not take it again, in either mode, while it
+// holds it.
+
+#ifndef RW_LATCH_HPP
+#define RW_LATCH_HPP
+
+#include <mutex>
+#include <condition_variable>
+
+class rw_latch
+{
+public:
+  rw_latch(void)
+      : readers(0),
+        writer(false),
+        waiting_writers(0)
+  {
+  }
+
+  // Both locks return true if they had to wait for the latch.
+  bool lock_shared(void)
+  {
+    std::unique_lock<std::mutex> lock(mtx);
+    bool waited = writer || waiting_writers > 0;
+    cond.wait(lock, [this] { return !writer && waiting_writers == 0; });
+    readers++;
+    return waited;
+  }
+
+  // Both unlocks notify while still holding mtx: the thread we wake
+  // may free the latch as soon as it has it.
+  void unlock_shared(void)
+  {
+    std::lock_guard<std::mutex> lock(mtx);
+    readers--;
+    if (readers == 0 && waiting_writers > 0)
+      cond.notify_all();
+  }
+
+  bool lock(void)
+  {
+    std::unique_lock<std::mutex> lock(mtx);
+    bool waited = writer || readers > 0;
+    waiting_writers++;
+    cond.wait(lock, [this] { return !writer && readers == 0; });
+    waiting_writers--;
+    writer = true;
+    return waited;
+  }
+
+  // Take the latch only if that needs no waiting.
+  bool try_lock_shared(void)
+  {
+    std::lock_guard<std::mutex> lock(mtx);
+    if (writer || waiting_writers > 0)
+      return false;
+    readers++;
+    return true;
+  }
+
+  bool try_lock(void)
+  {
+    std::lock_guard<std::mutex> lock(mtx);
+    if (writer || readers > 0)
+      return false;
+    writer = true;
+    return true;
+  }
+
+  // try_lock() for a writer that will keep trying.  The first failure
+  // queues it as a waiting writer, which keeps new readers out as
+  // lock() does, until it gets the latch or calls cancel_lock().
+  // queued says whether it is queued.
+  bool try_lock(bool &queued)
+  {
+    std::lock_guard<std::mutex> lock(mtx);
+    if (writer || readers > 0) {
+      if (!queued)
+        waiting_writers++;
+      queued = true;
+      return false;
+    }
+    if (queued)
+      waiting_writers--;
+    queued = false;
+    writer = true;
+    return true;
+  }
+
+  void cancel_lock(bool &queued)
+  {
+    std::lock_guard<std::mutex> lock(mtx);
+    if (!queued)
+      return;
+    queued = false;
+    waiting_writers--;
+    cond.notify_all();
+  }
+
+  void unlock(void)
+  {
+    std::lock_guard<std::mutex> lock(mtx);
+    writer = false;
+    cond.notify_all();
+  }
+
+private:
+  std::mutex mtx;
+  std::condition_variable cond;
+  unsigned int readers;
+  bool writer;
+  unsigned int waiting_writers;
+};
+
+#endif // RW_LATCH_HPP
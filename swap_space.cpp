@@ -1,4 +1,7 @@
 #include "swap_space.hpp"
+#include <vector>
+#include <algorithm>
+#include <thread>
 
 
 //Methods to serialize/deserialize different kinds of objects.
@@ -39,7 +42,7 @@ void deserialize(std::iostream &fs, serialization_context &context, float &x)
   assert(fs.good());
 }
 
-void serialize(std::iostream &fs, serialization_context &context, std::string x)
+void serialize(std::iostream &fs, serialization_context &context, const std::string &x)
 {
   fs << x.size() << ",";
   assert(fs.good());
@@ -47,18 +50,23 @@ void serialize(std::iostream &fs, serialization_context &context, std::string x)
   assert(fs.good());
 }
 
+void serialize(std::iostream &fs, serialization_context &context, std::string &x)
+{
+  serialize(fs, context, static_cast<const std::string &>(x));
+}
+
 void deserialize(std::iostream &fs, serialization_context &context, std::string &x)
 {
   size_t length;
   char comma;
   fs >> length >> comma;
   assert(fs.good());
-  char *buf = new char[length];
-  assert(buf);
-  fs.read(buf, length);
+  //read straight into x's own buffer: no temporary, and one copy out
+  //of the stream rather than two.
+  x.resize(length);
+  if (length > 0)
+    fs.read(&x[0], length);
   assert(fs.good());
-  x = std::string(buf, length);
-  delete buf;
 }
 
 
@@ -81,24 +89,264 @@ bool swap_space::cmp_by_last_access(swap_space::object *a, swap_space::object *b
   return a->last_access < b->last_access;
 }
 
-swap_space::swap_space(backing_store *bs, uint64_t n) :
+swap_space::swap_space(backing_store *bs, uint64_t n, uint64_t nshards) :
   backstore(bs),
   max_in_memory_objects(n),
-  objects(),
-  lru_pqueue(cmp_by_last_access)
-{}
+  shards(nshards)
+{
+  assert(nshards > 0);
+  for (int i = 0; i < DEFAULT_OPTIMISTIC_READER_SLOTS; i++) {
+    reader_slots[i].objects[0] = NULL;
+    reader_slots[i].objects[1] = NULL;
+  }
+}
+
+//stop the garbage collector and free whatever it left behind.
+//nothing can read a snapshot once the swap space is gone.
+swap_space::~swap_space(void)
+{
+  {
+    std::lock_guard<std::mutex> lock(io_mutex);
+    for (auto sh = shards.begin(); sh != shards.end(); ++sh)
+      for (auto it = sh->objects.begin(); it != sh->objects.end(); ++it)
+	finish_io(it->second);
+    inflight_writes.clear();
+  }
+
+  if (gc_thread.joinable()) {
+    {
+      std::lock_guard<std::mutex> lock(gc_mutex);
+      gc_stop = true;
+    }
+    gc_cond.notify_one();
+    gc_thread.join();
+  }
+  open_snapshots.clear();
+  reclaim(UINT64_MAX);
+}
+
+void swap_space::set_copy_on_write(bool enable, uint64_t gc_batch)
+{
+  assert(gc_batch > 0);
+  copy_on_write = enable;
+  gc_batch_size = gc_batch;
+  if (enable && !gc_thread.joinable())
+    gc_thread = std::thread(&swap_space::gc_main, this);
+}
+
+uint64_t swap_space::open_snapshot(void)
+{
+  alloc_scope scope(ALLOC_SWAP_SPACE);
+  std::lock_guard<std::mutex> lock(gc_mutex);
+  uint64_t snap = current_epoch++;
+  open_snapshots.insert(snap);
+  return snap;
+}
+
+void swap_space::close_snapshot(uint64_t snap)
+{
+  {
+    std::lock_guard<std::mutex> lock(gc_mutex);
+    auto it = open_snapshots.find(snap);
+    assert(it != open_snapshots.end());
+    open_snapshots.erase(it);
+  }
+  gc_cond.notify_one();
+}
+
+void swap_space::collect_garbage(void)
+{
+  reclaim(UINT64_MAX);
+  std::unique_lock<std::mutex> lock(gc_mutex);
+  reclaimed.wait(lock, [this] { return reclaiming == 0; });
+}
+
+uint64_t swap_space::get_retired_versions(void)
+{
+  std::lock_guard<std::mutex> lock(gc_mutex);
+  return retired_versions.size() + reclaiming;
+}
+
+//an on-disk version is no longer current.  Without copy-on-write it
+//goes away immediately, otherwise it waits for the collector.
+void swap_space::release_version(uint64_t id, uint64_t version)
+{
+  if (!copy_on_write) {
+    backstore->deallocate(id, version);
+    return;
+  }
+
+  alloc_scope scope(ALLOC_SWAP_SPACE);
+  bool wake = false;
+  {
+    std::lock_guard<std::mutex> lock(gc_mutex);
+    retired_versions.push_back(retired_version{id, version, current_epoch});
+    wake = count_reclaimable(gc_batch_size) >= gc_batch_size;
+  }
+  if (wake)
+    gc_cond.notify_one();
+}
+
+//number of retired versions (up to limit) that no open snapshot can see.
+//versions are retired in epoch order, so they form a prefix of the queue.
+//requires gc_mutex.
+uint64_t swap_space::count_reclaimable(uint64_t limit)
+{
+  uint64_t oldest = open_snapshots.empty() ? UINT64_MAX : *open_snapshots.begin();
+  uint64_t n = 0;
+  for (auto it = retired_versions.begin();
+       it != retired_versions.end() && n < limit && it->epoch <= oldest;
+       ++it)
+    n++;
+  return n;
+}
+
+//deallocate up to limit reclaimable versions.  The backing store is
+//called without holding gc_mutex so writers are never blocked on I/O.
+void swap_space::reclaim(uint64_t limit)
+{
+  std::vector<retired_version> batch;
+  {
+    std::lock_guard<std::mutex> lock(gc_mutex);
+    uint64_t n = count_reclaimable(limit);
+    batch.assign(retired_versions.begin(), retired_versions.begin() + n);
+    retired_versions.erase(retired_versions.begin(), retired_versions.begin() + n);
+    reclaiming += n;
+  }
+  for (auto it = batch.begin(); it != batch.end(); ++it)
+    backstore->deallocate(it->id, it->version);
+  {
+    std::lock_guard<std::mutex> lock(gc_mutex);
+    reclaiming -= batch.size();
+  }
+  reclaimed.notify_all();
+}
+
+//body of the garbage collection thread: sleep until a full batch is
+//reclaimable, then free it.
+void swap_space::gc_main(void)
+{
+  while (true) {
+    {
+      std::unique_lock<std::mutex> lock(gc_mutex);
+      gc_cond.wait(lock, [this] {
+	  return gc_stop || count_reclaimable(gc_batch_size) >= gc_batch_size;
+	});
+      if (gc_stop)
+	return;
+    }
+    reclaim(gc_batch_size);
+  }
+}
+
+//a stream buffer that serializes straight into a string, so the image
+//does not have to be copied out of a stringstream afterwards.  The
+//string is written over in place and trimmed by finish(), so a reused
+//string needs no clearing; it is only grown (and zero-filled) when an
+//image outgrows it.
+class image_sink : public std::streambuf {
+public:
+  image_sink(std::string &s, size_t reserve)
+    : out(s)
+  {
+    if (out.capacity() < reserve) {
+      out.clear();
+      out.reserve(reserve);
+    }
+    if (out.empty())
+      out.resize(std::max<size_t>(out.capacity(), 64));
+    setp(&out[0], &out[0] + out.size());
+  }
+
+  void finish(void)
+  {
+    out.resize(pptr() - pbase());
+  }
+
+protected:
+  int_type overflow(int_type c)
+  {
+    size_t used = pptr() - pbase();
+    out.resize(out.size() < out.capacity() ? out.capacity() : 2 * out.size());
+    setp(&out[0], &out[0] + out.size());
+    pbump(used);
+    if (!traits_type::eq_int_type(c, traits_type::eof())) {
+      *pptr() = traits_type::to_char_type(c);
+      pbump(1);
+    }
+    return traits_type::not_eof(c);
+  }
+
+private:
+  std::string &out;
+};
 
 //construct a new object. Called by ss->allocate() via pointer<Referent> construction
 //Does not insert into objects table - that's handled by pointer<Referent>()
-swap_space::object::object(swap_space *sspace, serializable * tgt) {
+swap_space::object::object(swap_space *sspace, uint64_t oid, serializable * tgt) {
   target = tgt;
-  id = sspace->next_id++;
+  seq = 0;
+  id = oid;
   version = 0;
   is_leaf = false;
   refcount = 1;
   last_access = sspace->next_access_time++;
   target_is_dirty = true;
   pincount = 0;
+  loading = false;
+  write_req = NULL;
+  write_old_version = 0;
+  read_req = NULL;
+}
+
+//find an object in its shard.  requires the shard's lock.
+swap_space::object *swap_space::lookup(swap_space::shard &sh, uint64_t id)
+{
+  auto it = sh.objects.find(id);
+  assert(it != sh.objects.end());
+  return it->second;
+}
+
+//find an object.  The caller must hold a reference or pin on it, so it
+//cannot go away after the shard lock is dropped.
+swap_space::object *swap_space::find_object(uint64_t id)
+{
+  shard &sh = shard_of(id);
+  std::lock_guard<std::mutex> lock(sh.mtx);
+  return lookup(sh, id);
+}
+
+//find an object and raise its pin count.  The evictor checks the pin
+//count under the shard lock and keeps the lock until the object is
+//gone, so it cannot take an object somebody is in the middle of
+//pinning.
+swap_space::object *swap_space::pin_object(uint64_t id)
+{
+  shard &sh = shard_of(id);
+  std::lock_guard<std::mutex> lock(sh.mtx);
+  object *obj = lookup(sh, id);
+  obj->pincount++;
+  return obj;
+}
+
+//drop all the I/O state of an object that is about to be deleted.
+void swap_space::forget_object(swap_space::object *obj)
+{
+  std::lock_guard<std::mutex> lock(io_mutex);
+  finish_io(obj);
+  inflight_writes.erase(std::remove(inflight_writes.begin(), inflight_writes.end(), obj),
+			inflight_writes.end());
+  drop_compressed(obj->id);
+}
+
+//the object is already out of the table and nobody can reach it, so
+//only the pool needs the shard lock.
+void swap_space::free_object(swap_space::object *obj)
+{
+  shard &sh = shard_of(obj->id);
+  obj->~object();
+  std::lock_guard<std::mutex> lock(sh.mtx);
+  sh.pool.deallocate(obj, sizeof(object));
 }
 
 //set # of items that can live in ss.
@@ -110,43 +358,355 @@ void swap_space::set_cache_size(uint64_t sz) {
 
 //write an object that lives on disk back to disk
 //only triggers a write if the object is "dirty" (target_is_dirty == true)
+//requires the object's shard lock.
 void swap_space::write_back(swap_space::object *obj)
 {
-  assert(objects.count(obj->id) > 0);
-
   debug(std::cout << "Writing back " << obj->id
 	<< " (" << obj->target << ") "
 	<< "with last access time " << obj->last_access << std::endl);
 
   // This calls _serialize on all the pointers in this object,
   // which keeps refcounts right later on when we delete them all.
-  // In the future, we may also use this to implement in-memory
-  // evictions, i.e. where we first "evict" an object by
-  // compressing it and keeping the compressed version in memory.
+  // The serialized image also goes to the compressed tier, if any.
+  // Serializing and compressing happen before taking io_mutex, so
+  // threads evicting from different shards only serialize on the
+  // bookkeeping.  The image goes straight into this thread's buffer.
+  // A buffer handed over to a write request comes back to the spare
+  // buffers when the write is done, and this thread takes one of them
+  // the next time round.
+  alloc_scope scope(ALLOC_IO);
+  static thread_local std::string buffer;
+  if (buffer.empty())
+    take_spare_buffer(buffer);
   serialization_context ctxt(*this);
-  std::stringstream sstream;
-  serialize(sstream, ctxt, *obj->target);
+  {
+    image_sink sink(buffer, largest_image);
+    std::iostream out(&sink);
+    serialize(out, ctxt, *obj->target);
+    sink.finish();
+  }
   obj->is_leaf = ctxt.is_leaf;
+  uint64_t image_size = buffer.size();
+  uint64_t largest = largest_image;
+  while (image_size > largest && !largest_image.compare_exchange_weak(largest, image_size))
+    ;
+  std::string packed;
+  bool have_packed = max_compressed_bytes > 0;
+  if (have_packed)
+    lz_compress(buffer.data(), buffer.size(), packed);
+
+  //the compressed tier's image is the disk block's payload too, so it
+  //is not compressed a second time.
+  int codec = disk_codec;
+  std::string block;
+  if (obj->target_is_dirty && codec != CODEC_NONE) {
+    take_spare_buffer(block);
+    if (codec == CODEC_LZ && have_packed)
+      encode_packed_block(buffer, packed, block);
+    else
+      encode_block(buffer, codec, block);
+  }
+  std::string &stored = codec != CODEC_NONE ? block : buffer;
 
+  bytes_serialized += image_size;
+  std::lock_guard<std::mutex> lock(io_mutex);
   if (obj->target_is_dirty) {
-    std::string buffer = sstream.str();
-
+    write_backs++;
 
     //modification - ss now controls BSID - split into unique id and version.
     //version increments linearly based uniquely on this version counter.
 
     uint64_t new_version_id = obj->version+1;
 
+    zstats.image_bytes_written += image_size;
+    zstats.stored_bytes_written += stored.size();
+
+    finish_io(obj);
     backstore->allocate(obj->id, new_version_id);
-    std::iostream *out = backstore->get(obj->id, new_version_id);
-    out->write(buffer.data(), buffer.length());
-    backstore->put(out);
+    io_request *req = new io_request(IO_WRITE, obj->id, new_version_id);
+    req->buffer.swap(stored);
+    backstore->submit(req);
 
     //version 0 is the flag that the object exists only in memory.
-    if (obj->version > 0)
-      backstore->deallocate(obj->id, obj->version);
+    //The old version is released once the write completes.
+    obj->write_req = req;
+    obj->write_old_version = obj->version;
     obj->version = new_version_id;
     obj->target_is_dirty = false;
+    inflight_writes.push_back(obj);
+  }
+
+  store_compressed(obj, packed, image_size);
+  reap_writes(true);
+}
+
+void swap_space::set_disk_compression(bool enable)
+{
+  disk_codec = enable ? CODEC_LZ : CODEC_NONE;
+}
+
+void swap_space::set_compressed_cache_size(uint64_t bytes)
+{
+  std::lock_guard<std::mutex> lock(io_mutex);
+  max_compressed_bytes = bytes;
+  while (current_compressed_bytes > max_compressed_bytes)
+    drop_compressed(compressed_lru.back());
+}
+
+swap_space::cache_stats swap_space::get_cache_stats(void)
+{
+  std::lock_guard<std::mutex> lock(io_mutex);
+  cache_stats s = cstats;
+  s.in_memory_objects = current_in_memory_objects;
+  s.object_hits = object_hits;
+  s.object_misses = object_misses;
+  return s;
+}
+
+swap_space::compression_stats swap_space::get_compression_stats(void)
+{
+  std::lock_guard<std::mutex> lock(io_mutex);
+  return zstats;
+}
+
+swap_space::io_stats swap_space::get_io_stats(void)
+{
+  io_stats s;
+  s.node_loads = node_loads;
+  s.bytes_deserialized = bytes_deserialized;
+  s.write_backs = write_backs;
+  s.bytes_serialized = bytes_serialized;
+  s.dirty_evictions = dirty_evictions;
+  s.clean_evictions = clean_evictions;
+  s.pin_waits = pin_waits;
+  s.load_waits = load_waits;
+  backing_store::io_counters c = backstore->get_io_counters();
+  s.disk_reads = c.reads;
+  s.disk_writes = c.writes;
+  s.disk_bytes_written = c.bytes_written;
+  std::lock_guard<std::mutex> lock(io_mutex);
+  s.disk_bytes_read = zstats.stored_bytes_read;
+  return s;
+}
+
+//put the compressed image of the current version of an object into
+//the compressed tier, evicting the least recently stored images to
+//make room.  requires io_mutex.
+void swap_space::store_compressed(swap_space::object *obj, std::string &packed,
+				  uint64_t uncompressed_size)
+{
+  if (max_compressed_bytes == 0 || packed.size() > max_compressed_bytes)
+    return;
+  drop_compressed(obj->id);
+  while (current_compressed_bytes + packed.size() > max_compressed_bytes)
+    drop_compressed(compressed_lru.back());
+
+  compressed_lru.push_front(obj->id);
+  compressed_image &img = compressed_cache[obj->id];
+  img.version = obj->version;
+  img.uncompressed_size = uncompressed_size;
+  img.data.swap(packed);
+  img.lru_pos = compressed_lru.begin();
+  current_compressed_bytes += img.data.size();
+}
+
+//move the image of the current version of an object out of the
+//compressed tier.  Returns false if the tier does not have it.
+//requires io_mutex.
+bool swap_space::take_compressed(swap_space::object *obj, std::string &buffer)
+{
+  auto it = compressed_cache.find(obj->id);
+  if (it == compressed_cache.end())
+    return false;
+  bool ok = it->second.version == obj->version;
+  if (ok) {
+    buffer.resize(it->second.uncompressed_size);
+    ok = lz_decompress(it->second.data.data(), it->second.data.size(),
+		       &buffer[0], buffer.size());
+    assert(ok);
+  }
+  drop_compressed(obj->id);
+  return ok;
+}
+
+//requires io_mutex.
+void swap_space::drop_compressed(uint64_t id)
+{
+  auto it = compressed_cache.find(id);
+  if (it == compressed_cache.end())
+    return;
+  current_compressed_bytes -= it->second.data.size();
+  compressed_lru.erase(it->second.lru_pos);
+  compressed_cache.erase(it);
+}
+
+//start reading an on-disk object in the background.
+void swap_space::prefetch_object(uint64_t tgt)
+{
+  alloc_scope scope(ALLOC_IO);
+  shard &sh = shard_of(tgt);
+  std::lock_guard<std::mutex> slock(sh.mtx);
+  object *obj = lookup(sh, tgt);
+  if (obj->target || obj->loading)
+    return;
+  std::lock_guard<std::mutex> lock(io_mutex);
+  if (obj->write_req || obj->read_req)
+    return;
+  if (compressed_cache.count(tgt) > 0)
+    return;
+  if (inflight_reads >= max_inflight_io)
+    return;
+  debug(std::cout << "Prefetching " << obj->id << " version " << obj->version << std::endl);
+  obj->read_req = new io_request(IO_READ, obj->id, obj->version);
+  backstore->submit(obj->read_req);
+  inflight_reads++;
+}
+
+//like prefetch_object, but reports whether the object can be loaded
+//without waiting for the disk: it is in memory, its image is in
+//memory (compressed tier or write buffer), or its prefetch is done.
+//If not, and ready is given, it is called once the read is done.
+int swap_space::fetch_object(uint64_t tgt, const std::function<void(void)> *ready)
+{
+  alloc_scope scope(ALLOC_IO);
+  shard &sh = shard_of(tgt);
+  std::lock_guard<std::mutex> slock(sh.mtx);
+  object *obj = lookup(sh, tgt);
+  if (obj->target)
+    return FETCH_READY;
+  if (obj->loading)
+    return FETCH_BUSY;
+  std::lock_guard<std::mutex> lock(io_mutex);
+  if (obj->write_req || compressed_cache.count(tgt) > 0)
+    return FETCH_READY;
+  if (obj->read_req == NULL) {
+    if (inflight_reads >= max_inflight_io)
+      return FETCH_BUSY;
+    debug(std::cout << "Fetching " << obj->id << " version " << obj->version << std::endl);
+    obj->read_req = new io_request(IO_READ, obj->id, obj->version);
+    backstore->submit(obj->read_req);
+    inflight_reads++;
+  }
+  if (ready == NULL)
+    return backstore->poll(obj->read_req) ? FETCH_READY : FETCH_BUSY;
+  //notify() refuses a read that is already done.
+  return backstore->notify(obj->read_req, *ready) ? FETCH_WAITING : FETCH_READY;
+}
+
+//get the serialized image of the current version of an object: it is
+//the tail of image starting at offset.  A version that is still being
+//written is served from a copy of its buffer, and a prefetched one
+//from the finished read.  Called by the thread loading obj, without
+//any lock; the disk read happens outside io_mutex.
+void swap_space::read_object(swap_space::object *obj, std::string &image, size_t &offset)
+{
+  io_request *req;
+  offset = 0;
+  {
+    std::lock_guard<std::mutex> lock(io_mutex);
+    if (take_compressed(obj, image)) {
+      cstats.compressed_hits++;
+      return;
+    }
+
+    if (obj->write_req) {
+      cstats.write_buffer_hits++;
+      image = obj->write_req->buffer;
+      unpack_image(image, offset);
+      return;
+    }
+
+    cstats.disk_reads++;
+    req = obj->read_req;
+    if (req) {
+      obj->read_req = NULL;
+      inflight_reads--;
+    }
+  }
+
+  if (req == NULL) {
+    req = new io_request(IO_READ, obj->id, obj->version);
+    backstore->submit(req);
+  }
+  backstore->wait(req);
+  assert(req->error == 0);
+  image.swap(req->buffer);
+  delete req;
+
+  size_t stored = image.size();
+  unpack_image(image, offset);
+  std::lock_guard<std::mutex> lock(io_mutex);
+  zstats.stored_bytes_read += stored;
+  zstats.image_bytes_read += image.size() - offset;
+}
+
+//strip the block header (and compression, if any) from a stored image,
+//in place.
+void swap_space::unpack_image(std::string &block, size_t &offset)
+{
+  bool ok = decode_block(block, offset);
+  assert(ok);
+  (void)ok;
+}
+
+//give buffer a spare buffer's memory, if there is one.
+void swap_space::take_spare_buffer(std::string &buffer)
+{
+  std::lock_guard<std::mutex> lock(buffer_mutex);
+  if (spare_buffers.empty())
+    return;
+  buffer.swap(spare_buffers.back());
+  spare_buffers.pop_back();
+}
+
+//keep the memory of a finished write's buffer for write_back.
+void swap_space::recycle_buffer(std::string &buffer)
+{
+  std::lock_guard<std::mutex> lock(buffer_mutex);
+  if (spare_buffers.size() >= max_inflight_io)
+    return;
+  spare_buffers.emplace_back();
+  spare_buffers.back().swap(buffer);
+}
+
+//wait for the in-flight I/O of an object, if any.  A finished write
+//releases the version it replaced; a prefetch is thrown away.
+//requires io_mutex.
+void swap_space::finish_io(swap_space::object *obj)
+{
+  if (obj->read_req) {
+    backstore->wait(obj->read_req);
+    delete obj->read_req;
+    obj->read_req = NULL;
+    inflight_reads--;
+  }
+  if (obj->write_req == NULL)
+    return;
+  backstore->wait(obj->write_req);
+  assert(obj->write_req->error == 0);
+  if (obj->write_old_version > 0)
+    release_version(obj->id, obj->write_old_version);
+  recycle_buffer(obj->write_req->buffer);
+  delete obj->write_req;
+  obj->write_req = NULL;
+  obj->write_old_version = 0;
+}
+
+//retire finished writes from the front of the in-flight queue.  If
+//block_until_under_limit, also wait on the oldest writes until no more
+//than max_inflight_io remain.  requires io_mutex.
+void swap_space::reap_writes(bool block_until_under_limit)
+{
+  while (!inflight_writes.empty()) {
+    object *obj = inflight_writes.front();
+    if (obj->write_req) {
+      bool must_wait = block_until_under_limit &&
+	inflight_writes.size() > max_inflight_io;
+      if (!must_wait && !backstore->poll(obj->write_req))
+	return;
+      finish_io(obj);
+    }
+    inflight_writes.pop_front();
   }
 }
 
@@ -156,22 +716,146 @@ void swap_space::write_back(swap_space::object *obj)
 //pull objects with low counts first to try and find an object with pincount 0.
 void swap_space::maybe_evict_something(void)
 {
-  while (current_in_memory_objects > max_in_memory_objects) {
-    object *obj = NULL;
-    for (auto it = lru_pqueue.begin(); it != lru_pqueue.end(); ++it)
-      if ((*it)->pincount == 0) {
-	obj = *it;
-	break;
-      }
-    if (obj == NULL)
+  while (current_in_memory_objects > max_in_memory_objects)
+    if (!evict_one())
       return;
-    lru_pqueue.erase(obj);
+}
+
+//write back and drop the least recently used unpinned object.  Each
+//shard keeps its own LRU queue, so we look at the oldest candidate of
+//every shard and evict the oldest of those.  Returns false if nothing
+//in memory can be evicted.
+bool swap_space::evict_one(void)
+{
+  auto first_unpinned = [](shard &sh) -> object * {
+    for (auto it = sh.lru_pqueue.begin(); it != sh.lru_pqueue.end(); ++it)
+      if ((*it)->pincount == 0 && (*it)->target)
+	return *it;
+    return NULL;
+  };
+
+  shard *victim = NULL;
+  uint64_t oldest = UINT64_MAX;
+  for (auto sh = shards.begin(); sh != shards.end(); ++sh) {
+    std::lock_guard<std::mutex> lock(sh->mtx);
+    object *obj = first_unpinned(*sh);
+    if (obj && obj->last_access < oldest) {
+      oldest = obj->last_access;
+      victim = &*sh;
+    }
+  }
+  if (victim == NULL)
+    return false;
+
+  // Somebody may have used or evicted our candidate in the meantime,
+  // so look again.
+  std::lock_guard<std::mutex> lock(victim->mtx);
+  object *obj = first_unpinned(*victim);
+  if (obj == NULL)
+    return true;
+  victim->lru_pqueue.erase(obj);
+
+  //serializing clears the child pointers optimistic readers follow.
+  obj->seq++;
+  wait_for_optimistic_readers(obj);
+  if (obj->target_is_dirty)
+    dirty_evictions++;
+  else
+    clean_evictions++;
+  write_back(obj);
+
+  delete obj->target;
+  obj->target = NULL;
+  obj->seq++;
+  current_in_memory_objects--;
+  return true;
+}
 
-    write_back(obj);
-    
-    delete obj->target;
-    obj->target = NULL;
-    current_in_memory_objects--;
+//reader slots are numbered per thread, the same in every swap space.
+//a thread takes a number the first time it reads optimistically and
+//gives it back when it exits.
+static std::mutex reader_number_mutex;
+static std::vector<int> free_reader_numbers;
+static int next_reader_number = 0;
+static std::atomic<int> reader_numbers_in_use{0};
+
+class reader_number {
+public:
+  reader_number(void) : n(-1) {
+    std::lock_guard<std::mutex> lock(reader_number_mutex);
+    if (!free_reader_numbers.empty()) {
+      n = free_reader_numbers.back();
+      free_reader_numbers.pop_back();
+    } else if (next_reader_number < DEFAULT_OPTIMISTIC_READER_SLOTS) {
+      n = next_reader_number++;
+      reader_numbers_in_use = next_reader_number;
+    }
+  }
+
+  ~reader_number(void) {
+    if (n < 0)
+      return;
+    std::lock_guard<std::mutex> lock(reader_number_mutex);
+    free_reader_numbers.push_back(n);
   }
+
+  int n;
+};
+
+static int my_reader_number(void)
+{
+  static thread_local reader_number number;
+  return number.n;
 }
 
+swap_space::optimistic_reader::optimistic_reader(swap_space *sspace)
+  : ss(sspace),
+    slot(NULL),
+    cur(0),
+    current(NULL),
+    current_seq(0),
+    ntouched(0)
+{
+  int n = my_reader_number();
+  if (n >= 0)
+    slot = &ss->reader_slots[n];
+}
+
+//let go of the last object, then refresh the LRU positions of what we
+//read, now that taking the shard locks is safe.
+swap_space::optimistic_reader::~optimistic_reader(void)
+{
+  if (slot == NULL)
+    return;
+  slot->objects[0] = NULL;
+  slot->objects[1] = NULL;
+
+  static thread_local uint64_t nreads = 0;
+  if (++nreads % DEFAULT_OPTIMISTIC_TOUCH_INTERVAL == 0)
+    for (int i = 0; i < ntouched; i++)
+      ss->touch(touched[i]);
+}
+
+//the caller made obj's sequence number odd first, so a reader that
+//publishes obj after we look at its slot sees that and backs off.
+void swap_space::wait_for_optimistic_readers(swap_space::object *obj)
+{
+  int n = reader_numbers_in_use;
+  for (int i = 0; i < n; i++)
+    while (reader_slots[i].objects[0] == obj || reader_slots[i].objects[1] == obj)
+      std::this_thread::yield();
+}
+
+void swap_space::touch(uint64_t id)
+{
+  alloc_scope scope(ALLOC_SWAP_SPACE);
+  shard &sh = shard_of(id);
+  std::lock_guard<std::mutex> lock(sh.mtx);
+  auto it = sh.objects.find(id);
+  if (it == sh.objects.end() || it->second->target == NULL)
+    return;
+  object *obj = it->second;
+  sh.lru_pqueue.erase(obj);
+  obj->last_access = next_access_time++;
+  sh.lru_pqueue.insert(obj);
+}
@@ -67,6 +67,64 @@
 // This is just a convenience.  It would be nice to be able to swap in
 // different formats.
 
+// By default, writing back an object allocates a new version on the
+// backing store and immediately deallocates the old one.  In
+// copy-on-write mode (see set_copy_on_write()), superseded versions
+// are instead retired.  A retired version stays on the backing store
+// as long as some snapshot opened before it was superseded is still
+// open.  Retired versions that no snapshot can see are reclaimed in
+// batches by a background garbage collection thread.  Snapshots only
+// control this retention: they do not write back dirty objects and
+// do not record which version of each object was current, so they
+// cannot be read through the swap space.  A caller that wants to
+// read the versions a snapshot holds must write back what it needs
+// and note the versions itself before opening it.
+
+// Write-backs are asynchronous.  The serialized object is handed to
+// the backing store and the swap space moves on; up to
+// max_inflight_io writes may be in flight at once.  The previous
+// version is only released once the new one is durable.  Loading an
+// object whose write is still in flight is served from the write
+// buffer without touching the disk.
+
+// Users that know which objects they will need next can call
+// prefetch() on a pointer.  If the object is on disk, its read is
+// started in the background and the next access waits for it instead
+// of issuing its own read.
+
+// Between memory and disk there is an optional second cache tier of
+// compressed serialized objects (see set_compressed_cache_size()).
+// When an object is evicted, its serialized image is compressed and
+// kept in this tier, so reloading it only costs a decompression.  The
+// tier is sized in bytes, independently of the object cache, and
+// evicts in LRU order.  Objects leave the tier when they are loaded.
+
+// Images written to the backing store can also be compressed (see
+// set_disk_compression()).  Each image is then framed with a small
+// header recording the codec and uncompressed size (compressor.hpp),
+// so compressed and uncompressed images can be mixed on disk.
+
+// The swap space itself may be used from several threads at once.
+// The object table and LRU queue are split into shards by object id,
+// pin and reference counts are atomic, and when several threads miss
+// on the same object only one of them reads it in while the others
+// wait.  This does not make the objects thread-safe by itself, but
+// every object carries a reader/writer latch that callers can hold
+// through a pin to coordinate access to it.
+
+// Read-mostly callers can also read in-memory objects without pinning
+// or latching them at all (see optimistic_reader), so that readers of
+// hot objects do not all write to the same latch and LRU state.  Each
+// object has a sequence number that is odd while a writer holds its
+// exclusive latch or while it is being evicted or freed.  An
+// optimistic reader publishes the object it is about to read in a
+// per-thread slot, checks that the sequence number is even and the
+// object is in memory, reads, and checks the sequence number again.
+// Writers, the evictor and the reference counter make the sequence
+// number odd and then wait until no slot names the object, so a
+// reader never sees an object change or go away under it; when it
+// cannot get in, it falls back on pins.
+
 #ifndef SWAP_SPACE_HPP
 #define SWAP_SPACE_HPP
 
@@ -77,7 +135,18 @@
 #include <functional>
 #include <sstream>
 #include <cassert>
+#include <deque>
+#include <mutex>
+#include <thread>
+#include <condition_variable>
+#include <list>
+#include <vector>
+#include <atomic>
 #include "backing_store.hpp"
+#include "compressor.hpp"
+#include "rw_latch.hpp"
+#include "alloc_stats.hpp"
+#include "arena.hpp"
 #include "debug.hpp"
 
 class swap_space;
@@ -108,16 +177,19 @@ void deserialize(std::iostream &fs, serialization_context &context, int64_t &x);
 void serialize(std::iostream &fs, serialization_context &context, float x);
 void deserialize(std::iostream &fs, serialization_context &context, float &x);
 
-void serialize(std::iostream &fs, serialization_context &context, std::string x);
+// Both, so that neither copies the string nor loses to the
+// serializable template below.
+void serialize(std::iostream &fs, serialization_context &context, const std::string &x);
+void serialize(std::iostream &fs, serialization_context &context, std::string &x);
 void deserialize(std::iostream &fs, serialization_context &context, std::string &x);
 
 
 void serialize(std::iostream &fs, serialization_context &context, bool x);
 void deserialize(std::iostream &fs, serialization_context &context, bool &x);
 
-template<class Key, class Value> void serialize(std::iostream &fs,
+template<class Key, class Value, class Compare, class Alloc> void serialize(std::iostream &fs,
 						serialization_context &context,
-						std::map<Key, Value> &mp)
+						std::map<Key, Value, Compare, Alloc> &mp)
 {
   fs << "map " << mp.size() << " {" << std::endl;
   assert(fs.good());
@@ -131,9 +203,10 @@ template<class Key, class Value> void serialize(std::iostream &fs,
   fs << "}" << std::endl;
 }
 
-template<class Key, class Value> void deserialize(std::iostream &fs,
+// The entries were written in order, so each goes in at the end.
+template<class Key, class Value, class Compare, class Alloc> void deserialize(std::iostream &fs,
 						  serialization_context &context,
-						  std::map<Key, Value> &mp)
+						  std::map<Key, Value, Compare, Alloc> &mp)
 {
   std::string dummy;
   int size = 0;
@@ -145,7 +218,7 @@ template<class Key, class Value> void deserialize(std::iostream &fs,
     deserialize(fs, context, k);
     fs >> dummy;
     deserialize(fs, context, v);
-    mp[k] = v;
+    mp.emplace_hint(mp.end(), std::move(k), std::move(v));
   }
   fs >> dummy;
 }
@@ -175,9 +248,139 @@ template<class X> void deserialize(std::iostream &fs, serialization_context &con
   x._deserialize(fs, context);
 }
 
+// A read-only stream buffer over the tail of a string, so a loaded
+// image can be deserialized where it was read instead of being copied
+// into a stringstream.
+class image_source : public std::streambuf {
+public:
+  image_source(std::string &s, size_t offset)
+  {
+    char *base = &s[0];
+    setg(base + offset, base + offset, base + s.size());
+  }
+};
+
+// Number of reclaimable versions the garbage collector waits for
+// before deallocating them as one batch.
+#define DEFAULT_GC_BATCH_SIZE (64)
+
+// Number of write-backs allowed in flight before we wait for the
+// oldest one.
+#define DEFAULT_MAX_INFLIGHT_IO (32)
+
+// Number of independently locked pieces the object table is split into.
+#define DEFAULT_SWAP_SPACE_SHARDS (16)
+
+// Number of threads that can read optimistically at once; further
+// threads always use pins.
+#define DEFAULT_OPTIMISTIC_READER_SLOTS (64)
+
+// Optimistic reads do not touch the LRU queue, so every this many
+// optimistic reads a thread refreshes the objects it read, to keep
+// hot objects from looking idle.
+#define DEFAULT_OPTIMISTIC_TOUCH_INTERVAL (64)
+
+// What swap_space::fetch() reports about an object.
+#define FETCH_READY (0)
+#define FETCH_WAITING (1)
+#define FETCH_BUSY (2)
+
+// How a pin holds the latch of its object.
+#define LATCH_NONE (0)
+#define LATCH_SHARED (1)
+#define LATCH_EXCLUSIVE (2)
+
 class swap_space {
+private:
+  class object;
+  class reader_slot;
+
 public:
-  swap_space(backing_store *bs, uint64_t n);
+  swap_space(backing_store *bs, uint64_t n,
+	     uint64_t nshards = DEFAULT_SWAP_SPACE_SHARDS);
+  ~swap_space(void);
+
+  // Switch copy-on-write mode on or off.  Turning it off does not
+  // reclaim versions that are already retired; they are still freed
+  // by the collector once no snapshot can see them.
+  void set_copy_on_write(bool enable, uint64_t gc_batch = DEFAULT_GC_BATCH_SIZE);
+
+  // A snapshot keeps every on-disk version that is current when it is
+  // opened alive on the backing store until it is closed.  It only
+  // holds back garbage collection; see above.
+  uint64_t open_snapshot(void);
+  void close_snapshot(uint64_t snap);
+
+  // Number of retired versions still on the backing store, counting
+  // those being deallocated right now.
+  uint64_t get_retired_versions(void);
+
+  // Reclaim every retired version that no open snapshot can see,
+  // without waiting for a full batch.  Returns once they, and any
+  // batch the collector thread was freeing, are off the backing store.
+  void collect_garbage(void);
+
+  // Byte budget of the compressed tier (0 disables it).
+  void set_compressed_cache_size(uint64_t bytes);
+
+  // Where object accesses were served from.  The object tier hit rate
+  // is object_hits / (object_hits + object_misses), and the compressed
+  // tier hit rate is compressed_hits / object_misses.
+  // in_memory_objects is how many objects are loaded right now.
+  class cache_stats {
+  public:
+    uint64_t in_memory_objects = 0;
+    uint64_t object_hits = 0;
+    uint64_t object_misses = 0;
+    uint64_t compressed_hits = 0;
+    uint64_t write_buffer_hits = 0;
+    uint64_t disk_reads = 0;
+    double hit_ratio(void) const {
+      return object_hits + object_misses ? (double)object_hits / (object_hits + object_misses) : 0.0;
+    }
+  };
+  cache_stats get_cache_stats(void);
+
+  // What the cache did and what it cost.  Loads and write-backs count
+  // objects (de)serialized, with the bytes of their images; every
+  // eviction serializes its object, but only dirty ones are written.
+  // pin_waits counts pins that had to wait for another pin's latch,
+  // and load_waits accesses that waited for another thread to finish
+  // loading the object.  The disk_* counters are the requests that
+  // went to the backing store.
+  class io_stats {
+  public:
+    uint64_t node_loads = 0;
+    uint64_t bytes_deserialized = 0;
+    uint64_t write_backs = 0;
+    uint64_t bytes_serialized = 0;
+    uint64_t dirty_evictions = 0;
+    uint64_t clean_evictions = 0;
+    uint64_t pin_waits = 0;
+    uint64_t load_waits = 0;
+    uint64_t disk_reads = 0;
+    uint64_t disk_writes = 0;
+    uint64_t disk_bytes_read = 0;
+    uint64_t disk_bytes_written = 0;
+  };
+  io_stats get_io_stats(void);
+
+  // Compress images written to the backing store from now on.
+  void set_disk_compression(bool enable);
+
+  // Serialized (image) bytes versus bytes actually stored on or read
+  // from the backing store.
+  class compression_stats {
+  public:
+    uint64_t image_bytes_written = 0;
+    uint64_t stored_bytes_written = 0;
+    uint64_t image_bytes_read = 0;
+    uint64_t stored_bytes_read = 0;
+    double write_ratio(void) const {
+      return stored_bytes_written ? (double)image_bytes_written / stored_bytes_written : 1.0;
+    }
+  };
+  compression_stats get_compression_stats(void);
 
   template<class Referent> class pointer;
 
@@ -188,113 +391,227 @@ public:
     return pointer<Referent>(this, tgt);
   }
 
+  //Hint that p will be accessed soon.  Only a hint: it is ignored if
+  //the object is already in memory or too many reads are in flight.
+  template<class Referent>
+  void prefetch(const pointer<Referent> &p) {
+    if (p.target > 0)
+      prefetch_object(p.target);
+  }
+
+  //Returns true if p can be accessed now without waiting for the
+  //disk.  Otherwise starts reading it in the background, if nobody
+  //has yet, and returns false; ask again later.
+  template<class Referent>
+  bool fetch(const pointer<Referent> &p) {
+    return fetch_object(p.target, NULL) == FETCH_READY;
+  }
+
+  //Like fetch(), but instead of asking again later, a caller told
+  //FETCH_WAITING can wait for ready to be called, from whichever
+  //thread finishes the read.  FETCH_BUSY means there is nothing to
+  //wait for (another thread is loading p, or too many reads are in
+  //flight to start one): ask again later.
+  template<class Referent>
+  int fetch(const pointer<Referent> &p, const std::function<void(void)> &ready) {
+    return fetch_object(p.target, &ready);
+  }
+
   // This pins an object in memory for the duration of a member
   // access.  It's sort of an instance of the "resource aquisition is
   // initialization" paradigm.
+  //
+  // A pin can also hold the object's latch, shared or exclusive, for
+  // as long as it lives (see pointer::read_pin() and write_pin()).
+  // Accesses through a shared pin never mark the object dirty.
+  // Moving a pin hands the pin and latch over, which is how callers
+  // crab from one object to the next.
   template<class Referent>
   class pin {
   public:
     const Referent * operator->(void) const {
-      assert(ss->objects.count(target) > 0);
+      assert(obj != NULL);
       debug(std::cout << "Accessing (constly) " << target
-	    << " id " << ss->objects[target]->id << " version " << ss->objects[target]->version << " (" << ss->objects[target]->target << ")" << std::endl);
-      access(target, false);
-      return (const Referent *)ss->objects[target]->target;
+	    << " id " << obj->id << " version " << obj->version << " (" << obj->target << ")" << std::endl);
+      return (const Referent *)access(false);
     }
 
     Referent * operator->(void) {
-      assert(ss->objects.count(target) > 0);
+      assert(obj != NULL);
       debug(std::cout << "Accessing " << target
-	    << " id " << ss->objects[target]->id << " version " << ss->objects[target]->version << " (" << ss->objects[target]->target << ")" << std::endl);
-      access(target, true);
-      return (Referent *)ss->objects[target]->target;
+	    << " id " << obj->id << " version " << obj->version << " (" << obj->target << ")" << std::endl);
+      return (Referent *)access(latch != LATCH_SHARED);
     }
 
-    pin(const pointer<Referent> *p)
+    // If wait is false and the latch is taken, the pin is left empty
+    // (see is_pinned()).  queued is for rw_latch::try_lock().
+    pin(const pointer<Referent> *p, int latch_mode = LATCH_NONE, bool wait = true,
+	bool *queued = NULL)
       : ss(NULL),
-	target(0)
+	target(0),
+	obj(NULL),
+	latch(LATCH_NONE)
     {
-      dopin(p->ss, p->target);
+      dopin(p->ss, p->target, latch_mode, wait, queued);
+      if (obj && p->obj != obj)
+	p->obj = obj;
     }
 
     pin(void)
       : ss(NULL),
-	target(0)
+	target(0),
+	obj(NULL),
+	latch(LATCH_NONE)
     {}
 
+    pin(pin &&other)
+      : ss(other.ss),
+	target(other.target),
+	obj(other.obj),
+	latch(other.latch)
+    {
+      other.ss = NULL;
+      other.target = 0;
+      other.obj = NULL;
+      other.latch = LATCH_NONE;
+    }
+
     ~pin(void) {
       unpin();
     }
 
-    pin &operator=(const pin &other) {
+    pin &operator=(pin &&other) {
       if (&other != this) {
 	unpin();
-	dopin(other.ss, other.target);
+	ss = other.ss;
+	target = other.target;
+	obj = other.obj;
+	latch = other.latch;
+	other.ss = NULL;
+	other.target = 0;
+	other.obj = NULL;
+	other.latch = LATCH_NONE;
       }
+      return *this;
+    }
+
+    // Drop the pin (and latch) before the pin goes out of scope.
+    void release(void) {
+      unpin();
+    }
+
+    bool is_pinned(void) const {
+      return target > 0;
     }
-    
+
   private:
 
     //called when pointer no longer accessed - remove pincount and maybe evict from cache.
     void unpin(void) {
-      debug(std::cout << "Unpinning " << target
-	    << " id " << ss->objects[target]->id << " version " << ss->objects[target]->version << " (" << ss->objects[target]->target << ")" << std::endl);
       if (target > 0) {
-	assert(ss->objects.count(target) > 0);
-	ss->objects[target]->pincount--;
+	debug(std::cout << "Unpinning " << target
+	      << " id " << obj->id << " version " << obj->version << " (" << obj->target << ")" << std::endl);
+	// The evictor takes any unpinned object, so seq has to be even
+	// again before the pin goes.  Once the latch is released a
+	// writer may free the object, so it has to go last.
+	assert(obj->pincount > 0);
+	if (latch == LATCH_EXCLUSIVE)
+	  obj->seq++;
+	obj->pincount--;
+	if (latch == LATCH_SHARED)
+	  obj->latch.unlock_shared();
+	else if (latch == LATCH_EXCLUSIVE)
+	  obj->latch.unlock();
 	ss->maybe_evict_something();
       }
       ss = NULL;
       target = 0;
+      obj = NULL;
+      latch = LATCH_NONE;
     }
 
     //Called when creating pin type - assert target exists, then force load in ss.
-    void dopin(swap_space *newss, uint64_t newtarget) {
+    void dopin(swap_space *newss, uint64_t newtarget, int latch_mode, bool wait, bool *queued) {
       assert(ss == NULL && target == 0);
       ss = newss;
       target = newtarget;
       if (target > 0) {
-	assert(ss->objects.count(target) > 0);
+	obj = ss->pin_object(target);
 	debug(std::cout << "Pinning " << target
-	      << " id " << ss->objects[target]->id << " version " << ss->objects[target]->version << " (" << ss->objects[target]->target << ")" << std::endl);
-	ss->objects[target]->pincount++;
+	      << " id " << obj->id << " version " << obj->version << " (" << obj->target << ")" << std::endl);
+	if (!wait && latch_mode != LATCH_NONE &&
+	    !(latch_mode == LATCH_SHARED ? obj->latch.try_lock_shared() :
+	      queued ? obj->latch.try_lock(*queued) : obj->latch.try_lock())) {
+	  obj->pincount--;
+	  ss->maybe_evict_something();
+	  ss = NULL;
+	  target = 0;
+	  obj = NULL;
+	  return;
+	}
+	if (latch_mode == LATCH_SHARED) {
+	  if (wait && obj->latch.lock_shared())
+	    ss->pin_waits++;
+	} else if (latch_mode == LATCH_EXCLUSIVE) {
+	  if (wait && obj->latch.lock())
+	    ss->pin_waits++;
+	  obj->seq++;
+	  ss->wait_for_optimistic_readers(obj);
+	}
+	latch = latch_mode;
       }
     }
-    
+
     //Called when accessing object, forces load - requires object to be pinned.
-    void access(uint64_t tgt, bool dirty) const {
-      assert(ss->objects.count(tgt) > 0);
-      object *obj = ss->objects[tgt];
-      ss->lru_pqueue.erase(obj);
+    //The pin keeps the object from being evicted once it is loaded, so
+    //the returned pointer stays valid after the shard lock is dropped.
+    serializable *access(bool dirty) const {
+      alloc_scope scope(ALLOC_SWAP_SPACE);
+      shard &sh = ss->shard_of(target);
+      std::unique_lock<std::mutex> lock(sh.mtx);
+      sh.lru_pqueue.erase(obj);
       obj->last_access = ss->next_access_time++;
-      ss->lru_pqueue.insert(obj);
+      sh.lru_pqueue.insert(obj);
       obj->target_is_dirty |= dirty;
-      ss->load<Referent>(tgt);
+      if (obj->target)
+	ss->object_hits++;
+      else
+	ss->object_misses++;
+      ss->load<Referent>(sh, lock, obj);
+      serializable *result = obj->target;
+      lock.unlock();
       ss->maybe_evict_something();
+      return result;
     }
-  
+
     swap_space *ss;
     uint64_t target;
+    object *obj;
+    int latch;
   };
-  
+
   //pointer wrapper that allows for ss control
   template<class Referent>
   class pointer : public serializable {
     friend class swap_space;
     friend class pin<Referent>;
-    
+
   public:
     pointer(void) :
       ss(NULL),
-      target(0)
+      target(0),
+      obj(NULL)
     {}
-    
-    pointer(const pointer &other) {
+
+    pointer(const pointer &other)
+      : obj(NULL)
+    {
       ss = other.ss;
       target = other.target;
       if (target > 0) {
-	assert(ss->objects.count(target) > 0);
-	ss->objects[target]->refcount++;
+	object *o = ss->find_object(target);
+	o->refcount++;
+	obj = o;
       }
     }
 
@@ -305,29 +622,42 @@ public:
     void depoint(void) {
       if (target == 0)
 	return;
-      assert(ss->objects.count(target) > 0);
 
-      object *obj = ss->objects[target];
+      this->obj = NULL;
+      object *obj = ss->find_object(target);
       assert(obj->refcount > 0);
       if ((--obj->refcount) == 0) {
-	debug(std::cout << "Erasing " << target << " id " << ss->objects[target]->id << " version " << ss->objects[target]->version << std::endl);
+	alloc_scope scope(ALLOC_SWAP_SPACE);
+	debug(std::cout << "Erasing " << target << " id " << obj->id << " version " << obj->version << std::endl);
+	// Nobody else can reach the object any more, but the evictor
+	// may still be looking at it until it is out of the table.
+	shard &sh = ss->shard_of(target);
+	std::unique_lock<std::mutex> lock(sh.mtx);
 	// Load it into memory so we can recursively free stuff
 	if (obj->target == NULL) {
 	  assert(obj->version > 0);
 	  if (!obj->is_leaf) {
-	    ss->load<Referent>(target);
+	    ss->load<Referent>(sh, lock, obj);
 	  } else {
-	    debug(std::cout << "Skipping load of leaf " << target << " id " << ss->objects[target]->id << " version " << ss->objects[target]->version << std::endl);
+	    debug(std::cout << "Skipping load of leaf " << target << " id " << obj->id << " version " << obj->version << std::endl);
 	  }
 	}
-	ss->objects.erase(target);
-	ss->lru_pqueue.erase(obj);
-	if (obj->target)
+	sh.objects.erase(target);
+	sh.lru_pqueue.erase(obj);
+	lock.unlock();
+
+	// Deleting the target drops the references it holds, which
+	// takes other shards' locks, so it is done without ours.
+	obj->seq++;
+	ss->wait_for_optimistic_readers(obj);
+	if (obj->target) {
 	  delete obj->target;
-	ss->current_in_memory_objects--;
+	  ss->current_in_memory_objects--;
+	}
+	ss->forget_object(obj);
 	if (obj->version > 0)
-	  ss->backstore->deallocate(obj->id, obj->version);
-	delete obj;
+	  ss->release_version(obj->id, obj->version);
+	ss->free_object(obj);
       }
       target = 0;
     }
@@ -338,8 +668,9 @@ public:
 	ss = other.ss;
 	target = other.target;
 	if (target > 0) {
-	  assert(ss->objects.count(target) > 0);
-	  ss->objects[target]->refcount++;
+	  object *o = ss->find_object(target);
+	  o->refcount++;
+	  obj = o;
 	}
       }
       return *this;
@@ -352,7 +683,7 @@ public:
     bool operator!=(const pointer &other) const {
       return !operator==(other);
     }
-	  
+
     // const Referent * operator->(void) const {
     //   ss->access(target, false);
     //   return ss->objects[target].target;
@@ -369,36 +700,82 @@ public:
     pin<Referent> get_pin(void) {
       return pin<Referent>(this);
     }
-    
+
     const pin<Referent> get_pin(void) const {
       return pin<Referent>(this);
     }
-    
+
+    // Pin the object and hold its latch shared, or exclusive, for
+    // as long as the pin lives.
+    pin<Referent> read_pin(void) const {
+      return pin<Referent>(this, LATCH_SHARED);
+    }
+
+    pin<Referent> write_pin(void) const {
+      return pin<Referent>(this, LATCH_EXCLUSIVE);
+    }
+
+    // Like read_pin() and write_pin(), but return an empty pin
+    // instead of waiting for the latch.
+    pin<Referent> try_read_pin(void) const {
+      return pin<Referent>(this, LATCH_SHARED, false);
+    }
+
+    pin<Referent> try_write_pin(void) const {
+      return pin<Referent>(this, LATCH_EXCLUSIVE, false);
+    }
+
+    // try_write_pin() for a caller that will keep trying: it queues
+    // for the latch, and must call cancel_write_pin() if it stops
+    // trying before it gets it (see rw_latch::try_lock()).
+    pin<Referent> try_write_pin(bool &queued) const {
+      return pin<Referent>(this, LATCH_EXCLUSIVE, false, &queued);
+    }
+
+    void cancel_write_pin(bool &queued) const {
+      if (!queued)
+	return;
+      shard &sh = ss->shard_of(target);
+      std::unique_lock<std::mutex> lock(sh.mtx);
+      object *obj = ss->lookup(sh, target);
+      lock.unlock();
+      obj->latch.cancel_lock(queued);
+    }
+
     bool is_in_memory(void) const {
-      assert(ss->objects.count(target) > 0);
-      return target > 0 && ss->objects[target]->target != NULL;
+      if (target == 0)
+	return false;
+      shard &sh = ss->shard_of(target);
+      std::lock_guard<std::mutex> lock(sh.mtx);
+      return ss->lookup(sh, target)->target != NULL;
     }
 
     bool is_dirty(void) const {
-      assert(ss->objects.count(target) > 0);
-      return target > 0 && ss->objects[target]->target && ss->objects[target]->target_is_dirty;
+      if (target == 0)
+	return false;
+      shard &sh = ss->shard_of(target);
+      std::lock_guard<std::mutex> lock(sh.mtx);
+      object *obj = ss->lookup(sh, target);
+      return obj->target && obj->target_is_dirty;
     }
 
+    // Neither of these looks the target up: they run while the shard
+    // of the object being (de)serialized is locked, and taking another
+    // shard's lock here could deadlock.
     void _serialize(std::iostream &fs, serialization_context &context) {
       assert(target > 0);
-      assert(context.ss.objects.count(target) > 0);
       fs << target << " ";
       target = 0;
+      obj = NULL;
       assert(fs.good());
       context.is_leaf = false;
     }
-    
+
     void _deserialize(std::iostream &fs, serialization_context &context) {
       assert(target == 0);
       ss = &context.ss;
       fs >> target;
       assert(fs.good());
-      assert(context.ss.objects.count(target) > 0);
       // We just created a new reference to this object and
       // invalidated the on-disk reference, so the total refcount
       // stays the same.
@@ -408,81 +785,321 @@ public:
   private:
     swap_space *ss;
     uint64_t target;
+    // The object, once somebody has looked it up, for optimistic
+    // readers, which cannot look it up themselves.
+    mutable std::atomic<object *> obj;
 
     // Only callable through swap_space::allocate(...)
     // This creates new pointers and allocates an object in the ss
     pointer(swap_space *sspace, Referent *tgt)
+      : obj(NULL)
     {
+      alloc_scope scope(ALLOC_SWAP_SPACE);
       ss = sspace;
-      target = sspace->next_id++;
-
-      object *o = new object(sspace, tgt);
-      assert(o != NULL);
-      target = o->id;
-      assert(ss->objects.count(target) == 0);
-      ss->objects[target] = o;
-      ss->lru_pqueue.insert(o);
+
+      target = ss->next_id++;
+      {
+	shard &sh = ss->shard_of(target);
+	std::lock_guard<std::mutex> lock(sh.mtx);
+	object *o = new (sh.pool.allocate(sizeof(object))) object(sspace, target, tgt);
+	obj = o;
+	assert(sh.objects.count(target) == 0);
+	sh.objects[target] = o;
+	sh.lru_pqueue.insert(o);
+      }
       ss->current_in_memory_objects++;
       ss->maybe_evict_something();
     }
 
   };
-  
+
+  // Reads objects that are in memory without pins or latches, moving
+  // from one object to the next hand over hand, as a pinned reader
+  // would with latch crabbing.  enter() returns NULL whenever it
+  // cannot get in (the object is on disk or being written, or no
+  // longer what the pointer points to), and then the caller should
+  // drop the reader and use pins.  Everything read from an object
+  // is only known to be consistent once validate() says so.  A reader
+  // must not take pins, latches or swap space locks while it lives.
+  class optimistic_reader {
+  public:
+    optimistic_reader(swap_space *sspace);
+    ~optimistic_reader(void);
+
+    // False if this thread has no reader slot.
+    bool ok(void) const { return slot != NULL; }
+
+    template<class Referent>
+    const Referent *enter(const pointer<Referent> &p) {
+      object *o = p.obj;
+      if (slot == NULL || o == NULL)
+	return NULL;
+      int next = 1 - cur;
+      slot->objects[next] = o;
+      // Until it was published, o could have been freed.
+      if (p.obj != o)
+	return NULL;
+      uint64_t s = o->seq;
+      serializable *t = o->target;
+      if ((s & 1) || t == NULL)
+	return NULL;
+      slot->objects[cur] = NULL;
+      cur = next;
+      current = o;
+      current_seq = s;
+      if (ntouched < MAX_TOUCHED)
+	touched[ntouched++] = o->id;
+      return (const Referent *)t;
+    }
+
+    // True if the object last entered has not changed since.
+    bool validate(void) const {
+      return current != NULL && current->seq == current_seq;
+    }
+
+  private:
+    static const int MAX_TOUCHED = 16;
+
+    swap_space *ss;
+    reader_slot *slot;
+    int cur;
+    object *current;
+    uint64_t current_seq;
+    uint64_t touched[MAX_TOUCHED];
+    int ntouched;
+  };
+
 private:
-  backing_store *backstore;  
+  backing_store *backstore;
 
-  uint64_t next_id = 1;
-  uint64_t next_access_time = 0;
-  
+  std::atomic<uint64_t> next_id{1};
+  std::atomic<uint64_t> next_access_time{0};
+
+  // Fields of an object are protected by the lock of its shard, except
+  // for the counts, which are atomic, and the in-flight I/O, which is
+  // protected by io_mutex.
   class object {
   public:
-    
-    object(swap_space *sspace, serializable * tgt);
-    
-    serializable * target;
+
+    object(swap_space *sspace, uint64_t oid, serializable * tgt);
+
+    std::atomic<serializable *> target;
+    // Odd while the object may be changing under optimistic readers.
+    std::atomic<uint64_t> seq;
     uint64_t id;
     uint64_t version;
     bool is_leaf;
-    uint64_t refcount;
+    std::atomic<uint64_t> refcount;
     uint64_t last_access;
     bool target_is_dirty;
-    uint64_t pincount;
+    std::atomic<uint64_t> pincount;
+    // Taken through pins; the swap space itself never waits on it.
+    rw_latch latch;
+    // Set while one thread reads the object in.  Everybody else who
+    // needs it waits on the shard's loaded condition.
+    bool loading;
+    // In-flight write of the current version, and the version it
+    // replaces, which is released when the write is done.
+    io_request *write_req;
+    uint64_t write_old_version;
+    // Prefetch of the current version, consumed by the next load.
+    io_request *read_req;
   };
 
   static bool cmp_by_last_access(object *a, object *b);
 
+  // The objects one thread is reading optimistically: the current one
+  // and the one it is moving to.  Padded to a cache line so that
+  // readers do not share lines.
+  class reader_slot {
+  public:
+    std::atomic<object *> objects[2];
+    char padding[64 - 2 * sizeof(std::atomic<object *>)];
+  };
+
+  reader_slot reader_slots[DEFAULT_OPTIMISTIC_READER_SLOTS];
+
+  // Wait until no optimistic reader is in obj.  The caller has made
+  // obj's sequence number odd, so no new reader gets in.
+  void wait_for_optimistic_readers(object *obj);
+  // Move an object to the back of the LRU queue, if it still exists.
+  void touch(uint64_t id);
+
+  typedef std::unordered_map<uint64_t, object *, std::hash<uint64_t>, std::equal_to<uint64_t>,
+			     arena_allocator<std::pair<const uint64_t, object *>>> object_table;
+  typedef std::set<object *, bool (*)(object *, object *), arena_allocator<object *>> lru_queue;
+
+  // Objects are spread over shards by id.  Each shard has its own part
+  // of the object table and its own LRU queue, so threads working on
+  // different objects rarely contend.  Shard locks are never nested,
+  // and io_mutex and gc_mutex are only ever taken after a shard lock.
+  // The shard's objects, table entries and LRU queue nodes come from
+  // its pool (see arena.hpp), under the shard lock, so creating and
+  // dropping objects stays off the general-purpose allocator.  The
+  // pool keeps what it has taken until the swap space goes away.
+  class shard {
+  public:
+    shard(void)
+      : objects(object_table::allocator_type(&pool)),
+	lru_pqueue(cmp_by_last_access, lru_queue::allocator_type(&pool))
+    {}
+    arena pool;
+    std::mutex mtx;
+    std::condition_variable loaded;
+    object_table objects;
+    lru_queue lru_pqueue;
+  };
+
+  shard &shard_of(uint64_t id) { return shards[id % shards.size()]; }
+  object *lookup(shard &sh, uint64_t id);
+  object *find_object(uint64_t id);
+  object *pin_object(uint64_t id);
+  void forget_object(object *obj);
+  // Destroy an object that is out of the table and give its memory back
+  // to its shard's pool.
+  void free_object(object *obj);
+
+  // A superseded on-disk version waiting to be reclaimed.  It is
+  // visible to every snapshot opened before epoch.
+  class retired_version {
+  public:
+    uint64_t id;
+    uint64_t version;
+    uint64_t epoch;
+  };
+
+  void release_version(uint64_t id, uint64_t version);
+  uint64_t count_reclaimable(uint64_t limit);
+  void reclaim(uint64_t limit);
+  void gc_main(void);
+
+  bool copy_on_write = false;
+  uint64_t gc_batch_size = DEFAULT_GC_BATCH_SIZE;
+
+  // Everything below is shared with the garbage collection thread
+  // and protected by gc_mutex.
+  std::mutex gc_mutex;
+  std::condition_variable gc_cond;
+  std::thread gc_thread;
+  bool gc_stop = false;
+  uint64_t current_epoch = 0;
+  std::multiset<uint64_t> open_snapshots;
+  std::deque<retired_version> retired_versions;
+  // Versions taken off retired_versions but not yet deallocated.
+  uint64_t reclaiming = 0;
+  std::condition_variable reclaimed;
+
 
   //ss load - if the object is not in memory (target != null)
-  //bring into memory.
+  //bring into memory.  Called with the object's shard locked; the lock
+  //is dropped while the object is read and deserialized, and only one
+  //thread does that for a given object.
   template<class Referent>
-  void load(uint64_t tgt) {
-    assert(objects.count(tgt) > 0);
-    if (objects[tgt]->target == NULL) {
-      object *obj = objects[tgt];
-      debug(std::cout << "Loading " << obj->id << " version " << obj->version << std::endl);
-      std::iostream *in = backstore->get(obj->id, obj->version);
-      Referent *r = new Referent();
+  void load(shard &sh, std::unique_lock<std::mutex> &lock, object *obj) {
+    if (obj->loading)
+      load_waits++;
+    while (obj->loading)
+      sh.loaded.wait(lock);
+    if (obj->target != NULL)
+      return;
+    debug(std::cout << "Loading " << obj->id << " version " << obj->version << std::endl);
+    obj->loading = true;
+    lock.unlock();
+    Referent *r;
+    {
+      alloc_scope scope(ALLOC_IO);
+      std::string image;
+      size_t offset;
+      read_object(obj, image, offset);
+      node_loads++;
+      bytes_deserialized += image.size() - offset;
+      image_source src(image, offset);
+      std::iostream in(&src);
+      alloc_scope node_scope(ALLOC_NODE);
+      r = new Referent();
       serialization_context ctxt(*this);
-      deserialize(*in, ctxt, *r);
-      backstore->put(in);
-      obj->target = r;
-      current_in_memory_objects++;
+      deserialize(in, ctxt, *r);
     }
+    lock.lock();
+    obj->target = r;
+    obj->loading = false;
+    current_in_memory_objects++;
+    sh.loaded.notify_all();
   }
 
   void set_cache_size(uint64_t sz);
-  
+
+  // A compressed serialized image of one version of an object.
+  class compressed_image {
+  public:
+    uint64_t version;
+    uint64_t uncompressed_size;
+    std::string data;
+    std::list<uint64_t>::iterator lru_pos;
+  };
+
+  void store_compressed(object *obj, std::string &packed, uint64_t uncompressed_size);
+  bool take_compressed(object *obj, std::string &buffer);
+  void drop_compressed(uint64_t id);
+
+  void prefetch_object(uint64_t tgt);
+  int fetch_object(uint64_t tgt, const std::function<void(void)> *ready);
+  void read_object(object *obj, std::string &image, size_t &offset);
+  static void unpack_image(std::string &block, size_t &offset);
   void write_back(object *obj);
+  void take_spare_buffer(std::string &buffer);
+  void recycle_buffer(std::string &buffer);
+  void finish_io(object *obj);
+  void reap_writes(bool block_until_under_limit);
   void maybe_evict_something(void);
-  
-  uint64_t max_in_memory_objects;
-  uint64_t current_in_memory_objects = 0;
-
+  bool evict_one(void);
 
-  //structs used in ss
-  //objects is a map from targets->objects (target == obj->id)
-  std::unordered_map<uint64_t, object *> objects;
-  std::set<object *, bool (*)(object *, object *)> lru_pqueue;
+  uint64_t max_in_memory_objects;
+  std::atomic<uint64_t> current_in_memory_objects{0};
+
+  // Buffers of finished writes, kept for write_back to serialize into.
+  // buffer_mutex is taken last, after io_mutex if at all.
+  std::mutex buffer_mutex;
+  std::vector<std::string> spare_buffers;
+
+  // Everything from here to the shards is protected by io_mutex.
+  std::mutex io_mutex;
+
+  //objects with a write-back in flight, oldest first.
+  std::deque<object *> inflight_writes;
+  uint64_t inflight_reads = 0;
+  uint64_t max_inflight_io = DEFAULT_MAX_INFLIGHT_IO;
+
+  //compressed tier, keyed by object id.  compressed_lru holds ids,
+  //most recently stored first.
+  std::unordered_map<uint64_t, compressed_image> compressed_cache;
+  std::list<uint64_t> compressed_lru;
+  std::atomic<uint64_t> max_compressed_bytes{0};
+  uint64_t current_compressed_bytes = 0;
+
+  // object_hits and object_misses are kept in the atomics, not here.
+  cache_stats cstats;
+  std::atomic<uint64_t> object_hits{0};
+  std::atomic<uint64_t> object_misses{0};
+  std::atomic<uint64_t> node_loads{0};
+  std::atomic<uint64_t> bytes_deserialized{0};
+  std::atomic<uint64_t> write_backs{0};
+  std::atomic<uint64_t> bytes_serialized{0};
+  // The biggest image write_back has made.  It reserves this much room
+  // before serializing, so the image never has to grow.
+  std::atomic<uint64_t> largest_image{0};
+  std::atomic<uint64_t> dirty_evictions{0};
+  std::atomic<uint64_t> clean_evictions{0};
+  std::atomic<uint64_t> pin_waits{0};
+  std::atomic<uint64_t> load_waits{0};
+
+  std::atomic<int> disk_codec{CODEC_NONE};
+  compression_stats zstats;
+
+
+  //the object table, split into shards.  Every object lives in
+  //shard_of(obj->id), keyed by id.
+  std::vector<shard> shards;
 };
 
 #endif // SWAP_SPACE_HPP
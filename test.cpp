@@ -10,10 +10,16 @@
 // on the values, this test performs concatenation on the strings.
 
 #include <string.h>
+#include <errno.h>
 #include <sys/types.h>
 #include <sys/time.h>
+#include <sys/stat.h>
+#include <dirent.h>
 #include <unistd.h>
+#include <thread>
 #include "betree.hpp"
+#include "partitioned_betree.hpp"
+#include "trace.hpp"
 
 void timer_start(uint64_t &timer)
 {
@@ -85,11 +91,11 @@ int next_command(FILE *input, int *op, uint64_t *arg)
   return 0;
 }
 
-template <class Key, class Value>
-void do_scan(typename betree<Key, Value>::iterator &betit,
-             typename std::map<Key, Value>::iterator &refit,
-             betree<Key, Value> &b,
-             typename std::map<Key, Value> &reference)
+template <class Tree, class Map>
+void do_scan(typename Tree::iterator &betit,
+             typename Map::iterator &refit,
+             Tree &b,
+             Map &reference)
 {
   while (refit != reference.end())
   {
@@ -111,6 +117,12 @@ void do_scan(typename betree<Key, Value>::iterator &betit,
 #define DEFAULT_TEST_CACHE_SIZE (4)
 #define DEFAULT_TEST_NDISTINCT_KEYS (1ULL << 10)
 #define DEFAULT_TEST_NOPS (1ULL << 12)
+#define DEFAULT_TEST_MAX_THREADS (4)
+#define DEFAULT_TEST_PARTITIONS (1)
+#define DEFAULT_TEST_ASYNC_WINDOW (8)
+#define DEFAULT_TEST_ASYNC_THREADS (2)
+#define DEFAULT_TEST_SCAN_LENGTH (64)
+#define DEFAULT_TEST_MAX_IMAGE_SIZE (1ULL << 24)
 
 void usage(char *name)
 {
@@ -121,18 +133,37 @@ void usage(char *name)
       << "Options are" << std::endl
       << "  Required:" << std::endl
       << "    -d <backing_store_directory>                    [ default: none, parameter is required ]" << std::endl
-      << "    -m  <mode>  (test or benchmark-<mode>)          [ default: none, parameter required ]" << std::endl
+      << "    -m  <mode>  (test, test-<kind> or benchmark-<mode>) [ default: none, parameter required ]" << std::endl
+      << "        test-concurrent: one writer and -T readers, some of them async" << std::endl
+      << "        test-partitioned: test on -p partitions (by hash with -H), half of them empty" << std::endl
+      << "        test-compressor: round-trip edge-case images through the block codec" << std::endl
+      << "        test-snapshot: check that a snapshot holds back garbage collection (implies -G)" << std::endl
       << "        benchmark modes:" << std::endl
       << "          upserts    " << std::endl
       << "          queries    " << std::endl
+      << "          concurrent-queries" << std::endl
+      << "          concurrent-upserts" << std::endl
+      << "          async-queries" << std::endl
       << "  Betree tuning parameters:" << std::endl
       << "    -N <max_node_size>            (in elements)     [ default: " << DEFAULT_TEST_MAX_NODE_SIZE << " ]" << std::endl
       << "    -f <min_flush_size>           (in elements)     [ default: " << DEFAULT_TEST_MIN_FLUSH_SIZE << " ]" << std::endl
       << "    -C <max_cache_size>           (in betree nodes) [ default: " << DEFAULT_TEST_CACHE_SIZE << " ]" << std::endl
+      << "    -P <flush_threads>            (parallel flushes) [ default: 0 (off) ]" << std::endl
+      << "    -M <maintenance_threads>      (background flushes) [ default: 0 (off) ]" << std::endl
+      << "    -p <partitions>               (test-partitioned, concurrent-upserts) [ default: " << DEFAULT_TEST_PARTITIONS << " ]" << std::endl
+      << "    -H                            (partition by hash, not range) [ default: off ]" << std::endl
+      << "    -Q                            (optimistic lock-free queries) [ default: off ]" << std::endl
+      << "    -L                            (print latency percentiles) [ default: off ]" << std::endl
+      << "  Swap space options:" << std::endl
+      << "    -G <gc_batch_size>            (enables copy-on-write) [ default: off ]" << std::endl
+      << "    -Z <compressed_cache_size>    (in bytes)        [ default: 0 (off) ]" << std::endl
+      << "    -z                            (compress nodes on disk) [ default: off ]" << std::endl
       << "  Options for both tests and benchmarks" << std::endl
       << "    -k <number_of_distinct_keys>                    [ default: " << DEFAULT_TEST_NDISTINCT_KEYS << " ]" << std::endl
       << "    -t <number_of_operations>                       [ default: " << DEFAULT_TEST_NOPS << " ]" << std::endl
       << "    -s <random_seed>                                [ default: random ]" << std::endl
+      << "    -T <max_threads>              (concurrent and async modes) [ default: " << DEFAULT_TEST_MAX_THREADS << " ]" << std::endl
+      << "    -W <trace_file>               (record a binary trace, for replay) [ default: none ]" << std::endl
       << "  Test scripting options" << std::endl
       << "    -o <output_script>                              [ default: no output ]" << std::endl
       << "    -i <script_file>                                [ default: none ]" << std::endl;
@@ -241,6 +272,398 @@ int test(betree<uint64_t, std::string> &b,
   return 0;
 }
 
+// One entry of a key's history in test_concurrent: from the writer's
+// operation op on, the key was present with this value, or absent.
+class key_version
+{
+public:
+  uint64_t op;
+  bool present;
+  std::string value;
+};
+
+// Whether a key with history h was present with value v (or absent,
+// if !present) after one of the writer's operations from to to.  h is
+// in order of operations and starts with operation 0.
+bool was_ever(const std::vector<key_version> &h, bool present, const std::string &v,
+              uint64_t from, uint64_t to)
+{
+  auto it = h.end();
+  do
+  {
+    --it;
+  } while (it->op > from);
+  for (; it != h.end() && it->op <= to; ++it)
+    if (it->present == present && (!present || it->value == v))
+      return true;
+  return false;
+}
+
+// Like test, but the operations run on this thread while nreaders
+// threads query and scan the tree, half of their queries through
+// query_async() and half of the upserts through upsert_async().
+// Readers cannot know exactly when an upsert takes effect, so each
+// result must match the key's value at some point between the start
+// and the end of the read: every upsert is added to its key's history
+// before it is sent to the tree, and a read may see any state from
+// the last upsert finished before it began to the last one started
+// before it ended.  A scan must also skip only keys that were absent
+// at some point in that window.
+int test_concurrent(betree<uint64_t, std::string> &b,
+                    uint64_t nops,
+                    uint64_t number_of_distinct_keys,
+                    uint64_t random_seed,
+                    uint64_t nreaders)
+{
+  std::map<uint64_t, std::string> reference;
+  std::vector<std::vector<key_version>> history(number_of_distinct_keys);
+  for (uint64_t i = 0; i < number_of_distinct_keys; i++)
+    history[i].push_back(key_version{0, false, ""});
+  std::mutex history_mutex;
+  std::atomic<uint64_t> started(0);
+  std::atomic<uint64_t> finished(0);
+  std::atomic<bool> done(false);
+  std::atomic<uint64_t> reads(0);
+
+  b.set_async_threads(DEFAULT_TEST_ASYNC_THREADS);
+
+  std::vector<std::thread> readers;
+  for (uint64_t j = 0; j < nreaders; j++)
+    readers.push_back(std::thread([&, j]
+                                  {
+      unsigned int seed = random_seed + j + 1;
+      while (!done)
+      {
+        uint64_t t = rand_r(&seed) % number_of_distinct_keys;
+        uint64_t from = finished;
+        if (rand_r(&seed) % 2)
+        {
+          bool present = true;
+          std::string v;
+          try
+          {
+            if (rand_r(&seed) % 2)
+              v = b.query_async(t).get();
+            else
+              v = b.query(t);
+          }
+          catch (std::out_of_range &e)
+          {
+            present = false;
+          }
+          uint64_t to = started;
+          std::lock_guard<std::mutex> lock(history_mutex);
+          assert(was_ever(history[t], present, v, from, to));
+        }
+        else
+        {
+          std::vector<std::pair<uint64_t, std::string>> seen;
+          auto betit = b.lower_bound(t);
+          while (betit != b.end() && seen.size() < DEFAULT_TEST_SCAN_LENGTH)
+          {
+            seen.push_back(std::make_pair(betit.first, betit.second));
+            ++betit;
+          }
+          bool at_end = betit == b.end();
+          uint64_t to = started;
+          std::lock_guard<std::mutex> lock(history_mutex);
+          uint64_t next = t;
+          for (auto it = seen.begin(); it != seen.end(); ++it)
+          {
+            assert(next <= it->first && it->first < number_of_distinct_keys);
+            for (; next < it->first; next++)
+              assert(was_ever(history[next], false, "", from, to));
+            assert(was_ever(history[it->first], true, it->second, from, to));
+            next = it->first + 1;
+          }
+          if (at_end)
+            for (; next < number_of_distinct_keys; next++)
+              assert(was_ever(history[next], false, "", from, to));
+        }
+        reads++;
+      } }));
+
+  srand(random_seed);
+  for (uint64_t i = 1; i <= nops; i++)
+  {
+    int op = rand() % 3;
+    uint64_t t = rand() % number_of_distinct_keys;
+    bool async = rand() % 2;
+    std::string v = std::to_string(t) + ":";
+
+    {
+      std::lock_guard<std::mutex> lock(history_mutex);
+      switch (op)
+      {
+      case 0: // insert
+        reference[t] = v;
+        break;
+      case 1: // update
+        reference[t] += v;
+        break;
+      case 2: // delete
+        reference.erase(t);
+        break;
+      default:
+        abort();
+      }
+      if (reference.count(t) > 0)
+        history[t].push_back(key_version{i, true, reference[t]});
+      else
+        history[t].push_back(key_version{i, false, ""});
+      started = i;
+    }
+
+    int opcode = op == 0 ? INSERT : op == 1 ? UPDATE : DELETE;
+    if (async)
+      b.upsert_async(opcode, t, v).get();
+    else if (op == 0)
+      b.insert(t, v);
+    else if (op == 1)
+      b.update(t, v);
+    else
+      b.erase(t);
+    finished = i;
+  }
+
+  done = true;
+  for (auto it = readers.begin(); it != readers.end(); ++it)
+    it->join();
+  b.set_async_threads(0);
+
+  // Nothing runs concurrently any more, so the tree must now match the
+  // reference exactly.
+  for (auto it = reference.begin(); it != reference.end(); ++it)
+    assert(b.query(it->first) == it->second);
+  auto betit = b.begin();
+  auto refit = reference.begin();
+  do_scan(betit, refit, b, reference);
+
+  std::cout << "# reads checked: " << reads << std::endl;
+  std::cout << "Test PASSED" << std::endl;
+
+  return 0;
+}
+
+// Like test, but on a partitioned tree, to check that its scans merge
+// or chain the partitions' iterators correctly.  Keys that belong to
+// an odd-numbered partition are never written, so every other
+// partition stays empty, while queries and scans still start anywhere
+// in the key space.
+int test_partitioned(partitioned_betree<uint64_t, std::string> &pt,
+                     uint64_t nops,
+                     uint64_t number_of_distinct_keys)
+{
+  std::map<uint64_t, std::string> reference;
+
+  for (uint64_t i = 0; i < nops; i++)
+  {
+    int op = rand() % 7;
+    uint64_t t = rand() % number_of_distinct_keys;
+    if (op < 3 && pt.partition_of(t) % 2 == 1)
+      op = 3;
+
+    switch (op)
+    {
+    case 0: // insert
+      pt.insert(t, std::to_string(t) + ":");
+      reference[t] = std::to_string(t) + ":";
+      break;
+    case 1: // update
+      pt.update(t, std::to_string(t) + ":");
+      reference[t] += std::to_string(t) + ":";
+      break;
+    case 2: // delete
+      pt.erase(t);
+      reference.erase(t);
+      break;
+    case 3: // query
+      try
+      {
+        std::string bval = pt.query(t);
+        assert(reference.count(t) > 0);
+        assert(bval == reference[t]);
+      }
+      catch (std::out_of_range &e)
+      {
+        assert(reference.count(t) == 0);
+      }
+      break;
+    case 4: // full scan
+    {
+      auto betit = pt.begin();
+      auto refit = reference.begin();
+      do_scan(betit, refit, pt, reference);
+    }
+    break;
+    case 5: // lower-bound scan
+    {
+      auto betit = pt.lower_bound(t);
+      auto refit = reference.lower_bound(t);
+      do_scan(betit, refit, pt, reference);
+    }
+    break;
+    case 6: // upper-bound scan
+    {
+      auto betit = pt.upper_bound(t);
+      auto refit = reference.upper_bound(t);
+      do_scan(betit, refit, pt, reference);
+    }
+    break;
+    default:
+      abort();
+    }
+  }
+
+  for (uint64_t i = 1; i < pt.partitions(); i += 2)
+    assert(pt.partition(i)->begin() == pt.partition(i)->end());
+
+  std::cout << "Test PASSED" << std::endl;
+
+  return 0;
+}
+
+// Encode image with codec, check that the block ended up with
+// expected_codec, and that decoding it gives image back.
+void check_block_round_trip(const std::string &image, int codec, int expected_codec)
+{
+  std::string block;
+  encode_block(image, codec, block);
+  assert(block.size() >= BLOCK_HEADER_SIZE);
+  assert((unsigned char)block[0] == BLOCK_MAGIC);
+  assert((unsigned char)block[1] == expected_codec);
+  size_t offset;
+  bool ok = decode_block(block, offset);
+  assert(ok);
+  assert(block.compare(offset, std::string::npos, image) == 0);
+  (void)ok;
+}
+
+std::string random_bytes(size_t len)
+{
+  std::string s(len, '\0');
+  for (size_t i = 0; i < len; i++)
+    s[i] = (char)(rand() & 0xff);
+  return s;
+}
+
+// Round-trip the images at the edges of the block format: an empty
+// one, incompressible ones, which must fall back to CODEC_NONE, and a
+// DEFAULT_TEST_MAX_IMAGE_SIZE one, many LZ windows long, with matches
+// at the largest offset and runs long enough to need many length
+// bytes.  Also check that headerless images read back unchanged and
+// that a truncated block is rejected.
+int test_compressor(void)
+{
+  check_block_round_trip("", CODEC_NONE, CODEC_NONE);
+  check_block_round_trip("", CODEC_LZ, CODEC_NONE);
+
+  for (size_t len = 1; len <= (1 << 16); len *= 4)
+  {
+    std::string noise = random_bytes(len);
+    check_block_round_trip(noise, CODEC_NONE, CODEC_NONE);
+    check_block_round_trip(noise, CODEC_LZ, CODEC_NONE);
+  }
+
+  std::string chunk = random_bytes(65535);
+  std::string big = chunk + chunk;
+  big.append(1 << 20, '\0');
+  while (big.size() < DEFAULT_TEST_MAX_IMAGE_SIZE - 1000)
+  {
+    big += "node " + std::to_string(rand() % 1000) + " pivot " + std::to_string(rand()) + ";";
+    if (rand() % 64 == 0)
+      big += random_bytes(rand() % 300);
+  }
+  big += random_bytes(DEFAULT_TEST_MAX_IMAGE_SIZE - big.size());
+  check_block_round_trip(big, CODEC_NONE, CODEC_NONE);
+  check_block_round_trip(big, CODEC_LZ, CODEC_LZ);
+
+  std::string packed;
+  lz_compress(big.data(), big.size(), packed);
+  std::string block;
+  encode_packed_block(big, packed, block);
+  std::string plain;
+  encode_block(big, CODEC_LZ, plain);
+  assert(block == plain);
+
+  block.resize(block.size() - 1);
+  size_t offset;
+  assert(!decode_block(block, offset));
+
+  std::string legacy = "legacy image";
+  bool ok = decode_block(legacy, offset);
+  assert(ok && offset == 0 && legacy == "legacy image");
+  (void)ok;
+
+  std::cout << "Test PASSED" << std::endl;
+
+  return 0;
+}
+
+// The names of the files in dir, i.e. the object versions a
+// one_file_per_object_backing_store holds.
+std::set<std::string> list_versions(const char *dir)
+{
+  std::set<std::string> names;
+  DIR *d = opendir(dir);
+  assert(d != NULL);
+  struct dirent *e;
+  while ((e = readdir(d)) != NULL)
+    if (e->d_name[0] != '.')
+      names.insert(e->d_name);
+  closedir(d);
+  return names;
+}
+
+// Check copy-on-write retention.  Every version on disk when a
+// snapshot is opened must survive the write-backs of nops more
+// updates while it is open, and the versions they superseded must be
+// collected once it is closed.
+int test_snapshot(betree<uint64_t, std::string> &b,
+                  swap_space &sspace,
+                  const char *dir,
+                  uint64_t nops,
+                  uint64_t number_of_distinct_keys)
+{
+  for (uint64_t i = 0; i < nops; i++)
+  {
+    uint64_t t = rand() % number_of_distinct_keys;
+    b.update(t, std::to_string(t) + ":");
+  }
+  sspace.collect_garbage();
+  assert(sspace.get_retired_versions() == 0);
+
+  std::set<std::string> before = list_versions(dir);
+  uint64_t snap = sspace.open_snapshot();
+  for (uint64_t i = 0; i < nops; i++)
+  {
+    uint64_t t = rand() % number_of_distinct_keys;
+    b.update(t, std::to_string(t) + ":");
+  }
+  sspace.collect_garbage();
+  std::set<std::string> during = list_versions(dir);
+  for (auto it = before.begin(); it != before.end(); ++it)
+    assert(during.count(*it) > 0);
+  uint64_t retired = sspace.get_retired_versions();
+  assert(retired > 0);
+
+  sspace.close_snapshot(snap);
+  sspace.collect_garbage();
+  assert(sspace.get_retired_versions() == 0);
+  std::set<std::string> after = list_versions(dir);
+  uint64_t reclaimed = 0;
+  for (auto it = before.begin(); it != before.end(); ++it)
+    if (after.count(*it) == 0)
+      reclaimed++;
+  assert(reclaimed > 0);
+
+  std::cout << "# versions: " << before.size() << " at open, " << retired
+            << " retired while open, " << reclaimed << " of them collected after close" << std::endl;
+  std::cout << "Test PASSED" << std::endl;
+
+  return 0;
+}
+
 void benchmark_upserts(betree<uint64_t, std::string> &b,
                        uint64_t nops,
                        uint64_t number_of_distinct_keys,
@@ -294,18 +717,144 @@ void benchmark_queries(betree<uint64_t, std::string> &b,
   printf("# overall: %ld %ld, %f\n", nops, overall_timer, throughput);
 }
 
+// Like benchmark_queries, but with up to DEFAULT_TEST_ASYNC_WINDOW
+// query_async() calls in flight on nthreads async threads.
+void benchmark_async_queries(betree<uint64_t, std::string> &b,
+                             uint64_t nops,
+                             uint64_t number_of_distinct_keys,
+                             uint64_t random_seed,
+                             uint64_t nthreads)
+{
+  srand(random_seed);
+  for (uint64_t i = 0; i < nops; i++)
+  {
+    uint64_t t = rand() % number_of_distinct_keys;
+    b.update(t, std::to_string(t) + ":");
+  }
+
+  b.set_async_threads(nthreads);
+  std::deque<std::future<std::string>> inflight;
+  srand(random_seed);
+  uint64_t overall_timer = 0;
+  timer_start(overall_timer);
+  for (uint64_t i = 0; i < nops; i++)
+  {
+    uint64_t t = rand() % number_of_distinct_keys;
+    inflight.push_back(b.query_async(t));
+    if (inflight.size() >= DEFAULT_TEST_ASYNC_WINDOW)
+    {
+      inflight.front().get();
+      inflight.pop_front();
+    }
+  }
+  for (auto it = inflight.begin(); it != inflight.end(); ++it)
+    it->get();
+  timer_stop(overall_timer);
+
+  double throughput = (1.0 * nops * 1000000) / overall_timer;
+  printf("# overall: %ld %ld, %f\n", nops, overall_timer, throughput);
+}
+
+// Load the tree like benchmark_queries, then run nops queries with 1,
+// 2, 4, ... max_threads threads, each thread doing an equal share.
+void benchmark_concurrent_queries(betree<uint64_t, std::string> &b,
+                                  uint64_t nops,
+                                  uint64_t number_of_distinct_keys,
+                                  uint64_t random_seed,
+                                  uint64_t max_threads)
+{
+  srand(random_seed);
+  for (uint64_t i = 0; i < nops; i++)
+  {
+    uint64_t t = rand() % number_of_distinct_keys;
+    b.update(t, std::to_string(t) + ":");
+  }
+
+  for (uint64_t nthreads = 1; nthreads <= max_threads;
+       nthreads = nthreads < max_threads && 2 * nthreads > max_threads ? max_threads : 2 * nthreads)
+  {
+    std::vector<std::thread> threads;
+    uint64_t timer = 0;
+    timer_start(timer);
+    for (uint64_t j = 0; j < nthreads; j++)
+      threads.push_back(std::thread([&b, j, nthreads, nops, number_of_distinct_keys, random_seed]
+                                    {
+        unsigned int seed = random_seed + j;
+        for (uint64_t i = j; i < nops; i += nthreads)
+        {
+          uint64_t t = rand_r(&seed) % number_of_distinct_keys;
+          try
+          {
+            b.query(t);
+          }
+          catch (std::out_of_range &e)
+          {
+          }
+        } }));
+    for (auto it = threads.begin(); it != threads.end(); ++it)
+      it->join();
+    timer_stop(timer);
+
+    double throughput = (1.0 * nops * 1000000) / timer;
+    printf("%ld %ld %ld %f\n", nthreads, nops, timer, throughput);
+  }
+}
+
+// Like benchmark_concurrent_queries, but every thread upserts, into
+// a tree partitioned by key.
+void benchmark_concurrent_upserts(partitioned_betree<uint64_t, std::string> &pt,
+                                  uint64_t nops,
+                                  uint64_t number_of_distinct_keys,
+                                  uint64_t random_seed,
+                                  uint64_t max_threads)
+{
+  for (uint64_t nthreads = 1; nthreads <= max_threads;
+       nthreads = nthreads < max_threads && 2 * nthreads > max_threads ? max_threads : 2 * nthreads)
+  {
+    std::vector<std::thread> threads;
+    uint64_t timer = 0;
+    timer_start(timer);
+    for (uint64_t j = 0; j < nthreads; j++)
+      threads.push_back(std::thread([&pt, j, nthreads, nops, number_of_distinct_keys, random_seed]
+                                    {
+        unsigned int seed = random_seed + j;
+        for (uint64_t i = j; i < nops; i += nthreads)
+        {
+          uint64_t t = rand_r(&seed) % number_of_distinct_keys;
+          pt.update(t, std::to_string(t) + ":");
+        } }));
+    for (auto it = threads.begin(); it != threads.end(); ++it)
+      it->join();
+    timer_stop(timer);
+
+    double throughput = (1.0 * nops * 1000000) / timer;
+    printf("%ld %ld %ld %f\n", nthreads, nops, timer, throughput);
+  }
+}
+
 int main(int argc, char **argv)
 {
   char *mode = NULL;
   uint64_t max_node_size = DEFAULT_TEST_MAX_NODE_SIZE;
   uint64_t min_flush_size = DEFAULT_TEST_MIN_FLUSH_SIZE;
   uint64_t cache_size = DEFAULT_TEST_CACHE_SIZE;
+  uint64_t gc_batch_size = 0;
+  uint64_t compressed_cache_size = 0;
+  bool disk_compression = false;
   char *backing_store_dir = NULL;
   uint64_t number_of_distinct_keys = DEFAULT_TEST_NDISTINCT_KEYS;
   uint64_t nops = DEFAULT_TEST_NOPS;
   char *script_infile = NULL;
   char *script_outfile = NULL;
   unsigned int random_seed = time(NULL) * getpid();
+  uint64_t max_threads = DEFAULT_TEST_MAX_THREADS;
+  uint64_t flush_threads = 0;
+  uint64_t maintenance_threads = 0;
+  uint64_t partitions = DEFAULT_TEST_PARTITIONS;
+  bool hash_partitions = false;
+  bool optimistic_reads = false;
+  bool track_latency = false;
+  char *trace_file = NULL;
 
   int opt;
   char *term;
@@ -314,7 +863,7 @@ int main(int argc, char **argv)
   // Argument parsing //
   //////////////////////
 
-  while ((opt = getopt(argc, argv, "m:d:N:f:C:o:k:t:s:i:")) != -1)
+  while ((opt = getopt(argc, argv, "m:d:N:f:C:P:M:p:HQLG:Z:zo:k:t:s:i:T:W:")) != -1)
   {
     switch (opt)
     {
@@ -351,6 +900,63 @@ int main(int argc, char **argv)
         exit(1);
       }
       break;
+    case 'P':
+      flush_threads = strtoull(optarg, &term, 10);
+      if (*term)
+      {
+        std::cerr << "Argument to -P must be an integer" << std::endl;
+        usage(argv[0]);
+        exit(1);
+      }
+      break;
+    case 'M':
+      maintenance_threads = strtoull(optarg, &term, 10);
+      if (*term)
+      {
+        std::cerr << "Argument to -M must be an integer" << std::endl;
+        usage(argv[0]);
+        exit(1);
+      }
+      break;
+    case 'p':
+      partitions = strtoull(optarg, &term, 10);
+      if (*term || partitions == 0)
+      {
+        std::cerr << "Argument to -p must be a positive integer" << std::endl;
+        usage(argv[0]);
+        exit(1);
+      }
+      break;
+    case 'H':
+      hash_partitions = true;
+      break;
+    case 'Q':
+      optimistic_reads = true;
+      break;
+    case 'L':
+      track_latency = true;
+      break;
+    case 'G':
+      gc_batch_size = strtoull(optarg, &term, 10);
+      if (*term || gc_batch_size == 0)
+      {
+        std::cerr << "Argument to -G must be a positive integer" << std::endl;
+        usage(argv[0]);
+        exit(1);
+      }
+      break;
+    case 'Z':
+      compressed_cache_size = strtoull(optarg, &term, 10);
+      if (*term)
+      {
+        std::cerr << "Argument to -Z must be an integer" << std::endl;
+        usage(argv[0]);
+        exit(1);
+      }
+      break;
+    case 'z':
+      disk_compression = true;
+      break;
     case 'o':
       script_outfile = optarg;
       break;
@@ -384,6 +990,18 @@ int main(int argc, char **argv)
     case 'i':
       script_infile = optarg;
       break;
+    case 'T':
+      max_threads = strtoull(optarg, &term, 10);
+      if (*term || max_threads == 0)
+      {
+        std::cerr << "Argument to -T must be a positive integer" << std::endl;
+        usage(argv[0]);
+        exit(1);
+      }
+      break;
+    case 'W':
+      trace_file = optarg;
+      break;
     default:
       std::cerr << "Unknown option '" << (char)opt << "'" << std::endl;
       usage(argv[0]);
@@ -395,24 +1013,27 @@ int main(int argc, char **argv)
   FILE *script_output = NULL;
 
   if (mode == NULL ||
-      (strcmp(mode, "test") != 0 && strcmp(mode, "benchmark-upserts") != 0 && strcmp(mode, "benchmark-queries") != 0))
+      (strcmp(mode, "test") != 0 && strcmp(mode, "test-concurrent") != 0 && strcmp(mode, "test-partitioned") != 0 &&
+       strcmp(mode, "test-compressor") != 0 && strcmp(mode, "test-snapshot") != 0 && strcmp(mode, "benchmark-upserts") != 0 && strcmp(mode, "benchmark-queries") != 0 &&
+       strcmp(mode, "benchmark-concurrent-queries") != 0 && strcmp(mode, "benchmark-concurrent-upserts") != 0 &&
+       strcmp(mode, "benchmark-async-queries") != 0))
   {
     std::cerr << "Must specify a mode of \"test\" or \"benchmark\"" << std::endl;
     usage(argv[0]);
     exit(1);
   }
 
-  if (strncmp(mode, "benchmark", strlen("benchmark")) == 0)
+  if (strcmp(mode, "test") != 0)
   {
     if (script_infile)
     {
-      std::cerr << "Cannot specify an input script in benchmark mode" << std::endl;
+      std::cerr << "Cannot specify an input script in " << mode << " mode" << std::endl;
       usage(argv[0]);
       exit(1);
     }
     if (script_outfile)
     {
-      std::cerr << "Cannot specify an output script in benchmark mode" << std::endl;
+      std::cerr << "Cannot specify an output script in " << mode << " mode" << std::endl;
       usage(argv[0]);
       exit(1);
     }
@@ -440,6 +1061,9 @@ int main(int argc, char **argv)
 
   srand(random_seed);
 
+  if (strcmp(mode, "test-compressor") == 0)
+    return test_compressor();
+
   if (backing_store_dir == NULL)
   {
     std::cerr << "-d <backing_store_directory> is required" << std::endl;
@@ -451,8 +1075,15 @@ int main(int argc, char **argv)
   // Construct a betree and run the tests or benchmarks //
   ////////////////////////////////////////////////////////
 
+  if (strcmp(mode, "test-snapshot") == 0 && gc_batch_size == 0)
+    gc_batch_size = DEFAULT_GC_BATCH_SIZE;
+
   one_file_per_object_backing_store ofpobs(backing_store_dir);
   swap_space sspace(&ofpobs, cache_size);
+  if (gc_batch_size > 0)
+    sspace.set_copy_on_write(true, gc_batch_size);
+  sspace.set_compressed_cache_size(compressed_cache_size);
+  sspace.set_disk_compression(disk_compression);
 
   // Launch test with non-adaptive tree:
   // betree<uint64_t, std::string> b(&sspace, max_node_size, min_flush_size);
@@ -460,13 +1091,121 @@ int main(int argc, char **argv)
   // Launch test with adaptive tree:
   // (sspace, maxnodesize, minnodesize, minflushsize, isdynamic, startingepsilon, tunableepsilonlevel, opsbeforeupdate, windowsize)
   betree<uint64_t, std::string> b(&sspace, max_node_size, max_node_size / 4, min_flush_size, true, 0.4, 0, 100, 100);
+  b.set_flush_threads(flush_threads);
+  b.set_maintenance_threads(maintenance_threads);
+  b.set_optimistic_reads(optimistic_reads);
+  b.set_latency_tracking(track_latency);
+  std::unique_ptr<trace_writer> trace;
+  if (trace_file)
+  {
+    if (strcmp(mode, "benchmark-concurrent-upserts") == 0 || strcmp(mode, "test-partitioned") == 0)
+    {
+      std::cerr << "Cannot record a trace of a partitioned tree" << std::endl;
+      usage(argv[0]);
+      exit(1);
+    }
+    trace.reset(new trace_writer(trace_file, true));
+    b.set_trace_hook([&trace](int opcode, const uint64_t &k, const std::string &v)
+                     { trace->record(opcode, k, v); });
+  }
 
   if (strcmp(mode, "test") == 0)
     test(b, nops, number_of_distinct_keys, script_input, script_output);
+  else if (strcmp(mode, "test-snapshot") == 0)
+    test_snapshot(b, sspace, backing_store_dir, nops, number_of_distinct_keys);
+  else if (strcmp(mode, "test-concurrent") == 0)
+    test_concurrent(b, nops, number_of_distinct_keys, random_seed, max_threads);
   else if (strcmp(mode, "benchmark-upserts") == 0)
     benchmark_upserts(b, nops, number_of_distinct_keys, random_seed);
   else if (strcmp(mode, "benchmark-queries") == 0)
     benchmark_queries(b, nops, number_of_distinct_keys, random_seed);
+  else if (strcmp(mode, "benchmark-concurrent-queries") == 0)
+    benchmark_concurrent_queries(b, nops, number_of_distinct_keys, random_seed, max_threads);
+  else if (strcmp(mode, "benchmark-async-queries") == 0)
+    benchmark_async_queries(b, nops, number_of_distinct_keys, random_seed, max_threads);
+  else if (strcmp(mode, "benchmark-concurrent-upserts") == 0 || strcmp(mode, "test-partitioned") == 0)
+  {
+    // One betree per partition, each with its own directory,
+    // swap_space and share of the cache.
+    std::vector<one_file_per_object_backing_store *> stores;
+    std::vector<swap_space *> spaces;
+    std::vector<betree<uint64_t, std::string> *> trees;
+    std::vector<uint64_t> split_keys;
+    for (uint64_t i = 0; i < partitions; i++)
+    {
+      std::string dir = std::string(backing_store_dir) + "/part" + std::to_string(i);
+      if (mkdir(dir.c_str(), 0755) < 0 && errno != EEXIST)
+      {
+        perror("Couldn't create partition directory");
+        exit(1);
+      }
+      stores.push_back(new one_file_per_object_backing_store(dir));
+      spaces.push_back(new swap_space(stores.back(), std::max<uint64_t>(cache_size / partitions, 1)));
+      if (gc_batch_size > 0)
+        spaces.back()->set_copy_on_write(true, gc_batch_size);
+      spaces.back()->set_compressed_cache_size(compressed_cache_size / partitions);
+      spaces.back()->set_disk_compression(disk_compression);
+      trees.push_back(new betree<uint64_t, std::string>(spaces.back(), max_node_size, max_node_size / 4, min_flush_size, true, 0.4, 0, 100, 100));
+      trees.back()->set_flush_threads(flush_threads);
+      trees.back()->set_maintenance_threads(maintenance_threads);
+      trees.back()->set_optimistic_reads(optimistic_reads);
+      trees.back()->set_latency_tracking(track_latency);
+      if (i > 0)
+        split_keys.push_back(i * number_of_distinct_keys / partitions);
+    }
+
+    std::unique_ptr<partitioned_betree<uint64_t, std::string>> pt;
+    if (hash_partitions)
+      pt.reset(new partitioned_betree<uint64_t, std::string>(trees));
+    else
+      pt.reset(new partitioned_betree<uint64_t, std::string>(trees, split_keys));
+    if (strcmp(mode, "test-partitioned") == 0)
+      test_partitioned(*pt, nops, number_of_distinct_keys);
+    else
+      benchmark_concurrent_upserts(*pt, nops, number_of_distinct_keys, random_seed, max_threads);
+
+    if (track_latency)
+    {
+      latency_histogram::print_header(stdout);
+      for (int op = 0; op < LATENCY_OPS; op++)
+      {
+        latency_histogram all;
+        for (uint64_t i = 0; i < partitions; i++)
+          all.merge(trees[i]->get_latency(op));
+        if (all.count() > 0)
+          all.print(stdout, betree<uint64_t, std::string>::latency_name(op), 1000.0);
+      }
+    }
+
+    for (uint64_t i = 0; i < partitions && strcmp(mode, "test-partitioned") != 0; i++)
+    {
+      printf("# partition %lu\n", i);
+      trees[i]->print_io_stats(stdout);
+      trees[i]->print_shape(stdout);
+    }
+
+    pt.reset();
+    for (uint64_t i = 0; i < partitions; i++)
+    {
+      delete trees[i];
+      delete spaces[i];
+      delete stores[i];
+    }
+  }
+
+  if (strncmp(mode, "benchmark", strlen("benchmark")) == 0)
+  {
+    b.print_latency(stdout);
+    alloc_stats::get().print(stdout);
+  }
+  if (strncmp(mode, "benchmark", strlen("benchmark")) == 0 && strcmp(mode, "benchmark-concurrent-upserts") != 0)
+  {
+    b.print_io_stats(stdout);
+    b.print_shape(stdout);
+  }
+
+  if (disk_compression)
+    printf("# disk compression ratio: %f\n", sspace.get_compression_stats().write_ratio());
 
   if (script_input)
     fclose(script_input);
@@ -1,6 +1,8 @@
 #include <string.h>
 #include <sys/types.h>
 #include <sys/time.h>
+#include <sys/stat.h>
+#include <errno.h>
 #include <unistd.h>
 #include "betree.hpp"
 #include <fstream> 
@@ -229,14 +231,35 @@ int main(int argc, char **argv)
     // Construct a betree and run the benchmark upserts  //
     ////////////////////////////////////////////////////////
 
-    one_file_per_object_backing_store ofpobs(backing_store_dir);
-    swap_space sspace(&ofpobs, cache_size);
-    betree<uint64_t, std::string> b_o(&sspace, max_node_size, min_node_size, min_flush_size, false, startingepsilon, 0, 100, 500);
-    betree<uint64_t, std::string> b_n(&sspace, max_node_size, min_node_size, min_flush_size, true, startingepsilon, 2, 100, 500);
+    // Each tree gets its own swap space, so that the I/O counters it
+    // prints are its own, and so its own subdirectory, since object
+    // ids are only unique within a swap space.
+    std::string dir_o = std::string(backing_store_dir) + "/old";
+    std::string dir_n = std::string(backing_store_dir) + "/new";
+    if ((mkdir(dir_o.c_str(), 0755) < 0 && errno != EEXIST) ||
+        (mkdir(dir_n.c_str(), 0755) < 0 && errno != EEXIST))
+    {
+        perror("Couldn't create tree directory");
+        exit(1);
+    }
+    one_file_per_object_backing_store ofpobs_o(dir_o);
+    one_file_per_object_backing_store ofpobs_n(dir_n);
+    swap_space sspace_o(&ofpobs_o, cache_size);
+    swap_space sspace_n(&ofpobs_n, cache_size);
+    betree<uint64_t, std::string> b_o(&sspace_o, max_node_size, min_node_size, min_flush_size, false, startingepsilon, 0, 100, 500);
+    betree<uint64_t, std::string> b_n(&sspace_n, max_node_size, min_node_size, min_flush_size, true, startingepsilon, 2, 100, 500);
     char* outputFileName1 = "write_ops_times_old.txt"; // Name of the output file
     char* outputFileName2 = "write_ops_times_new.txt";
+    b_o.set_latency_tracking(true);
+    b_n.set_latency_tracking(true);
     benchmark_upserts(b_o, nops, number_of_distinct_keys, random_seed, outputFileName1);
+    b_o.print_latency(stdout);
+    b_o.print_io_stats(stdout);
+    b_o.print_shape(stdout);
     benchmark_upserts(b_n, nops, number_of_distinct_keys, random_seed, outputFileName2);
+    b_n.print_latency(stdout);
+    b_n.print_io_stats(stdout);
+    b_n.print_shape(stdout);
 
     return 0;
 }
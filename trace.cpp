@@ -0,0 +1,120 @@
+#include "trace.hpp"
+#include <cassert>
+#include <cstring>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+static const char trace_magic[8] = { 'B', 'E', 'T', 'R', 'A', 'C', 'E', '\0' };
+static const size_t trace_header_size = sizeof(trace_magic) + 2 * sizeof(uint32_t);
+
+//the calls are made outside assert(), so that they still happen when
+//asserts are compiled out.
+static void write_all(const void *p, size_t size, FILE *out)
+{
+  size_t written = fwrite(p, size, 1, out);
+  assert(written == 1);
+  (void)written;
+}
+
+trace_writer::trace_writer(const char *path, bool ts)
+  : timestamps(ts),
+    start(std::chrono::steady_clock::now()),
+    buffer(DEFAULT_TRACE_BUFFER_SIZE),
+    nrecords(0)
+{
+  out = fopen(path, "w");
+  assert(out != NULL);
+  setvbuf(out, buffer.data(), _IOFBF, buffer.size());
+  uint32_t version = TRACE_VERSION;
+  uint32_t flags = timestamps ? TRACE_TIMESTAMPS : 0;
+  write_all(trace_magic, sizeof(trace_magic), out);
+  write_all(&version, sizeof(version), out);
+  write_all(&flags, sizeof(flags), out);
+}
+
+trace_writer::~trace_writer(void)
+{
+  int r = fclose(out);
+  assert(r == 0);
+  (void)r;
+}
+
+void trace_writer::record(int opcode, uint64_t key, const char *value, uint32_t length)
+{
+  //the fixed part of a record, packed.
+  char fixed[sizeof(uint8_t) + sizeof(uint64_t) + sizeof(uint32_t)];
+  fixed[0] = opcode;
+  memcpy(fixed + 1, &key, sizeof(key));
+  memcpy(fixed + 1 + sizeof(key), &length, sizeof(length));
+
+  std::lock_guard<std::mutex> lock(mtx);
+  write_all(fixed, sizeof(fixed), out);
+  if (length)
+    write_all(value, length, out);
+  if (timestamps) {
+    //taken under the lock, so timestamps never go backwards.
+    uint64_t ns = std::chrono::duration_cast<std::chrono::nanoseconds>(
+                      std::chrono::steady_clock::now() - start).count();
+    write_all(&ns, sizeof(ns), out);
+  }
+  nrecords++;
+}
+
+trace_reader::trace_reader(const char *path)
+{
+  fd = open(path, O_RDONLY);
+  assert(fd >= 0);
+  struct stat st;
+  int r = fstat(fd, &st);
+  assert(r == 0);
+  (void)r;
+  length = st.st_size;
+  assert(length >= trace_header_size);
+  void *p = mmap(NULL, length, PROT_READ, MAP_PRIVATE, fd, 0);
+  assert(p != MAP_FAILED);
+  madvise(p, length, MADV_SEQUENTIAL);
+  base = (const char *)p;
+
+  assert(memcmp(base, trace_magic, sizeof(trace_magic)) == 0);
+  uint32_t version, flags;
+  memcpy(&version, base + sizeof(trace_magic), sizeof(version));
+  memcpy(&flags, base + sizeof(trace_magic) + sizeof(version), sizeof(flags));
+  assert(version == TRACE_VERSION);
+  timestamps = flags & TRACE_TIMESTAMPS;
+  pos = trace_header_size;
+}
+
+trace_reader::~trace_reader(void)
+{
+  munmap((void *)base, length);
+  close(fd);
+}
+
+bool trace_reader::next(trace_reader::record &r)
+{
+  const size_t fixed = sizeof(uint8_t) + sizeof(uint64_t) + sizeof(uint32_t);
+  if (pos + fixed > length)
+    return false;
+  const char *p = base + pos;
+  r.opcode = (uint8_t)p[0];
+  memcpy(&r.key, p + 1, sizeof(r.key));
+  memcpy(&r.length, p + 1 + sizeof(r.key), sizeof(r.length));
+  r.value = p + fixed;
+  size_t size = fixed + r.length + (timestamps ? sizeof(uint64_t) : 0);
+  //a trace cut short, e.g. by a crash while recording, ends at the
+  //last whole record.
+  if (pos + size > length)
+    return false;
+  r.timestamp = 0;
+  if (timestamps)
+    memcpy(&r.timestamp, r.value + r.length, sizeof(r.timestamp));
+  pos += size;
+  return true;
+}
+
+void trace_reader::rewind(void)
+{
+  pos = trace_header_size;
+}
@@ -0,0 +1,92 @@
+// Binary operation traces.
+//
+// A trace is a header followed by one record per operation, packed
+// with no padding and in host byte order:
+//
+//   header: "BETRACE" and a NUL, then uint32 version, uint32 flags
+//   record: uint8 opcode, uint64 key, uint32 value length, the value
+//           bytes, and, if the header has TRACE_TIMESTAMPS, a uint64
+//           timestamp (nanoseconds since the trace was started)
+//
+// The opcodes are the betree's: INSERT, DELETE, UPDATE or TRACE_QUERY
+// (see betree::set_trace_hook()).
+//
+// trace_writer appends records through a large stdio buffer and may be
+// shared by several threads.  trace_reader maps the whole trace into
+// memory and hands out records whose values point into the mapping, so
+// replaying a trace copies nothing and parses nothing.
+
+#ifndef TRACE_HPP
+#define TRACE_HPP
+
+#include <cstdint>
+#include <cstdio>
+#include <cstddef>
+#include <string>
+#include <mutex>
+#include <chrono>
+#include <vector>
+
+#define TRACE_VERSION (1)
+// Header flag: every record carries a timestamp.
+#define TRACE_TIMESTAMPS (1)
+// Size of trace_writer's stdio buffer.
+#define DEFAULT_TRACE_BUFFER_SIZE (1 << 20)
+
+class trace_writer
+{
+public:
+  trace_writer(const char *path, bool timestamps);
+  ~trace_writer(void);
+
+  void record(int opcode, uint64_t key, const char *value, uint32_t length);
+  void record(int opcode, uint64_t key, const std::string &value)
+  {
+    record(opcode, key, value.data(), value.size());
+  }
+
+  uint64_t size(void) const { return nrecords; }
+
+private:
+  FILE *out;
+  bool timestamps;
+  std::chrono::steady_clock::time_point start;
+  std::vector<char> buffer;
+  std::mutex mtx;
+  uint64_t nrecords;
+};
+
+class trace_reader
+{
+public:
+  class record
+  {
+  public:
+    int opcode;
+    uint64_t key;
+    // Points into the mapped trace.
+    const char *value;
+    uint32_t length;
+    // 0 if the trace has no timestamps.
+    uint64_t timestamp;
+  };
+
+  trace_reader(const char *path);
+  ~trace_reader(void);
+
+  bool has_timestamps(void) const { return timestamps; }
+
+  // Fill in the next record, or return false at the end of the trace.
+  bool next(record &r);
+  // Go back to the first record.
+  void rewind(void);
+
+private:
+  int fd;
+  const char *base;
+  size_t length;
+  size_t pos;
+  bool timestamps;
+};
+
+#endif // TRACE_HPP
@@ -0,0 +1,69 @@
+#include "worker_pool.hpp"
+#include <cassert>
+
+worker_pool::worker_pool(unsigned int nthreads)
+  : stopping(false)
+{
+  assert(nthreads > 0);
+  for (unsigned int i = 0; i < nthreads; i++)
+    workers.push_back(std::thread(&worker_pool::worker_main, this));
+}
+
+worker_pool::~worker_pool(void)
+{
+  {
+    std::lock_guard<std::mutex> lock(mtx);
+    stopping = true;
+  }
+  work_cond.notify_all();
+  for (auto it = workers.begin(); it != workers.end(); ++it)
+    it->join();
+}
+
+//run one task without holding mtx, then account for it.
+void worker_pool::run_task(std::unique_lock<std::mutex> &lock, worker_pool::task t)
+{
+  lock.unlock();
+  (*t.fn)();
+  lock.lock();
+  if (--t.owner->remaining == 0)
+    done_cond.notify_all();
+}
+
+void worker_pool::run(std::vector<std::function<void(void)>> &tasks)
+{
+  if (tasks.empty())
+    return;
+
+  batch b;
+  b.remaining = tasks.size();
+  std::unique_lock<std::mutex> lock(mtx);
+  for (auto it = tasks.begin(); it != tasks.end(); ++it)
+    queue.push_back(task{&*it, &b});
+  work_cond.notify_all();
+
+  //help out until our batch is done.  The queue may hold other
+  //batches' tasks too; running them is just as useful.
+  while (b.remaining > 0) {
+    if (!queue.empty()) {
+      task t = queue.front();
+      queue.pop_front();
+      run_task(lock, t);
+    } else {
+      done_cond.wait(lock);
+    }
+  }
+}
+
+void worker_pool::worker_main(void)
+{
+  std::unique_lock<std::mutex> lock(mtx);
+  while (true) {
+    work_cond.wait(lock, [this] { return stopping || !queue.empty(); });
+    if (queue.empty())
+      return;
+    task t = queue.front();
+    queue.pop_front();
+    run_task(lock, t);
+  }
+}
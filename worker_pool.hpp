@@ -0,0 +1,58 @@
+// A fixed-size pool of threads for running batches of independent
+// tasks.
+//
+// run() hands a batch of tasks to the pool and returns once all of
+// them have finished.  While it waits, the calling thread runs queued
+// tasks itself, so a task may call run() on the same pool (e.g. a
+// flush that flushes its own children in parallel) without
+// deadlocking, even when every worker is busy.
+
+#ifndef WORKER_POOL_HPP
+#define WORKER_POOL_HPP
+
+#include <cstdint>
+#include <deque>
+#include <vector>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <condition_variable>
+
+class worker_pool
+{
+public:
+  worker_pool(unsigned int nthreads);
+  ~worker_pool(void);
+
+  // Run every task in tasks, on the pool and on the calling thread.
+  void run(std::vector<std::function<void(void)>> &tasks);
+
+  unsigned int size(void) const { return workers.size(); }
+
+private:
+  // Tasks of one call to run() that have not finished yet.
+  class batch
+  {
+  public:
+    uint64_t remaining;
+  };
+
+  class task
+  {
+  public:
+    std::function<void(void)> *fn;
+    batch *owner;
+  };
+
+  void worker_main(void);
+  void run_task(std::unique_lock<std::mutex> &lock, task t);
+
+  std::mutex mtx;
+  std::condition_variable work_cond;
+  std::condition_variable done_cond;
+  std::deque<task> queue;
+  std::vector<std::thread> workers;
+  bool stopping;
+};
+
+#endif // WORKER_POOL_HPP
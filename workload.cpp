@@ -0,0 +1,220 @@
+#include "workload.hpp"
+#include <cassert>
+#include <cmath>
+#include <cctype>
+#include <cstring>
+
+static double zeta(uint64_t from, uint64_t to, double theta)
+{
+  double sum = 0;
+  for (uint64_t i = from + 1; i <= to; i++)
+    sum += 1.0 / pow(i, theta);
+  return sum;
+}
+
+zipfian_generator::zipfian_generator(uint64_t items, double th)
+  : n(items),
+    theta(th)
+{
+  assert(n > 0);
+  alpha = 1.0 / (1.0 - theta);
+  zeta2 = zeta(0, 2, theta);
+  zetan = zeta(0, n, theta);
+  update_constants();
+}
+
+void zipfian_generator::update_constants(void)
+{
+  eta = (1 - pow(2.0 / n, 1 - theta)) / (1 - zeta2 / zetan);
+}
+
+//zeta(n) is a sum over 1..n, so growing only adds the new terms.
+void zipfian_generator::grow(uint64_t new_n)
+{
+  if (new_n <= n)
+    return;
+  zetan += zeta(n, new_n, theta);
+  n = new_n;
+  update_constants();
+}
+
+uint64_t zipfian_generator::next(std::mt19937_64 &rng)
+{
+  double u = std::uniform_real_distribution<double>(0.0, 1.0)(rng);
+  double uz = u * zetan;
+  if (uz < 1.0)
+    return 0;
+  if (uz < 1.0 + pow(0.5, theta))
+    return n > 1 ? 1 : 0;
+  uint64_t result = n * pow(eta * u - eta + 1, alpha);
+  return result < n ? result : n - 1;
+}
+
+//the splitmix64 finalizer: a bijection, so distinct records never
+//share a key.
+static uint64_t mix64(uint64_t x)
+{
+  x += 0x9e3779b97f4a7c15ULL;
+  x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9ULL;
+  x = (x ^ (x >> 27)) * 0x94d049bb133111ebULL;
+  return x ^ (x >> 31);
+}
+
+uint64_t workload::record_key(uint64_t record)
+{
+  return mix64(record);
+}
+
+bool workload::set_mix(const char *name)
+{
+  static const int mixes[6][WOP_TYPES] = {
+    //read, update, insert, scan, read-modify-write
+    { 50, 50, 0, 0, 0 },
+    { 95, 5, 0, 0, 0 },
+    { 100, 0, 0, 0, 0 },
+    { 95, 0, 5, 0, 0 },
+    { 0, 0, 5, 95, 0 },
+    { 50, 0, 0, 0, 50 },
+  };
+  if (strlen(name) != 1)
+    return false;
+  int w = tolower(name[0]) - 'a';
+  if (w < 0 || w >= 6)
+    return false;
+  memcpy(percent, mixes[w], sizeof(percent));
+  distribution = w == 3 ? DIST_LATEST : DIST_ZIPFIAN;
+  return true;
+}
+
+bool workload::parse_distribution(const char *name, workload_distribution &result)
+{
+  for (int d = DIST_UNIFORM; d <= DIST_SKEW_NORMAL; d++)
+    if (strcmp(name, distribution_name((workload_distribution)d)) == 0)
+    {
+      result = (workload_distribution)d;
+      return true;
+    }
+  return false;
+}
+
+const char *workload::distribution_name(workload_distribution d)
+{
+  static const char *names[] = { "uniform", "zipfian", "latest", "skewnormal" };
+  return names[d];
+}
+
+const char *workload::op_name(int type)
+{
+  static const char *names[WOP_TYPES] = { "read", "update", "insert", "scan", "rmw" };
+  return names[type];
+}
+
+std::vector<uint64_t> workload::load_keys(uint64_t record_count)
+{
+  std::vector<uint64_t> keys(record_count);
+  for (uint64_t i = 0; i < record_count; i++)
+    keys[i] = record_key(i);
+  return keys;
+}
+
+std::vector<workload_op> workload::generate(uint64_t record_count, uint64_t nops, uint64_t seed) const
+{
+  assert(record_count > 0);
+  int total = 0;
+  for (int i = 0; i < WOP_TYPES; i++)
+    total += percent[i];
+  assert(total == 100);
+
+  std::mt19937_64 rng(seed);
+  std::uniform_int_distribution<int> pick_op(0, 99);
+  std::uniform_int_distribution<uint32_t> pick_length(1, DEFAULT_WORKLOAD_MAX_SCAN_LENGTH);
+  std::normal_distribution<double> normal(0.0, 1.0);
+  zipfian_generator zipf(record_count);
+  double delta = DEFAULT_SKEW_NORMAL_SHAPE / sqrt(1 + DEFAULT_SKEW_NORMAL_SHAPE * DEFAULT_SKEW_NORMAL_SHAPE);
+  uint64_t count = record_count;
+
+  std::vector<workload_op> ops(nops);
+  for (uint64_t i = 0; i < nops; i++)
+  {
+    workload_op &op = ops[i];
+    int p = pick_op(rng);
+    op.type = 0;
+    while (p >= percent[op.type])
+      p -= percent[op.type++];
+    op.length = op.type == WOP_SCAN ? pick_length(rng) : 0;
+
+    if (op.type == WOP_INSERT)
+    {
+      op.key = record_key(count++);
+      if (distribution == DIST_LATEST)
+        zipf.grow(count);
+      continue;
+    }
+
+    uint64_t record = 0;
+    switch (distribution)
+    {
+    case DIST_UNIFORM:
+      record = std::uniform_int_distribution<uint64_t>(0, count - 1)(rng);
+      break;
+    case DIST_ZIPFIAN:
+      //rank 0 is the most popular; scatter the ranks over the records.
+      record = mix64(zipf.next(rng)) % count;
+      break;
+    case DIST_LATEST:
+      record = count - 1 - zipf.next(rng);
+      break;
+    case DIST_SKEW_NORMAL:
+    {
+      //Azzalini's construction of a skew-normal variate, centred on
+      //the middle record with a sixth of the records as its scale.
+      double u0 = normal(rng);
+      double v = normal(rng);
+      double z = delta * u0 + sqrt(1 - delta * delta) * v;
+      if (u0 < 0)
+        z = -z;
+      int64_t r = llround(count / 2.0 + z * count / 6.0) % (int64_t)count;
+      record = r < 0 ? r + count : r;
+      break;
+    }
+    }
+    op.key = record_key(record);
+  }
+  return ops;
+}
+
+const workload_phase &workload::phase(uint64_t i)
+{
+  static const workload_phase phases[] = {
+    { "write-heavy", 10, 10 },
+    { "read-heavy", 90, 90 },
+    { "hot-writes", 10, 90 },
+    { "hot-reads", 90, 10 },
+  };
+  return phases[i % (sizeof(phases) / sizeof(phases[0]))];
+}
+
+std::vector<workload_op> workload::generate_phase(const std::vector<uint64_t> &sorted_keys,
+                                                  const workload_phase &p,
+                                                  uint64_t nops, uint64_t seed)
+{
+  uint64_t hot = sorted_keys.size() * DEFAULT_PHASE_HOT_PERCENT / 100;
+  assert(0 < hot && hot < sorted_keys.size());
+
+  std::mt19937_64 rng(seed);
+  std::uniform_int_distribution<int> percent(0, 99);
+  std::uniform_int_distribution<uint64_t> hot_record(0, hot - 1);
+  std::uniform_int_distribution<uint64_t> cold_record(hot, sorted_keys.size() - 1);
+
+  std::vector<workload_op> ops(nops);
+  for (uint64_t i = 0; i < nops; i++)
+  {
+    workload_op &op = ops[i];
+    bool in_hot = percent(rng) < DEFAULT_PHASE_HOT_TRAFFIC;
+    int read_percent = in_hot ? p.hot_read_percent : p.cold_read_percent;
+    op.type = percent(rng) < read_percent ? WOP_READ : WOP_UPDATE;
+    op.length = 0;
+    op.key = sorted_keys[in_hot ? hot_record(rng) : cold_record(rng)];
+  }
+  return ops;
+}
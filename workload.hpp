@@ -0,0 +1,138 @@
+// YCSB-style workloads generated in memory.
+//
+// A workload is a load phase, which inserts record_count records, and
+// a run phase of operations drawn from one of the YCSB core mixes:
+//
+//   A: 50% read, 50% update
+//   B: 95% read, 5% update
+//   C: 100% read
+//   D: 95% read, 5% insert, reads favouring recent inserts
+//   E: 95% short scan, 5% insert
+//   F: 50% read, 50% read-modify-write
+//
+// Record i has key record_key(i), a hash of i, so inserts land all
+// over the key space rather than at its end.  Which record an
+// operation touches is drawn from the chosen distribution over the
+// records inserted so far: uniform, Zipfian (scrambled, so the popular
+// records are spread out), latest (Zipfian over the newest records
+// first) or skew-normal (as generate_keys.py made for skewed_keys.txt).
+//
+// generate() produces the whole operation list before anything is
+// timed, so a benchmark loop over it measures the tree and nothing
+// else.
+//
+// Phase-shifting workloads, for watching the tree adapt, are a
+// sequence of phases of reads and updates to existing records, each
+// with its own mix (see workload_phase).
+
+#ifndef WORKLOAD_HPP
+#define WORKLOAD_HPP
+
+#include <cstdint>
+#include <vector>
+#include <random>
+
+// Skew of the Zipfian distributions, as in YCSB.
+#define DEFAULT_ZIPFIAN_THETA (0.99)
+// Shape of the skew-normal distribution, as in generate_keys.py.
+#define DEFAULT_SKEW_NORMAL_SHAPE (2.0)
+// Scans are uniformly 1 to this many records long.
+#define DEFAULT_WORKLOAD_MAX_SCAN_LENGTH (100)
+// In phase-shifting workloads, the hot range is this percentage of the
+// records (the lowest keys) and gets this percentage of operations.
+#define DEFAULT_PHASE_HOT_PERCENT (20)
+#define DEFAULT_PHASE_HOT_TRAFFIC (80)
+
+enum workload_distribution
+{
+  DIST_UNIFORM,
+  DIST_ZIPFIAN,
+  DIST_LATEST,
+  DIST_SKEW_NORMAL
+};
+
+enum workload_op_type
+{
+  WOP_READ,
+  WOP_UPDATE,
+  WOP_INSERT,
+  WOP_SCAN,
+  WOP_READ_MODIFY_WRITE,
+  WOP_TYPES
+};
+
+class workload_op
+{
+public:
+  uint8_t type;
+  // Records to scan, for WOP_SCAN.
+  uint32_t length;
+  uint64_t key;
+};
+
+// Draws Zipfian-distributed ranks in [0, n) with the method of Gray et
+// al., "Quickly generating billion-record synthetic databases", as
+// YCSB does.  n may grow as records are inserted.
+class zipfian_generator
+{
+public:
+  zipfian_generator(uint64_t n, double theta = DEFAULT_ZIPFIAN_THETA);
+
+  uint64_t next(std::mt19937_64 &rng);
+  void grow(uint64_t new_n);
+
+private:
+  void update_constants(void);
+
+  uint64_t n;
+  double theta;
+  double alpha;
+  double zeta2;
+  double zetan;
+  double eta;
+};
+
+// One phase of a phase-shifting workload: the percentage of reads,
+// the rest being updates, in the hot and cold key ranges.
+class workload_phase
+{
+public:
+  const char *name;
+  int hot_read_percent;
+  int cold_read_percent;
+};
+
+class workload
+{
+public:
+  // Percentages of each operation type, summing to 100.
+  int percent[WOP_TYPES];
+  workload_distribution distribution;
+
+  // The core workload called name ("a" to "f", either case), with its
+  // usual distribution.  Returns false if there is no such workload.
+  bool set_mix(const char *name);
+  // Parse "uniform", "zipfian", "latest" or "skewnormal".
+  static bool parse_distribution(const char *name, workload_distribution &result);
+  static const char *distribution_name(workload_distribution d);
+  static const char *op_name(int type);
+
+  static uint64_t record_key(uint64_t record);
+
+  // The keys of the load phase, in insertion order.
+  static std::vector<uint64_t> load_keys(uint64_t record_count);
+  // nops run-phase operations over a database of record_count records.
+  std::vector<workload_op> generate(uint64_t record_count, uint64_t nops, uint64_t seed) const;
+
+  // The i-th phase of the phase-shifting schedule, which cycles
+  // through write-heavy, read-heavy, hot-writes (hot range write-heavy,
+  // cold range read-heavy) and hot-reads (the reverse).
+  static const workload_phase &phase(uint64_t i);
+  // nops operations of phase p on the records whose keys, in order,
+  // are sorted_keys.  Operations pick uniformly within a range.
+  static std::vector<workload_op> generate_phase(const std::vector<uint64_t> &sorted_keys,
+                                                 const workload_phase &p,
+                                                 uint64_t nops, uint64_t seed);
+};
+
+#endif // WORKLOAD_HPP
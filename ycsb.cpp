@@ -0,0 +1,690 @@
+// A YCSB-style benchmark for the betree.
+//
+// It loads -r records and then runs -t operations from one of the
+// YCSB core workloads (see workload.hpp), printing the time and
+// throughput of each phase, then the latencies of the run phase and
+// the tree's I/O (over both phases) and shape.  Every key and
+// operation is generated before the clock starts.
+//
+// YCSB's update overwrites the record, so updates here are
+// betree::insert()s rather than betree::update()s (which append to
+// the value).  A read-modify-write is a query followed by an insert.
+//
+// With -m phases it instead runs a phase-shifting workload (see
+// workload::phase()) on an adaptive tree and on trees with each of the
+// fixed epsilons given with -E, each in its own subdirectory of the
+// backing store directory.  For every tree and phase it prints the
+// throughput, the time to adapt (until the first of
+// DEFAULT_PHASE_WINDOWS slices of the phase to reach
+// DEFAULT_PHASE_ADAPTED of the throughput of the phase's last quarter),
+// disk I/O per operation and the tree's mean epsilon at the end of the
+// phase, and then a table of throughput by phase and tree.
+//
+// With -m compare it runs the YCSB workload on each engine (see
+// kv_engine.hpp) in turn: a plain B+-tree, betrees with each of the
+// fixed epsilons and an adaptive betree, each in its own subdirectory
+// and with its own swap space of -C nodes.  It times every operation
+// itself, so all engines are measured the same way, and ends with
+// tables of throughput, latency by operation type, I/O per operation
+// and heap use, one row per engine.  Phases mode runs the B+-tree too.
+//
+// ycsb and compare modes also report the heap (see alloc_stats.hpp):
+// allocations per operation of the run phase by category, and the
+// node heap divided by the number of nodes in the cache.
+
+#include <string.h>
+#include <sys/types.h>
+#include <sys/time.h>
+#include <sys/stat.h>
+#include <errno.h>
+#include <unistd.h>
+#include "kv_engine.hpp"
+#include "workload.hpp"
+#include "trace.hpp"
+
+void timer_start(uint64_t &timer)
+{
+  struct timeval t;
+  int r = gettimeofday(&t, NULL);
+  assert(r == 0);
+  (void)r;
+  timer -= 1000000 * t.tv_sec + t.tv_usec;
+}
+
+void timer_stop(uint64_t &timer)
+{
+  struct timeval t;
+  int r = gettimeofday(&t, NULL);
+  assert(r == 0);
+  (void)r;
+  timer += 1000000 * t.tv_sec + t.tv_usec;
+}
+
+#define DEFAULT_YCSB_MAX_NODE_SIZE (1ULL << 6)
+#define DEFAULT_YCSB_MIN_FLUSH_SIZE (DEFAULT_YCSB_MAX_NODE_SIZE / 4)
+#define DEFAULT_YCSB_CACHE_SIZE (1000)
+#define DEFAULT_YCSB_RECORDS (100000)
+#define DEFAULT_YCSB_NOPS (100000)
+#define DEFAULT_YCSB_VALUE_SIZE (100)
+#define DEFAULT_YCSB_EPSILON (0.4)
+#define DEFAULT_YCSB_PHASES (8)
+#define DEFAULT_YCSB_FIXED_EPSILONS "0.2,0.5,0.8"
+#define DEFAULT_PHASE_WINDOWS (20)
+#define DEFAULT_PHASE_ADAPTED (0.9)
+
+void usage(char *name)
+{
+  std::cout
+      << "Usage: " << name << " [OPTIONS]" << std::endl
+      << "Runs a YCSB core workload against the betree" << std::endl
+      << std::endl
+      << "Options are" << std::endl
+      << "  Required:" << std::endl
+      << "    -d <backing_store_directory>                    [ default: none, parameter is required ]" << std::endl
+      << "    -m <mode>                     (ycsb, phases or compare) [ default: ycsb ]" << std::endl
+      << "  Workload options:" << std::endl
+      << "    -w <workload>                 (a to f)          [ default: a ]" << std::endl
+      << "    -D <distribution>             (uniform, zipfian, latest or skewnormal) [ default: the workload's ]" << std::endl
+      << "    -r <record_count>                               [ default: " << DEFAULT_YCSB_RECORDS << " ]" << std::endl
+      << "    -t <number_of_operations>     (per phase in phases mode) [ default: " << DEFAULT_YCSB_NOPS << " ]" << std::endl
+      << "    -p <phases>                   (phases mode)     [ default: " << DEFAULT_YCSB_PHASES << " ]" << std::endl
+      << "    -E <epsilon,epsilon,...>      (fixed-epsilon trees in phases and compare modes) [ default: " << DEFAULT_YCSB_FIXED_EPSILONS << " ]" << std::endl
+      << "    -v <value_size>               (in bytes)        [ default: " << DEFAULT_YCSB_VALUE_SIZE << " ]" << std::endl
+      << "    -s <random_seed>                                [ default: random ]" << std::endl
+      << "    -W <trace_file>               (record a timestamped trace, ycsb mode) [ default: none ]" << std::endl
+      << "  Betree tuning parameters:" << std::endl
+      << "    -N <max_node_size>            (in elements)     [ default: " << DEFAULT_YCSB_MAX_NODE_SIZE << " ]" << std::endl
+      << "    -f <min_flush_size>           (in elements)     [ default: " << DEFAULT_YCSB_MIN_FLUSH_SIZE << " ]" << std::endl
+      << "    -C <max_cache_size>           (in betree nodes) [ default: " << DEFAULT_YCSB_CACHE_SIZE << " ]" << std::endl
+      << "    -e <starting_epsilon>                           [ default: " << DEFAULT_YCSB_EPSILON << " ]" << std::endl
+      << "    -a                            (adapt epsilon per node) [ default: off ]" << std::endl
+      << "    -M <maintenance_threads>      (background flushes) [ default: 0 (off) ]" << std::endl
+      << "    -Q                            (optimistic lock-free queries) [ default: off ]" << std::endl;
+}
+
+// Returns the throughput.
+double load(kv_engine &b,
+            const std::vector<uint64_t> &keys,
+            const std::string &value)
+{
+  uint64_t timer = 0;
+  timer_start(timer);
+  for (auto it = keys.begin(); it != keys.end(); ++it)
+    b.insert(*it, value);
+  timer_stop(timer);
+
+  double throughput = (1.0 * keys.size() * 1000000) / timer;
+  printf("# load: %lu %lu %f\n", (unsigned long)keys.size(), (unsigned long)timer, throughput);
+  return throughput;
+}
+
+// Returns the number of records read: 0 or 1, or the length of a scan.
+uint64_t do_op(kv_engine &b,
+               const workload_op &op,
+               const std::string &value)
+{
+  uint64_t found = 0;
+  switch (op.type)
+  {
+  case WOP_READ:
+  case WOP_READ_MODIFY_WRITE:
+    found = b.query(op.key);
+    if (op.type == WOP_READ_MODIFY_WRITE)
+      b.insert(op.key, value);
+    break;
+  case WOP_UPDATE:
+  case WOP_INSERT:
+    b.insert(op.key, value);
+    break;
+  case WOP_SCAN:
+    found = b.scan(op.key, op.length);
+    break;
+  }
+  return found;
+}
+
+// Run ops and return the throughput.  If latencies is not NULL, time
+// every operation into latencies[op.type].
+double run(kv_engine &b,
+           const std::vector<workload_op> &ops,
+           const std::string &value,
+           latency_histogram *latencies = NULL)
+{
+  uint64_t counts[WOP_TYPES] = { 0 };
+  uint64_t missing = 0;
+  uint64_t scanned = 0;
+
+  uint64_t timer = 0;
+  timer_start(timer);
+  for (auto op = ops.begin(); op != ops.end(); ++op)
+  {
+    counts[op->type]++;
+    uint64_t found;
+    {
+      latency_timer op_timer(latencies ? &latencies[op->type] : NULL);
+      found = do_op(b, *op, value);
+    }
+    if (op->type == WOP_SCAN)
+      scanned += found;
+    else if (op->type == WOP_READ || op->type == WOP_READ_MODIFY_WRITE)
+      missing += !found;
+  }
+  timer_stop(timer);
+
+  double throughput = (1.0 * ops.size() * 1000000) / timer;
+  printf("# run: %lu %lu %f\n", (unsigned long)ops.size(), (unsigned long)timer, throughput);
+  for (int i = 0; i < WOP_TYPES; i++)
+    if (counts[i])
+      printf("# %s: %lu\n", workload::op_name(i), (unsigned long)counts[i]);
+  if (counts[WOP_SCAN])
+    printf("# records scanned: %lu\n", (unsigned long)scanned);
+  if (missing)
+    printf("# reads that found nothing: %lu\n", (unsigned long)missing);
+  return throughput;
+}
+
+// Run each phase in turn, printing one line per phase, and return the
+// throughput of each.
+std::vector<double> run_phases(kv_engine &b,
+                               swap_space &sspace,
+                               const std::string &name,
+                               const std::vector<std::vector<workload_op>> &phases,
+                               const std::string &value)
+{
+  std::vector<double> throughputs;
+  for (uint64_t p = 0; p < phases.size(); p++)
+  {
+    const std::vector<workload_op> &ops = phases[p];
+    swap_space::io_stats before = sspace.get_io_stats();
+
+    uint64_t window_timers[DEFAULT_PHASE_WINDOWS] = { 0 };
+    uint64_t window_ops[DEFAULT_PHASE_WINDOWS] = { 0 };
+    uint64_t i = 0;
+    for (int w = 0; w < DEFAULT_PHASE_WINDOWS; w++)
+    {
+      uint64_t end = ops.size() * (w + 1) / DEFAULT_PHASE_WINDOWS;
+      window_ops[w] = end - i;
+      timer_start(window_timers[w]);
+      for (; i < end; i++)
+        do_op(b, ops[i], value);
+      timer_stop(window_timers[w]);
+    }
+    b.wait_for_maintenance();
+
+    swap_space::io_stats after = sspace.get_io_stats();
+    uint64_t timer = 0;
+    for (int w = 0; w < DEFAULT_PHASE_WINDOWS; w++)
+      timer += window_timers[w];
+
+    //steady state is the last quarter of the phase.
+    uint64_t steady_ops = 0;
+    uint64_t steady_timer = 0;
+    for (int w = DEFAULT_PHASE_WINDOWS * 3 / 4; w < DEFAULT_PHASE_WINDOWS; w++)
+    {
+      steady_ops += window_ops[w];
+      steady_timer += window_timers[w];
+    }
+    double steady = steady_timer ? (1.0 * steady_ops * 1000000) / steady_timer : 0.0;
+    uint64_t adapt_timer = 0;
+    for (int w = 0; w < DEFAULT_PHASE_WINDOWS; w++)
+    {
+      adapt_timer += window_timers[w];
+      if (window_timers[w] == 0 ||
+          (1.0 * window_ops[w] * 1000000) / window_timers[w] >= DEFAULT_PHASE_ADAPTED * steady)
+        break;
+    }
+
+    double nops = ops.size() ? ops.size() : 1;
+    double throughput = timer ? (1.0 * ops.size() * 1000000) / timer : 0.0;
+    throughputs.push_back(throughput);
+    printf("%lu %s %s %lu %lu %f %lu %f %f %f %f\n",
+           (unsigned long)p, workload::phase(p).name, name.c_str(),
+           (unsigned long)ops.size(), (unsigned long)timer, throughput,
+           (unsigned long)adapt_timer,
+           (after.disk_reads - before.disk_reads) / nops,
+           (after.disk_writes - before.disk_writes) / nops,
+           (after.disk_bytes_written - before.disk_bytes_written) / nops,
+           b.mean_epsilon());
+  }
+  return throughputs;
+}
+
+// The subdirectory of backing_store_dir for engine e's nodes.
+std::string engine_dir(const char *backing_store_dir, const engine_config &e)
+{
+  std::string dir = std::string(backing_store_dir) + "/" + e.name;
+  if (mkdir(dir.c_str(), 0755) < 0 && errno != EEXIST)
+  {
+    perror(dir.c_str());
+    exit(1);
+  }
+  return dir;
+}
+
+void benchmark_phases(const std::vector<engine_config> &engines,
+                      const char *backing_store_dir,
+                      uint64_t cache_size,
+                      const std::vector<uint64_t> &keys,
+                      const std::vector<std::vector<workload_op>> &phases,
+                      const std::string &value)
+{
+  std::vector<std::vector<double>> throughputs;
+  printf("# phase name tree ops usecs throughput adapt_usecs disk_reads/op disk_writes/op bytes_written/op mean_epsilon\n");
+  for (auto e = engines.begin(); e != engines.end(); ++e)
+  {
+    one_file_per_object_backing_store ofpobs(engine_dir(backing_store_dir, *e));
+    swap_space sspace(&ofpobs, cache_size);
+    std::unique_ptr<kv_engine> b(kv_engine::create(*e, &sspace));
+
+    printf("# %s\n", e->name.c_str());
+    load(*b, keys, value);
+    b->wait_for_maintenance();
+    throughputs.push_back(run_phases(*b, sspace, e->name, phases, value));
+  }
+
+  printf("# throughput by phase\n");
+  printf("# %-5s %-12s", "phase", "name");
+  for (auto e = engines.begin(); e != engines.end(); ++e)
+    printf(" %12s", e->name.c_str());
+  printf("\n");
+  for (uint64_t p = 0; p < phases.size(); p++)
+  {
+    printf("# %-5lu %-12s", (unsigned long)p, workload::phase(p).name);
+    for (uint64_t e = 0; e < engines.size(); e++)
+      printf(" %12.0f", throughputs[e][p]);
+    printf("\n");
+  }
+}
+
+// Heap charged to nodes per node in the cache, or 0 if none are.
+double node_bytes_per_node(swap_space &sspace, const alloc_stats &heap)
+{
+  uint64_t nodes = sspace.get_cache_stats().in_memory_objects;
+  return nodes ? (double)heap.categories[ALLOC_NODE].current_bytes / nodes : 0.0;
+}
+
+// What one engine did in compare mode.
+class engine_result
+{
+public:
+  double load_throughput;
+  double run_throughput;
+  latency_histogram latencies[WOP_TYPES];
+  // I/O of the run phase.
+  swap_space::io_stats io;
+  // Heap at the start and the end of the run phase.  The peaks are
+  // over both phases.
+  alloc_stats heap_before;
+  alloc_stats heap_after;
+  double node_bytes;
+};
+
+void benchmark_compare(const std::vector<engine_config> &engines,
+                       const char *backing_store_dir,
+                       uint64_t cache_size,
+                       const std::vector<uint64_t> &keys,
+                       const std::vector<workload_op> &ops,
+                       const std::string &value)
+{
+  std::vector<std::unique_ptr<engine_result>> results;
+  for (auto e = engines.begin(); e != engines.end(); ++e)
+  {
+    one_file_per_object_backing_store ofpobs(engine_dir(backing_store_dir, *e));
+    swap_space sspace(&ofpobs, cache_size);
+    std::unique_ptr<kv_engine> b(kv_engine::create(*e, &sspace));
+    results.push_back(std::unique_ptr<engine_result>(new engine_result()));
+    engine_result &r = *results.back();
+
+    printf("# %s\n", e->name.c_str());
+    alloc_stats::reset_peaks();
+    r.load_throughput = load(*b, keys, value);
+    b->wait_for_maintenance();
+    swap_space::io_stats before = sspace.get_io_stats();
+    r.heap_before = alloc_stats::get();
+    r.run_throughput = run(*b, ops, value, r.latencies);
+    b->wait_for_maintenance();
+    r.heap_after = alloc_stats::get();
+    r.node_bytes = node_bytes_per_node(sspace, r.heap_after);
+    swap_space::io_stats after = sspace.get_io_stats();
+    r.io.node_loads = after.node_loads - before.node_loads;
+    r.io.write_backs = after.write_backs - before.write_backs;
+    r.io.disk_reads = after.disk_reads - before.disk_reads;
+    r.io.disk_writes = after.disk_writes - before.disk_writes;
+    r.io.disk_bytes_written = after.disk_bytes_written - before.disk_bytes_written;
+  }
+
+  double nops = ops.size() ? ops.size() : 1;
+  printf("# throughput\n");
+  printf("# %-14s %12s %12s\n", "engine", "load", "run");
+  for (uint64_t e = 0; e < engines.size(); e++)
+    printf("# %-14s %12.0f %12.0f\n", engines[e].name.c_str(),
+           results[e]->load_throughput, results[e]->run_throughput);
+
+  printf("# run latency (us)\n");
+  for (int t = 0; t < WOP_TYPES; t++)
+  {
+    if (results.empty() || results[0]->latencies[t].count() == 0)
+      continue;
+    printf("# %s\n", workload::op_name(t));
+    latency_histogram::print_header(stdout);
+    for (uint64_t e = 0; e < engines.size(); e++)
+      results[e]->latencies[t].print(stdout, engines[e].name.c_str(), 1000.0);
+  }
+
+  printf("# run I/O per operation\n");
+  printf("# %-14s %12s %12s %12s %12s %14s\n", "engine", "node_loads", "write_backs",
+         "disk_reads", "disk_writes", "bytes_written");
+  for (uint64_t e = 0; e < engines.size(); e++)
+  {
+    const swap_space::io_stats &io = results[e]->io;
+    printf("# %-14s %12.3f %12.3f %12.3f %12.3f %14.1f\n", engines[e].name.c_str(),
+           io.node_loads / nops, io.write_backs / nops, io.disk_reads / nops,
+           io.disk_writes / nops, io.disk_bytes_written / nops);
+  }
+
+  printf("# heap\n");
+  printf("# %-14s %12s %12s %14s %14s %14s\n", "engine", "allocs/op", "bytes/op",
+         "peak_node", "peak_total", "bytes/node");
+  for (uint64_t e = 0; e < engines.size(); e++)
+  {
+    const alloc_counts &before = results[e]->heap_before.total;
+    const alloc_stats &after = results[e]->heap_after;
+    printf("# %-14s %12.2f %12.1f %14ld %14ld %14.0f\n", engines[e].name.c_str(),
+           (after.total.allocations - before.allocations) / nops,
+           (after.total.bytes_allocated - before.bytes_allocated) / nops,
+           (long)after.categories[ALLOC_NODE].peak_bytes, (long)after.total.peak_bytes,
+           results[e]->node_bytes);
+  }
+}
+
+int main(int argc, char **argv)
+{
+  const char *mode = "ycsb";
+  char *backing_store_dir = NULL;
+  const char *workload_name = "a";
+  char *distribution_name = NULL;
+  uint64_t record_count = DEFAULT_YCSB_RECORDS;
+  uint64_t nops = DEFAULT_YCSB_NOPS;
+  uint64_t value_size = DEFAULT_YCSB_VALUE_SIZE;
+  unsigned int random_seed = time(NULL) * getpid();
+  uint64_t max_node_size = DEFAULT_YCSB_MAX_NODE_SIZE;
+  uint64_t min_flush_size = DEFAULT_YCSB_MIN_FLUSH_SIZE;
+  uint64_t cache_size = DEFAULT_YCSB_CACHE_SIZE;
+  float starting_epsilon = DEFAULT_YCSB_EPSILON;
+  bool is_dynamic = false;
+  uint64_t maintenance_threads = 0;
+  bool optimistic_reads = false;
+  uint64_t nphases = DEFAULT_YCSB_PHASES;
+  const char *fixed_epsilons = DEFAULT_YCSB_FIXED_EPSILONS;
+  char *trace_file = NULL;
+
+  int opt;
+  char *term;
+
+  //////////////////////
+  // Argument parsing //
+  //////////////////////
+
+  while ((opt = getopt(argc, argv, "m:d:w:D:r:t:p:E:v:s:N:f:C:e:aM:QW:")) != -1)
+  {
+    switch (opt)
+    {
+    case 'm':
+      mode = optarg;
+      break;
+    case 'd':
+      backing_store_dir = optarg;
+      break;
+    case 'w':
+      workload_name = optarg;
+      break;
+    case 'D':
+      distribution_name = optarg;
+      break;
+    case 'r':
+      record_count = strtoull(optarg, &term, 10);
+      if (*term || record_count == 0)
+      {
+        std::cerr << "Argument to -r must be a positive integer" << std::endl;
+        usage(argv[0]);
+        exit(1);
+      }
+      break;
+    case 't':
+      nops = strtoull(optarg, &term, 10);
+      if (*term)
+      {
+        std::cerr << "Argument to -t must be an integer" << std::endl;
+        usage(argv[0]);
+        exit(1);
+      }
+      break;
+    case 'p':
+      nphases = strtoull(optarg, &term, 10);
+      if (*term || nphases == 0)
+      {
+        std::cerr << "Argument to -p must be a positive integer" << std::endl;
+        usage(argv[0]);
+        exit(1);
+      }
+      break;
+    case 'E':
+      fixed_epsilons = optarg;
+      break;
+    case 'v':
+      value_size = strtoull(optarg, &term, 10);
+      if (*term)
+      {
+        std::cerr << "Argument to -v must be an integer" << std::endl;
+        usage(argv[0]);
+        exit(1);
+      }
+      break;
+    case 's':
+      random_seed = strtoull(optarg, &term, 10);
+      if (*term)
+      {
+        std::cerr << "Argument to -s must be an integer" << std::endl;
+        usage(argv[0]);
+        exit(1);
+      }
+      break;
+    case 'N':
+      max_node_size = strtoull(optarg, &term, 10);
+      if (*term)
+      {
+        std::cerr << "Argument to -N must be an integer" << std::endl;
+        usage(argv[0]);
+        exit(1);
+      }
+      break;
+    case 'f':
+      min_flush_size = strtoull(optarg, &term, 10);
+      if (*term)
+      {
+        std::cerr << "Argument to -f must be an integer" << std::endl;
+        usage(argv[0]);
+        exit(1);
+      }
+      break;
+    case 'C':
+      cache_size = strtoull(optarg, &term, 10);
+      if (*term)
+      {
+        std::cerr << "Argument to -C must be an integer" << std::endl;
+        usage(argv[0]);
+        exit(1);
+      }
+      break;
+    case 'e':
+      starting_epsilon = strtof(optarg, &term);
+      if (*term || starting_epsilon <= 0 || starting_epsilon > 1)
+      {
+        std::cerr << "Argument to -e must be a number in (0, 1]" << std::endl;
+        usage(argv[0]);
+        exit(1);
+      }
+      break;
+    case 'a':
+      is_dynamic = true;
+      break;
+    case 'M':
+      maintenance_threads = strtoull(optarg, &term, 10);
+      if (*term)
+      {
+        std::cerr << "Argument to -M must be an integer" << std::endl;
+        usage(argv[0]);
+        exit(1);
+      }
+      break;
+    case 'Q':
+      optimistic_reads = true;
+      break;
+    case 'W':
+      trace_file = optarg;
+      break;
+    default:
+      std::cerr << "Unknown option '" << (char)opt << "'" << std::endl;
+      usage(argv[0]);
+      exit(1);
+    }
+  }
+
+  workload w;
+  if (!w.set_mix(workload_name))
+  {
+    std::cerr << "Unknown workload '" << workload_name << "'" << std::endl;
+    usage(argv[0]);
+    exit(1);
+  }
+  if (distribution_name && !workload::parse_distribution(distribution_name, w.distribution))
+  {
+    std::cerr << "Unknown distribution '" << distribution_name << "'" << std::endl;
+    usage(argv[0]);
+    exit(1);
+  }
+
+  if (strcmp(mode, "ycsb") != 0 && strcmp(mode, "phases") != 0 && strcmp(mode, "compare") != 0)
+  {
+    std::cerr << "Unknown mode '" << mode << "'" << std::endl;
+    usage(argv[0]);
+    exit(1);
+  }
+
+  if (backing_store_dir == NULL)
+  {
+    std::cerr << "-d <backing_store_directory> is required" << std::endl;
+    usage(argv[0]);
+    exit(1);
+  }
+
+  engine_config base;
+  base.type = ENGINE_BETREE;
+  base.is_dynamic = is_dynamic;
+  base.epsilon = starting_epsilon;
+  base.max_node_size = max_node_size;
+  base.min_flush_size = min_flush_size;
+  base.maintenance_threads = maintenance_threads;
+  base.optimistic_reads = optimistic_reads;
+
+  // The engines of phases and compare modes: the adaptive betree, a
+  // betree for each fixed epsilon, and the B+-tree.
+  std::vector<engine_config> engines;
+  if (strcmp(mode, "ycsb") != 0)
+  {
+    if (trace_file)
+    {
+      std::cerr << "Can only record a trace in ycsb mode" << std::endl;
+      usage(argv[0]);
+      exit(1);
+    }
+    char name[64];
+    engine_config e = base;
+    sprintf(name, "adaptive-%g", starting_epsilon);
+    e.name = name;
+    e.is_dynamic = true;
+    engines.push_back(e);
+    for (const char *f = fixed_epsilons; *f; f = *term ? term + 1 : term)
+    {
+      float eps = strtof(f, &term);
+      if (term == f || (*term && *term != ',') || eps <= 0 || eps > 1)
+      {
+        std::cerr << "Argument to -E must be a list of numbers in (0, 1]" << std::endl;
+        usage(argv[0]);
+        exit(1);
+      }
+      sprintf(name, "fixed-%g", eps);
+      e.name = name;
+      e.is_dynamic = false;
+      e.epsilon = eps;
+      engines.push_back(e);
+    }
+    e.name = "bplus-tree";
+    e.type = ENGINE_BPLUS_TREE;
+    engines.push_back(e);
+  }
+
+  if (strcmp(mode, "phases") == 0)
+  {
+    std::vector<uint64_t> keys = workload::load_keys(record_count);
+    std::vector<uint64_t> sorted_keys = keys;
+    std::sort(sorted_keys.begin(), sorted_keys.end());
+    std::vector<std::vector<workload_op>> phases;
+    for (uint64_t p = 0; p < nphases; p++)
+      phases.push_back(workload::generate_phase(sorted_keys, workload::phase(p), nops, random_seed + p));
+    std::string value(value_size, 'x');
+    printf("# phases: %lu records, %lu phases of %lu operations, seed %u\n",
+           (unsigned long)record_count, (unsigned long)nphases, (unsigned long)nops, random_seed);
+
+    benchmark_phases(engines, backing_store_dir, cache_size, keys, phases, value);
+    return 0;
+  }
+
+  ////////////////////////////////////////////////////
+  // Generate the workload, then load and run it    //
+  ////////////////////////////////////////////////////
+
+  std::vector<uint64_t> keys = workload::load_keys(record_count);
+  std::vector<workload_op> ops = w.generate(record_count, nops, random_seed);
+  std::string value(value_size, 'x');
+  printf("# workload %s, %s distribution, %lu records, %lu operations, seed %u\n",
+         workload_name, workload::distribution_name(w.distribution),
+         (unsigned long)record_count, (unsigned long)nops, random_seed);
+
+  if (strcmp(mode, "compare") == 0)
+  {
+    benchmark_compare(engines, backing_store_dir, cache_size, keys, ops, value);
+    return 0;
+  }
+
+  one_file_per_object_backing_store ofpobs(backing_store_dir);
+  swap_space sspace(&ofpobs, cache_size);
+  betree_engine e(base, &sspace);
+  betree<uint64_t, std::string> &b = e.tree;
+  std::unique_ptr<trace_writer> trace;
+  if (trace_file)
+  {
+    trace.reset(new trace_writer(trace_file, true));
+    b.set_trace_hook([&trace](int opcode, const uint64_t &k, const std::string &v)
+                     { trace->record(opcode, k, v); });
+  }
+
+  load(e, keys, value);
+  b.wait_for_maintenance();
+
+  b.set_latency_tracking(true);
+  alloc_stats heap_before = alloc_stats::get();
+  run(e, ops, value);
+  b.wait_for_maintenance();
+  alloc_stats heap_after = alloc_stats::get();
+  b.print_latency(stdout);
+  b.print_io_stats(stdout);
+  heap_after.print_per_op(stdout, heap_before, ops.size());
+  heap_after.print(stdout);
+  printf("# node heap per cached node: %.0f\n", node_bytes_per_node(sspace, heap_after));
+  b.print_shape(stdout);
+  if (trace)
+    printf("# traced: %lu\n", (unsigned long)trace->size());
+
+  return 0;
+}